@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "alloc_count.h"
+
+#ifdef ENABLE_ALLOC_COUNT
+
+// glibc's own allocator, which the replacements below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/*
+ * Plain GCC atomics rather than SDL's: malloc runs before SDL is loaded and
+ * must not call into other libraries.
+ */
+static int64_t alloc_allocs;
+static int64_t alloc_bytes;
+
+static inline void alloc_count_add(size_t size) {
+    __atomic_fetch_add(&alloc_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    alloc_count_add(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    alloc_count_add(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count_add(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    alloc_count_add(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    alloc_count_add(size);
+    return __libc_memalign(alignment, size);
+}
+
+// av_malloc goes through here
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *ptr;
+
+    alloc_count_add(size);
+    ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+int alloc_count_enabled(void) {
+    return 1;
+}
+
+void alloc_count_snapshot(AllocCount *c) {
+    c->allocs = __atomic_load_n(&alloc_allocs, __ATOMIC_RELAXED);
+    c->bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+}
+
+#else
+
+int alloc_count_enabled(void) {
+    return 0;
+}
+
+void alloc_count_snapshot(AllocCount *c) {
+    memset(c, 0, sizeof(AllocCount));
+}
+
+#endif /* ENABLE_ALLOC_COUNT */
@@ -0,0 +1,20 @@
+#ifndef ALLOC_COUNT_H_
+#define ALLOC_COUNT_H_
+
+#include <stdint.h>
+
+/*
+ * Process-wide heap allocation counters, to check that steady-state playback
+ * does not allocate. Only built with ENABLE_ALLOC_COUNT (make ALLOC_COUNT=1),
+ * which replaces malloc and friends for the whole process, FFmpeg and SDL
+ * included. glibc only. Without it the counters stay 0.
+ */
+typedef struct AllocCount {
+    int64_t         allocs;         // malloc, calloc, realloc and aligned allocations
+    int64_t         bytes;          // Bytes requested by them
+} AllocCount;
+
+int alloc_count_enabled(void);
+void alloc_count_snapshot(AllocCount *c);
+
+#endif /* ALLOC_COUNT_H_ */
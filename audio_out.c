@@ -0,0 +1,330 @@
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+
+#include <SDL2/SDL.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#include "logging.h"
+#include "audio_out.h"
+
+
+static void interleave_scalar(uint32_t *dst, const uint32_t *const *src,
+                              int channels, int nb_samples) {
+    int i, ch;
+
+    if (channels == 1) {
+        memcpy(dst, src[0], nb_samples * sizeof(uint32_t));
+        return;
+    }
+
+    for (i = 0; i < nb_samples; i++)
+        for (ch = 0; ch < channels; ch++)
+            *dst++ = src[ch][i];
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void interleave_sse2(uint32_t *dst, const uint32_t *const *src,
+                            int channels, int nb_samples) {
+    const float *l = (const float *)src[0];
+    const float *r = (const float *)src[1];
+    float *out = (float *)dst;
+    __m128 a, b;
+    int i = 0;
+
+    if (channels != 2) {
+        interleave_scalar(dst, src, channels, nb_samples);
+        return;
+    }
+
+    // 4 frames per iteration: l0 r0 l1 r1 | l2 r2 l3 r3
+    for (; i + 4 <= nb_samples; i += 4) {
+        a = _mm_loadu_ps(l + i);
+        b = _mm_loadu_ps(r + i);
+        _mm_storeu_ps(out + 2*i,     _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps(out + 2*i + 4, _mm_unpackhi_ps(a, b));
+    }
+    for (; i < nb_samples; i++) {
+        out[2*i]     = l[i];
+        out[2*i + 1] = r[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void interleave_avx2(uint32_t *dst, const uint32_t *const *src,
+                            int channels, int nb_samples) {
+    const float *l = (const float *)src[0];
+    const float *r = (const float *)src[1];
+    float *out = (float *)dst;
+    __m256 a, b, lo, hi;
+    int i = 0;
+
+    if (channels != 2) {
+        interleave_scalar(dst, src, channels, nb_samples);
+        return;
+    }
+
+    // unpack works per 128 bit lane, so fix up the lane order afterwards
+    for (; i + 8 <= nb_samples; i += 8) {
+        a = _mm256_loadu_ps(l + i);
+        b = _mm256_loadu_ps(r + i);
+        lo = _mm256_unpacklo_ps(a, b);  // l0 r0 l1 r1 | l4 r4 l5 r5
+        hi = _mm256_unpackhi_ps(a, b);  // l2 r2 l3 r3 | l6 r6 l7 r7
+        _mm256_storeu_ps(out + 2*i,     _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(out + 2*i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    for (; i < nb_samples; i++) {
+        out[2*i]     = l[i];
+        out[2*i + 1] = r[i];
+    }
+}
+#endif
+
+static const AudioInterleaver kernel_scalar = { "scalar", interleave_scalar };
+#ifdef HAVE_X86_SIMD
+static const AudioInterleaver kernel_sse2 = { "sse2", interleave_sse2 };
+static const AudioInterleaver kernel_avx2 = { "avx2", interleave_avx2 };
+#endif
+
+static const AudioInterleaver *kernel = &kernel_scalar;
+
+/**
+ * Select the fastest interleave kernel supported by this CPU.
+ * Must be called before any audio thread is started.
+ */
+void audio_out_init(void) {
+    kernel = &kernel_scalar;
+#ifdef HAVE_X86_SIMD
+    if (SDL_HasAVX2())
+        kernel = &kernel_avx2;
+    else if (SDL_HasSSE2())
+        kernel = &kernel_sse2;
+#endif
+    LOG_DEBUG("Audio interleave kernel: %s", kernel->name);
+}
+
+const AudioInterleaver *audio_out_kernel(void) {
+    return kernel;
+}
+
+const AudioInterleaver *audio_out_kernel_scalar(void) {
+    return &kernel_scalar;
+}
+
+/**
+ * Interleave a decoded audio frame into one contiguous buffer
+ * @param frame decoded audio frame, planar or packed
+ * @param buf buffer reused between calls, grown with av_fast_malloc
+ * @param buf_size allocated size of buf
+ * @return number of bytes written to buf, negative on error
+ */
+int audio_out_interleave(AVFrame *frame, uint8_t **buf, unsigned int *buf_size) {
+    int bps, size, i, ch;
+    uint8_t *dst;
+
+    bps = av_get_bytes_per_sample(frame->format);
+    size = frame->nb_samples * frame->channels * bps;
+
+    av_fast_malloc(buf, buf_size, size);
+    if (!*buf) {
+        LOG_ERR("Could not allocate audio buffer");
+        return -1;
+    }
+
+    if (!av_sample_fmt_is_planar(frame->format)) {
+        memcpy(*buf, frame->data[0], size);
+        return size;
+    }
+
+    if (bps == 4) {
+        kernel->fn((uint32_t *)*buf, (const uint32_t *const *)frame->extended_data,
+                   frame->channels, frame->nb_samples);
+        return size;
+    }
+
+    dst = *buf;
+    for (i = 0; i < frame->nb_samples; i++) {
+        for (ch = 0; ch < frame->channels; ch++) {
+            memcpy(dst, frame->extended_data[ch] + bps*i, bps);
+            dst += bps;
+        }
+    }
+
+    return size;
+}
+
+/**
+ * Sample format of an SDL audio format, AV_SAMPLE_FMT_NONE for those
+ * libswresample cannot write (foreign byte order, unsigned 16 bit)
+ */
+enum AVSampleFormat audio_out_sample_fmt(SDL_AudioFormat format) {
+    switch (format) {
+        case AUDIO_U8:      return AV_SAMPLE_FMT_U8;
+        case AUDIO_S16SYS:  return AV_SAMPLE_FMT_S16;
+        case AUDIO_S32SYS:  return AV_SAMPLE_FMT_S32;
+        case AUDIO_F32SYS:  return AV_SAMPLE_FMT_FLT;
+        default:            return AV_SAMPLE_FMT_NONE;
+    }
+}
+
+/**
+ * Channel order SDL expects for a channel count
+ */
+static int64_t audio_out_layout(int channels) {
+    switch (channels) {
+        case 4:     return AV_CH_LAYOUT_QUAD;
+        case 6:     return AV_CH_LAYOUT_5POINT1;
+        case 7:     return AV_CH_LAYOUT_6POINT1;
+        case 8:     return AV_CH_LAYOUT_7POINT1;
+        default:    return av_get_default_channel_layout(channels);
+    }
+}
+
+/**
+ * Channel count to ask the device for: the stream's when SDL has an order
+ * for it, else the nearest one it has, swr remixes
+ */
+int audio_out_channels(int channels) {
+    static const int device_channels[] = { 2, 1, 2, 2, 4, 6, 6, 8, 8 };
+
+    if (channels <= 0 || channels >= sizeof(device_channels) / sizeof(device_channels[0]))
+        return channels > 0 ? 8 : 2;
+    return device_channels[channels];
+}
+
+static int64_t frame_layout(const AVFrame *frame) {
+    if (frame->channel_layout && av_get_channel_layout_nb_channels(frame->channel_layout) == frame->channels)
+        return frame->channel_layout;
+    return av_get_default_channel_layout(frame->channels);
+}
+
+/**
+ * Set a converter up for the spec a device was actually opened with
+ * @param c zeroed, or a converter used before
+ * @param spec as granted by SDL_OpenAudioDevice
+ */
+int audio_convert_init(AudioConverter *c, const SDL_AudioSpec *spec) {
+    audio_convert_free(c);
+    memset(c, 0, sizeof(AudioConverter));
+
+    c->out_format = audio_out_sample_fmt(spec->format);
+    if (c->out_format == AV_SAMPLE_FMT_NONE) {
+        LOG_ERR("Unsupported audio device format 0x%x", spec->format);
+        return -1;
+    }
+    c->out_channels = spec->channels;
+    c->out_layout = audio_out_layout(spec->channels);
+    c->out_rate = spec->freq;
+    c->in_format = AV_SAMPLE_FMT_NONE;
+
+    return 0;
+}
+
+void audio_convert_free(AudioConverter *c) {
+    swr_free(&c->swr);
+    av_freep(&c->buf);
+    c->buf_size = 0;
+}
+
+/**
+ * Convert a frame to the device format, into c->buf
+ * @param c converter set up with audio_convert_init
+ * @param frame decoded audio frame, any format, layout and rate
+ * @param wanted_samples input samples the frame should last for, frame->nb_samples
+ *        to play it as is
+ * @return number of bytes written to c->buf, negative on error
+ */
+int audio_convert_frame(AudioConverter *c, AVFrame *frame, int wanted_samples) {
+    int64_t layout = frame_layout(frame);
+    int out_count, out_size, len;
+
+    // Rebuilt only when the input changes, e.g. at a new stream or a
+    // mid-stream format change
+    if (c->swr && (frame->format != c->in_format || layout != c->in_layout
+                   || frame->sample_rate != c->in_rate))
+        swr_free(&c->swr);
+
+    // Already the device format, only interleave. Once swr is in use it
+    // stays, it may hold samples of a stretch still going on.
+    if (!c->swr && wanted_samples == frame->nb_samples && frame->sample_rate == c->out_rate
+            && layout == c->out_layout && av_get_packed_sample_fmt(frame->format) == c->out_format)
+        return audio_out_interleave(frame, &c->buf, &c->buf_size);
+
+    if (!c->swr) {
+        c->swr = swr_alloc_set_opts(NULL, c->out_layout, c->out_format, c->out_rate,
+                                    layout, frame->format, frame->sample_rate, 0, NULL);
+        if (!c->swr || swr_init(c->swr) < 0) {
+            LOG_ERR("Could not convert %d Hz %s %d channels to %d Hz %s %d channels",
+                    frame->sample_rate, av_get_sample_fmt_name(frame->format), frame->channels,
+                    c->out_rate, av_get_sample_fmt_name(c->out_format), c->out_channels);
+            swr_free(&c->swr);
+            return -1;
+        }
+        c->in_format = frame->format;
+        c->in_layout = layout;
+        c->in_rate = frame->sample_rate;
+        c->rebuilds++;
+        LOG_DEBUG("Audio conversion: %d Hz %s %d channels to %d Hz %s %d channels",
+                  frame->sample_rate, av_get_sample_fmt_name(frame->format), frame->channels,
+                  c->out_rate, av_get_sample_fmt_name(c->out_format), c->out_channels);
+    }
+
+    // Spread the difference over the frame, swr resamples it in so there is
+    // no click as when samples are dropped or repeated
+    if (wanted_samples != frame->nb_samples) {
+        if (swr_set_compensation(c->swr,
+                                 (int64_t)(wanted_samples - frame->nb_samples) * c->out_rate / frame->sample_rate,
+                                 (int64_t)wanted_samples * c->out_rate / frame->sample_rate) < 0)
+            LOG_WARN("Could not set audio rate compensation");
+        else
+            c->compensated++;
+    }
+
+    out_count = (int64_t)wanted_samples * c->out_rate / frame->sample_rate + 256;
+    out_size = av_samples_get_buffer_size(NULL, c->out_channels, out_count, c->out_format, 0);
+    if (out_size < 0)
+        return -1;
+    av_fast_malloc(&c->buf, &c->buf_size, out_size);
+    if (!c->buf) {
+        LOG_ERR("Could not allocate audio buffer");
+        return -1;
+    }
+
+    len = swr_convert(c->swr, &c->buf, out_count, (const uint8_t **)frame->extended_data, frame->nb_samples);
+    if (len < 0) {
+        LOG_ERR("Audio conversion failed: %s", av_err2str(len));
+        return -1;
+    }
+
+    return len * c->out_channels * av_get_bytes_per_sample(c->out_format);
+}
+
+/**
+ * Convert a frame and hand it to the audio device in a single call
+ * @param dev SDL audio device
+ * @param c converter set up for dev
+ * @param frame decoded audio frame
+ * @param wanted_samples see audio_convert_frame
+ */
+int audio_out_queue_frame(SDL_AudioDeviceID dev, AudioConverter *c, AVFrame *frame,
+                          int wanted_samples) {
+    int size;
+
+    size = audio_convert_frame(c, frame, wanted_samples);
+    if (size <= 0)
+        return size;
+
+    if (SDL_QueueAudio(dev, c->buf, size) < 0) {
+        LOG_ERR("SDL_QueueAudio: %s", SDL_GetError());
+        return -1;
+    }
+
+    return 0;
+}
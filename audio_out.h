@@ -0,0 +1,62 @@
+#ifndef AUDIO_OUT_H_
+#define AUDIO_OUT_H_
+
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+
+#include <SDL2/SDL.h>
+
+/*
+ * Planar -> interleaved kernel for 32 bit samples (float or s32).
+ * src holds one pointer per channel, dst receives channels * nb_samples values.
+ */
+typedef void (*interleave_fn)(uint32_t *dst, const uint32_t *const *src,
+                              int channels, int nb_samples);
+
+typedef struct AudioInterleaver {
+    const char      *name;
+    interleave_fn   fn;
+} AudioInterleaver;
+
+/*
+ * Turns decoded frames of any sample format, layout and rate into what the
+ * device was opened with. Frames already in the device format only get
+ * interleaved; the rest go through a SwrContext that is kept until the
+ * input format changes. Asking for more or fewer samples than the frame
+ * has stretches it slightly, for the sync code to steer audio with.
+ */
+typedef struct AudioConverter {
+    struct SwrContext *swr;         // NULL while frames need no resampling
+    enum AVSampleFormat in_format;  // What swr was built for
+    int64_t         in_layout;
+    int             in_rate;
+
+    enum AVSampleFormat out_format; // Device spec
+    int64_t         out_layout;
+    int             out_channels;
+    int             out_rate;
+
+    uint8_t         *buf;           // Interleaved device samples, reused per frame
+    unsigned int    buf_size;
+
+    int             rebuilds;       // SwrContexts created
+    int64_t         compensated;    // Frames stretched or squeezed
+} AudioConverter;
+
+void audio_out_init(void);
+const AudioInterleaver *audio_out_kernel(void);
+const AudioInterleaver *audio_out_kernel_scalar(void);
+
+int audio_out_interleave(AVFrame *frame, uint8_t **buf, unsigned int *buf_size);
+
+enum AVSampleFormat audio_out_sample_fmt(SDL_AudioFormat format);
+int audio_out_channels(int channels);
+int audio_convert_init(AudioConverter *c, const SDL_AudioSpec *spec);
+int audio_convert_frame(AudioConverter *c, AVFrame *frame, int wanted_samples);
+void audio_convert_free(AudioConverter *c);
+
+int audio_out_queue_frame(SDL_AudioDeviceID dev, AudioConverter *c, AVFrame *frame,
+                          int wanted_samples);
+
+#endif /* AUDIO_OUT_H_ */
@@ -0,0 +1,825 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "audio_out.h"
+#include "options.h"
+#include "convert.h"
+#include "clock.h"
+#include "sched.h"
+#include "splayer.h"
+#include "bench.h"
+
+#define BENCH_AUDIO_RATE 48000
+#define BENCH_AUDIO_CHANNELS 2
+#define BENCH_AUDIO_SAMPLES 1024
+#define BENCH_AUDIO_FRAMES 2000
+
+// Decoder outputs converted to the device format by --bench-audio
+static const struct {
+    const char          *name;
+    enum AVSampleFormat format;
+    int64_t             layout;
+    int                 rate;
+    int                 stretch;    // Samples more asked for, as rate compensation
+} bench_convert_cases[] = {
+    { "fltp stereo",            AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "flt stereo",             AV_SAMPLE_FMT_FLT,  AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "s16 stereo",             AV_SAMPLE_FMT_S16,  AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "s16p stereo",            AV_SAMPLE_FMT_S16P, AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "s32p stereo",            AV_SAMPLE_FMT_S32P, AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "dblp stereo",            AV_SAMPLE_FMT_DBLP, AV_CH_LAYOUT_STEREO,    48000, 0 },
+    { "fltp 5.1 downmix",       AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_5POINT1,   48000, 0 },
+    { "fltp 44.1k resample",    AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO,    44100, 0 },
+    { "fltp stereo, compensate", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO,   48000, 10 },
+};
+
+// Packets read into memory for the thread sweep, so I/O is not measured
+#define BENCH_THREADS_MAX_PACKETS 1500
+
+#define BENCH_FORMAT_WIDTH 1920
+#define BENCH_FORMAT_HEIGHT 1080
+#define BENCH_FORMAT_FRAMES 100
+
+// Multi-stream decode: instance counts run, and seconds measured for each
+static const int bench_stream_counts[] = { 1, 4, 16, 64 };
+#define BENCH_STREAMS_SECONDS 5
+#define BENCH_STREAMS_OPEN_TIMEOUT 30
+#define BENCH_STREAMS_QUANTUM_US 2000
+
+#define BENCH_LOG_CALLS 100000
+// Half the per-thread log ring, so timed batches never hit a full ring
+#define BENCH_LOG_BATCH 256
+
+
+static const char *stage_names[BENCH_STAGE_NB] = {
+    "demux",
+    "audio dec",
+    "video dec",
+    "video sink",
+};
+
+/**
+ * Monotonic time in microseconds, used for all pipeline measurements
+ */
+int64_t bench_now(void) {
+    return av_gettime_relative();
+}
+
+/**
+ * CPU time (user + system) used by the process so far, in seconds
+ */
+double bench_cpu_time(void) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Read the process I/O counters. /proc/self/io is Linux only, elsewhere the
+ * syscall counts stay 0 and only the page faults are filled in.
+ * @param io counters to fill
+ */
+void bench_io_snapshot(BenchIO *io) {
+    struct rusage usage;
+    char line[128];
+    FILE *f;
+
+    memset(io, 0, sizeof(BenchIO));
+
+    f = fopen("/proc/self/io", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "syscr: %"SCNd64, &io->read_syscalls) == 1)
+                continue;
+            sscanf(line, "rchar: %"SCNd64, &io->read_chars);
+        }
+        fclose(f);
+    }
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        io->minor_faults = usage.ru_minflt;
+        io->major_faults = usage.ru_majflt;
+    }
+}
+
+BenchStats *bench_stats_alloc(int convert) {
+    BenchStats *b;
+    int i;
+
+    b = av_mallocz(sizeof(BenchStats));
+    if (!b)
+        return NULL;
+
+    for (i = 0; i < BENCH_STAGE_NB; i++)
+        b->stages[i].name = stage_names[i];
+    b->convert = convert;
+
+    return b;
+}
+
+void bench_stats_free(BenchStats **b) {
+    av_freep(b);
+}
+
+/**
+ * Print throughput and p50/p99 latencies for every stage that saw work
+ * @param b pointer to BenchStats
+ * @param url input that was benchmarked
+ */
+void bench_report(BenchStats *b, const char *url) {
+    StageStats *st;
+    double elapsed;
+    int64_t frames;
+    int i;
+
+    elapsed = (b->end - b->start) / 1000000.0;
+    if (elapsed <= 0)
+        elapsed = 1e-6;
+
+    log_info("Bench: %s (convert %s)", url, b->convert ? "on" : "off");
+    log_info("Open %.1f ms, pipeline %.3f s, read %.1f MB (%.1f MB/s)",
+             b->open_time / 1000.0, elapsed, b->bytes_read / 1e6,
+             b->bytes_read / 1e6 / elapsed);
+    log_info("I/O: %"PRId64" read syscalls (%.1f per MB), %.1f MB through read(), "
+             "page faults %"PRId64" minor / %"PRId64" major",
+             b->io_end.read_syscalls - b->io_start.read_syscalls,
+             (b->io_end.read_syscalls - b->io_start.read_syscalls) / FFMAX(b->bytes_read / 1e6, 1e-6),
+             (b->io_end.read_chars - b->io_start.read_chars) / 1e6,
+             b->io_end.minor_faults - b->io_start.minor_faults,
+             b->io_end.major_faults - b->io_start.major_faults);
+    frames = b->stages[BENCH_STAGE_VIDEO].frames - BENCH_ALLOC_WARMUP_FRAMES;
+    if (alloc_count_enabled() && b->alloc_start.allocs && frames > 0)
+        log_info("Heap after %d warm-up frames: %.2f allocations, %.1f KB per video frame",
+                 BENCH_ALLOC_WARMUP_FRAMES,
+                 (double)(b->alloc_end.allocs - b->alloc_start.allocs) / frames,
+                 (b->alloc_end.bytes - b->alloc_start.bytes) / 1024.0 / frames);
+    log_info("%-10s %9s %9s %9s %9s %8s %17s %17s",
+             "stage", "packets", "frames", "pkt/s", "frames/s", "MB/s",
+             "work p50/p99 ms", "wait p50/p99 ms");
+
+    for (i = 0; i < BENCH_STAGE_NB; i++) {
+        st = &b->stages[i];
+        if (!st->packets && !st->frames)
+            continue;
+
+        log_info("%-10s %9"PRId64" %9"PRId64" %9.1f %9.1f %8.2f %8.3f/%-8.3f %8.3f/%-8.3f",
+                 st->name, st->packets, st->frames,
+                 st->packets / elapsed, st->frames / elapsed, st->bytes / 1e6 / elapsed,
+                 histogram_percentile(&st->latency, 50) / 1000.0,
+                 histogram_percentile(&st->latency, 99) / 1000.0,
+                 histogram_percentile(&st->wait, 50) / 1000.0,
+                 histogram_percentile(&st->wait, 99) / 1000.0);
+    }
+}
+
+/**
+ * Print how long sleepers on a queue took to run again after being signalled
+ * @param name queue and side
+ * @param h wakeup latency histogram, in us
+ */
+void bench_report_wakeup(const char *name, const Histogram *h) {
+    if (!h->count)
+        return;
+
+    log_info("%-12s wakeups %8"PRIu64"  p50 %6"PRId64" us  p99 %6"PRId64" us  max %6"PRId64" us",
+             name, h->count, histogram_percentile(h, 50), histogram_percentile(h, 99), h->max);
+}
+
+static double bench_seconds(Uint64 start) {
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+/**
+ * Time the old path: one SDL_QueueAudio call per sample per channel
+ */
+static double bench_audio_per_sample(SDL_AudioDeviceID dev, AVFrame *frame) {
+    Uint64 start;
+    int n, i, ch;
+
+    start = SDL_GetPerformanceCounter();
+    for (n = 0; n < BENCH_AUDIO_FRAMES; n++) {
+        for (i = 0; i < frame->nb_samples; i++)
+            for (ch = 0; ch < frame->channels; ch++)
+                SDL_QueueAudio(dev, frame->data[ch] + sizeof(float)*i, sizeof(float));
+        SDL_ClearQueuedAudio(dev);
+    }
+    return bench_seconds(start);
+}
+
+/**
+ * Time interleaving with the given kernel plus one SDL_QueueAudio per frame
+ */
+static double bench_audio_batched(SDL_AudioDeviceID dev, AVFrame *frame,
+                                  const AudioInterleaver *k, int queue) {
+    uint8_t *buf;
+    Uint64 start;
+    int n, size;
+
+    size = frame->nb_samples * frame->channels * sizeof(float);
+    buf = av_malloc(size);
+    if (!buf)
+        return -1;
+
+    start = SDL_GetPerformanceCounter();
+    for (n = 0; n < BENCH_AUDIO_FRAMES; n++) {
+        k->fn((uint32_t *)buf, (const uint32_t *const *)frame->extended_data,
+              frame->channels, frame->nb_samples);
+        if (queue) {
+            SDL_QueueAudio(dev, buf, size);
+            SDL_ClearQueuedAudio(dev);
+        }
+    }
+    av_free(buf);
+    return bench_seconds(start);
+}
+
+static void bench_audio_report(const char *name, double t, double base) {
+    double samples = (double)BENCH_AUDIO_FRAMES * BENCH_AUDIO_SAMPLES * BENCH_AUDIO_CHANNELS;
+
+    log_info("%-24s %8.2f ms  %8.1f Msamples/s  x%.1f",
+             name, t * 1000, samples / t / 1e6, base / t);
+}
+
+/**
+ * Time converting frames of one decoder output format to the device spec
+ * @return seconds, negative on error
+ */
+static double bench_audio_convert(const SDL_AudioSpec *spec, int c) {
+    AudioConverter conv;
+    AVFrame *frame;
+    Uint64 start;
+    int n;
+    double t = -1;
+
+    memset(&conv, 0, sizeof(conv));
+    frame = av_frame_alloc();
+    if (!frame || audio_convert_init(&conv, spec) < 0)
+        goto end;
+
+    frame->format = bench_convert_cases[c].format;
+    frame->channel_layout = bench_convert_cases[c].layout;
+    frame->channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+    frame->sample_rate = bench_convert_cases[c].rate;
+    frame->nb_samples = BENCH_AUDIO_SAMPLES;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        goto end;
+    av_samples_set_silence(frame->extended_data, 0, frame->nb_samples, frame->channels, frame->format);
+
+    start = SDL_GetPerformanceCounter();
+    for (n = 0; n < BENCH_AUDIO_FRAMES; n++)
+        if (audio_convert_frame(&conv, frame, frame->nb_samples + bench_convert_cases[c].stretch) < 0)
+            goto end;
+    t = bench_seconds(start);
+
+end:
+    audio_convert_free(&conv);
+    av_frame_free(&frame);
+    return t;
+}
+
+/**
+ * Microbenchmark of the audio output path on an AUDIO_F32SYS stereo device.
+ * Set SDL_AUDIODRIVER=dummy to run without a sound card.
+ */
+int bench_audio(void) {
+    SDL_AudioSpec   wanted_spec, spec;
+    SDL_AudioDeviceID dev;
+    AVFrame         *frame;
+    const AudioInterleaver *scalar, *best;
+    double          t_old, t_scalar, t_best, t_kernel_scalar, t_kernel_best;
+    double          t;
+    int             i, ch;
+
+    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+        LOG_ERR("Failed to initialize SDL - %s", SDL_GetError());
+        return -1;
+    }
+    audio_out_init();
+
+    SDL_zero(wanted_spec);
+    wanted_spec.freq        = BENCH_AUDIO_RATE;
+    wanted_spec.format      = AUDIO_F32SYS;
+    wanted_spec.channels    = BENCH_AUDIO_CHANNELS;
+    wanted_spec.samples     = 1024;
+    wanted_spec.callback    = NULL;
+
+    // Left paused, nothing is ever played
+    dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, 0);
+    if (dev == 0) {
+        LOG_ERR("SDL_OpenAudio: %s", SDL_GetError());
+        return -1;
+    }
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        LOG_ERR("Could not allocate memory for frame");
+        return -1;
+    }
+    frame->format = AV_SAMPLE_FMT_FLTP;
+    frame->nb_samples = BENCH_AUDIO_SAMPLES;
+    frame->channels = BENCH_AUDIO_CHANNELS;
+    frame->channel_layout = AV_CH_LAYOUT_STEREO;
+    frame->sample_rate = BENCH_AUDIO_RATE;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        LOG_ERR("Could not allocate frame buffer");
+        return -1;
+    }
+    for (ch = 0; ch < BENCH_AUDIO_CHANNELS; ch++)
+        for (i = 0; i < BENCH_AUDIO_SAMPLES; i++)
+            ((float *)frame->data[ch])[i] = (float)(i % 100) / 100.0f * (ch ? -1 : 1);
+
+    scalar = audio_out_kernel_scalar();
+    best = audio_out_kernel();
+
+    t_old           = bench_audio_per_sample(dev, frame);
+    t_scalar        = bench_audio_batched(dev, frame, scalar, 1);
+    t_best          = bench_audio_batched(dev, frame, best, 1);
+    t_kernel_scalar = bench_audio_batched(dev, frame, scalar, 0);
+    t_kernel_best   = bench_audio_batched(dev, frame, best, 0);
+
+    log_info("Audio output: %d frames of %d samples, %d ch @ %d Hz (F32)",
+             BENCH_AUDIO_FRAMES, BENCH_AUDIO_SAMPLES, spec.channels, spec.freq);
+    bench_audio_report("per-sample queue", t_old, t_old);
+    bench_audio_report("batched scalar", t_scalar, t_old);
+    bench_audio_report(best == scalar ? "batched (no simd)" : "batched simd", t_best, t_old);
+    bench_audio_report("kernel scalar", t_kernel_scalar, t_kernel_scalar);
+    bench_audio_report(best->name, t_kernel_best, t_kernel_scalar);
+
+    // Input samples per second, against plain interleaving
+    log_info("Audio conversion to the device format:");
+    for (i = 0; i < sizeof(bench_convert_cases) / sizeof(bench_convert_cases[0]); i++) {
+        t = bench_audio_convert(&spec, i);
+        if (t < 0)
+            LOG_ERR("%s: conversion failed", bench_convert_cases[i].name);
+        else
+            bench_audio_report(bench_convert_cases[i].name, t, t_kernel_best);
+    }
+
+    av_frame_free(&frame);
+    SDL_CloseAudioDevice(dev);
+    SDL_Quit();
+
+    return 0;
+}
+
+/**
+ * Decode all packets once with the given threading
+ * @param par stream codec parameters
+ * @param codec decoder to use
+ * @param pkts packets to decode
+ * @param nb_pkts number of packets
+ * @param thread_count codec thread count
+ * @param thread_type FF_THREAD_* flags
+ * @param frames set to the number of frames decoded
+ * @param active set to the threading the codec actually used
+ * @return seconds spent decoding, negative on error
+ */
+static double bench_decode_run(AVCodecParameters *par, AVCodec *codec, AVPacket **pkts, int nb_pkts,
+                               int thread_count, int thread_type, int *frames, int *active) {
+    AVCodecContext *context;
+    AVFrame *frame;
+    int64_t start;
+    double elapsed;
+    int i, response;
+
+    context = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    if (!context || !frame || avcodec_parameters_to_context(context, par) < 0)
+        return -1;
+
+    context->thread_count = thread_count;
+    context->thread_type = thread_type;
+    if (avcodec_open2(context, codec, NULL) < 0) {
+        LOG_ERR("Could not open codec");
+        return -1;
+    }
+    *active = context->active_thread_type;
+    *frames = 0;
+
+    start = bench_now();
+    for (i = 0; i <= nb_pkts; i++) {
+        // Last iteration sends a flush packet to drain delayed frames
+        response = avcodec_send_packet(context, i < nb_pkts ? pkts[i] : NULL);
+        if (response < 0 && response != AVERROR_EOF)
+            continue;
+
+        while ((response = avcodec_receive_frame(context, frame)) >= 0) {
+            (*frames)++;
+            av_frame_unref(frame);
+        }
+    }
+    elapsed = (bench_now() - start) / 1000000.0;
+
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+
+    return elapsed;
+}
+
+/**
+ * Decode the first packets of the video stream with every combination of
+ * thread count (1, 2, 4, ... up to the core count) and thread type, and
+ * report decode fps for each so the best setting can be picked per machine
+ * @param url input file
+ */
+int bench_decoder_threads(const char *url) {
+    static const int types[] = { FF_THREAD_SLICE, FF_THREAD_FRAME };
+    AVFormatContext *pFormatContext = NULL;
+    AVCodec *codec = NULL;
+    AVPacket **pkts, *packet;
+    double elapsed, base_fps = 0, fps;
+    int stream_index, nb_pkts = 0, cores, threads, t, frames, active;
+
+    if (avformat_open_input(&pFormatContext, url, NULL, NULL) < 0) {
+        LOG_ERR("Could not open the file");
+        return -1;
+    }
+    if (avformat_find_stream_info(pFormatContext, NULL) < 0)
+        return -1;
+
+    stream_index = av_find_best_stream(pFormatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (stream_index < 0 || !codec) {
+        LOG_ERR("No decodable video stream");
+        return -1;
+    }
+
+    pkts = av_mallocz_array(BENCH_THREADS_MAX_PACKETS, sizeof(AVPacket *));
+    packet = av_packet_alloc();
+    if (!pkts || !packet)
+        return -1;
+
+    while (nb_pkts < BENCH_THREADS_MAX_PACKETS && av_read_frame(pFormatContext, packet) >= 0) {
+        if (packet->stream_index == stream_index) {
+            pkts[nb_pkts] = av_packet_alloc();
+            av_packet_move_ref(pkts[nb_pkts++], packet);
+        } else {
+            av_packet_unref(packet);
+        }
+    }
+
+    cores = SDL_GetCPUCount();
+    log_info("Thread sweep: %s, %s %dx%d, %d packets, %d cores",
+             url, codec->name, pFormatContext->streams[stream_index]->codecpar->width,
+             pFormatContext->streams[stream_index]->codecpar->height, nb_pkts, cores);
+    log_info("%-12s %8s %8s %10s %8s", "type", "threads", "frames", "fps", "speedup");
+
+    for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        for (threads = 1; ; threads = FFMIN(threads * 2, cores)) {
+            elapsed = bench_decode_run(pFormatContext->streams[stream_index]->codecpar, codec,
+                                       pkts, nb_pkts, threads, types[t], &frames, &active);
+            if (elapsed < 0)
+                break;
+
+            fps = frames / FFMAX(elapsed, 1e-6);
+            if (threads == 1 && t == 0)
+                base_fps = fps;
+
+            log_info("%-12s %8d %8d %10.1f %7.2fx%s",
+                     options_thread_type_name(types[t]), threads, frames, fps,
+                     base_fps > 0 ? fps / base_fps : 0,
+                     (threads > 1 && !(active & types[t])) ? "  (not supported by codec)" : "");
+
+            if (threads >= cores)
+                break;
+        }
+    }
+
+    while (nb_pkts > 0)
+        av_packet_free(&pkts[--nb_pkts]);
+    av_freep(&pkts);
+    av_packet_free(&packet);
+    avformat_close_input(&pFormatContext);
+
+    return 0;
+}
+
+/**
+ * The logger as it was: vfprintf then fflush, on the calling thread
+ */
+static void bench_log_fprintf(FILE *f, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    fprintf(f, "[%s] <%s:%d> ", "DEBUG", __FILE__, __LINE__);
+    vfprintf(f, format, args);
+    fprintf(f, "\n");
+    fflush(f);
+    va_end(args);
+}
+
+static void bench_log_report(const char *name, double t, int calls) {
+    log_info("%-24s %8.1f ns/call", name, t * 1e9 / calls);
+}
+
+/**
+ * Cost of a log call on the calling thread, for the old synchronous logger
+ * and each path through the asynchronous one. Output goes to /dev/null.
+ */
+int bench_log(void) {
+    FILE        *null;
+    Uint64      start;
+    double      t_old, t_sync, t_filtered, t_async, t_limited;
+    int         i, j;
+
+    null = fopen("/dev/null", "w");
+    if (!null) {
+        LOG_ERR("Could not open /dev/null");
+        return -1;
+    }
+    log_set_output(null);
+    log_set_rate_limit(0);
+    log_set_level(LOG_LDEBUG);
+    log_thread_name("bench");
+
+    start = SDL_GetPerformanceCounter();
+    for (i = 0; i < BENCH_LOG_CALLS; i++)
+        bench_log_fprintf(null, "Queue empty! %d", i);
+    t_old = bench_seconds(start);
+
+    // Before log_init every message is written synchronously
+    start = SDL_GetPerformanceCounter();
+    for (i = 0; i < BENCH_LOG_CALLS; i++)
+        log_debug(__FILE__, __LINE__, "Queue empty! %d", i);
+    t_sync = bench_seconds(start);
+
+    if (log_init() < 0) {
+        LOG_ERR("Could not start the log writer");
+        return -1;
+    }
+
+    // Only the enqueue is timed, the ring is drained between batches
+    t_async = 0;
+    for (i = 0; i < BENCH_LOG_CALLS; i += BENCH_LOG_BATCH) {
+        start = SDL_GetPerformanceCounter();
+        for (j = 0; j < BENCH_LOG_BATCH; j++)
+            log_debug(__FILE__, __LINE__, "Queue empty! %d", i + j);
+        t_async += bench_seconds(start);
+        log_flush();
+    }
+
+    log_set_rate_limit(5);
+    start = SDL_GetPerformanceCounter();
+    for (i = 0; i < BENCH_LOG_CALLS; i++)
+        log_debug(__FILE__, __LINE__, "Queue empty! %d", i);
+    t_limited = bench_seconds(start);
+
+    log_set_level(LOG_LINFO);
+    start = SDL_GetPerformanceCounter();
+    for (i = 0; i < BENCH_LOG_CALLS; i++)
+        log_debug(__FILE__, __LINE__, "Queue empty! %d", i);
+    t_filtered = bench_seconds(start);
+
+    log_shutdown();
+    log_set_output(NULL);
+    fclose(null);
+
+    log_info("Log call cost, %d calls to /dev/null", BENCH_LOG_CALLS);
+    bench_log_report("old vfprintf+fflush", t_old, BENCH_LOG_CALLS);
+    bench_log_report("synchronous", t_sync, BENCH_LOG_CALLS);
+    bench_log_report("async enqueue", t_async, BENCH_LOG_CALLS);
+    bench_log_report("rate limited", t_limited, BENCH_LOG_CALLS);
+    bench_log_report("filtered by level", t_filtered, BENCH_LOG_CALLS);
+
+    return 0;
+}
+
+static const enum AVPixelFormat bench_pix_fmts[] = {
+    AV_PIX_FMT_YUV420P,
+    AV_PIX_FMT_NV12,
+    AV_PIX_FMT_YUYV422,
+    AV_PIX_FMT_YUV422P,
+    AV_PIX_FMT_YUV444P,
+    AV_PIX_FMT_YUV420P10LE,
+    AV_PIX_FMT_P010LE,
+    AV_PIX_FMT_RGB24,
+    AV_PIX_FMT_BGRA,
+};
+
+/**
+ * Upload the same frame repeatedly
+ * @return seconds per frame, negative on error
+ */
+static double bench_format_run(Converter *c, SDL_Texture *texture, AVFrame *frame) {
+    Uint64 start;
+    int n;
+
+    start = SDL_GetPerformanceCounter();
+    for (n = 0; n < BENCH_FORMAT_FRAMES; n++)
+        if (convert_upload(c, texture, frame, 0) < 0)
+            return -1;
+    return bench_seconds(start) / BENCH_FORMAT_FRAMES;
+}
+
+/**
+ * Time getting a 1080p frame of each common decoder output format into a
+ * texture, with one conversion thread and with the configured number.
+ * Runs on the dummy video driver unless SDL_VIDEODRIVER says otherwise.
+ * @param threads conversion threads, 0 for automatic
+ */
+int bench_formats(int threads) {
+    SDL_Window      *window;
+    SDL_Renderer    *renderer;
+    SDL_RendererInfo info;
+    SDL_Texture     *texture;
+    Converter       single, multi;
+    AVFrame         *frame;
+    Uint32          format;
+    double          t_single, t_multi, mb;
+    int             i, p;
+
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        LOG_ERR("Failed to initialize SDL - %s", SDL_GetError());
+        return -1;
+    }
+
+    window = SDL_CreateWindow("Player", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                              BENCH_FORMAT_WIDTH, BENCH_FORMAT_HEIGHT, SDL_WINDOW_HIDDEN);
+    renderer = window ? SDL_CreateRenderer(window, -1, 0) : NULL;
+    if (!renderer) {
+        LOG_ERR("SDL: Could not create renderer - %s", SDL_GetError());
+        return -1;
+    }
+    SDL_GetRendererInfo(renderer, &info);
+
+    if (convert_init(&single, renderer, 1) < 0 || convert_init(&multi, renderer, threads) < 0)
+        return -1;
+
+    log_info("Upload per format: %dx%d, %d frames, renderer %s, %d conversion threads",
+             BENCH_FORMAT_WIDTH, BENCH_FORMAT_HEIGHT, BENCH_FORMAT_FRAMES, info.name, multi.nb_slices);
+    log_info("%-12s %-10s %-8s %12s %12s %8s %9s", "format", "texture", "path",
+             "1 thread ms", "N threads ms", "speedup", "MB/s");
+
+    for (i = 0; i < sizeof(bench_pix_fmts) / sizeof(bench_pix_fmts[0]); i++) {
+        frame = av_frame_alloc();
+        if (!frame)
+            return -1;
+        frame->format = bench_pix_fmts[i];
+        frame->width = BENCH_FORMAT_WIDTH;
+        frame->height = BENCH_FORMAT_HEIGHT;
+        if (av_frame_get_buffer(frame, 0) < 0) {
+            LOG_ERR("Could not allocate frame buffer");
+            return -1;
+        }
+        for (p = 0; p < AV_NUM_DATA_POINTERS && frame->buf[p]; p++)
+            memset(frame->buf[p]->data, 0x80, frame->buf[p]->size);
+
+        format = convert_texture_format(&single, frame->format, 0);
+        convert_texture_format(&multi, frame->format, 0);
+        texture = format == SDL_PIXELFORMAT_UNKNOWN ? NULL
+            : SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING,
+                                frame->width, frame->height);
+        if (!texture) {
+            log_info("%-12s not supported", av_get_pix_fmt_name(frame->format));
+            av_frame_free(&frame);
+            continue;
+        }
+
+        t_single = bench_format_run(&single, texture, frame);
+        t_multi = single.direct ? t_single : bench_format_run(&multi, texture, frame);
+        mb = av_image_get_buffer_size(frame->format, frame->width, frame->height, 1) / 1e6;
+
+        if (t_single > 0 && t_multi > 0)
+            log_info("%-12s %-10s %-8s %12.3f %12.3f %7.2fx %9.1f",
+                     av_get_pix_fmt_name(frame->format),
+                     SDL_GetPixelFormatName(format) + strlen("SDL_PIXELFORMAT_"),
+                     single.direct ? "direct" : "swscale",
+                     t_single * 1000, t_multi * 1000, t_single / t_multi, mb / t_multi);
+
+        SDL_DestroyTexture(texture);
+        av_frame_free(&frame);
+    }
+
+    convert_destroy(&single);
+    convert_destroy(&multi);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return 0;
+}
+
+/**
+ * Threads of the process right now, from /proc/self/status
+ */
+static int bench_thread_count(void) {
+    char line[256];
+    FILE *f;
+    int threads = -1;
+
+    f = fopen("/proc/self/status", "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Threads: %d", &threads) == 1)
+            break;
+    fclose(f);
+    return threads;
+}
+
+/**
+ * Run n instances on the scheduler, decoding as fast as they can and
+ * looping, and report total frames/s, the spread between instances, CPU
+ * use and the threads the process needed
+ */
+static int bench_streams_run(Scheduler *s, const char **urls, int nb_urls, int n) {
+    SPlayerConfig cfg = { .priority = 1, .loop = 1 };
+    SPlayer **players;
+    int *start_frames;
+    double start, elapsed, cpu, fps, min_fps = -1, max_fps = 0;
+    int64_t frames = 0;
+    int i, opening, failed = 0, threads;
+
+    players = av_mallocz_array(n, sizeof(SPlayer *));
+    start_frames = av_mallocz_array(n, sizeof(int));
+    if (!players || !start_frames)
+        return -1;
+
+    for (i = 0; i < n; i++)
+        players[i] = splayer_open(s, urls[i % nb_urls], &cfg);
+
+    // Opening is not what is measured
+    start = clock_time();
+    do {
+        SDL_Delay(10);
+        for (i = opening = 0; i < n; i++)
+            opening += players[i] && SDL_AtomicGet(&players[i]->status) == SPLAYER_OPENING;
+    } while (opening && clock_time() - start < BENCH_STREAMS_OPEN_TIMEOUT);
+
+    for (i = 0; i < n; i++)
+        if (players[i])
+            start_frames[i] = SDL_AtomicGet(&players[i]->frames[AVMEDIA_TYPE_VIDEO]);
+    start = clock_time();
+    cpu = bench_cpu_time();
+
+    SDL_Delay(BENCH_STREAMS_SECONDS * 1000);
+
+    threads = bench_thread_count();
+    for (i = 0; i < n; i++) {
+        if (!players[i] || SDL_AtomicGet(&players[i]->status) != SPLAYER_PLAYING) {
+            failed++;
+            continue;
+        }
+        fps = SDL_AtomicGet(&players[i]->frames[AVMEDIA_TYPE_VIDEO]) - start_frames[i];
+        frames += fps;
+        fps /= BENCH_STREAMS_SECONDS;
+        min_fps = min_fps < 0 ? fps : FFMIN(min_fps, fps);
+        max_fps = FFMAX(max_fps, fps);
+    }
+    elapsed = clock_time() - start;
+    cpu = bench_cpu_time() - cpu;
+
+    for (i = 0; i < n; i++)
+        splayer_close(&players[i]);
+    av_freep(&players);
+    av_freep(&start_frames);
+
+    log_info("%8d %10.1f %8.1f %8.1f %8.0f%% %8d %8d%s", n, frames / elapsed,
+             FFMAX(min_fps, 0), max_fps, cpu * 100 / elapsed, threads,
+             2 * n + 1, failed ? "  (some failed)" : "");
+    return 0;
+}
+
+/**
+ * Decode N files at once for N = 1, 4, 16 and 64 on one shared scheduler,
+ * the files given being used round robin. The dedicated column is the
+ * threads a parse and a decoder thread per stream would take instead.
+ */
+int bench_streams(const char **urls, int nb_urls) {
+    Scheduler s;
+    int i;
+
+    if (sched_init(&s, 0, BENCH_STREAMS_QUANTUM_US) < 0)
+        return -1;
+
+    log_info("Multi-stream decode: %s%s, %d s per run, %d workers",
+             urls[0], nb_urls > 1 ? " and more" : "", BENCH_STREAMS_SECONDS, s.nb_workers);
+    log_info("%8s %10s %8s %8s %9s %8s %8s", "streams", "fps", "min", "max", "CPU", "threads",
+             "dedicated");
+
+    for (i = 0; i < sizeof(bench_stream_counts) / sizeof(bench_stream_counts[0]); i++)
+        if (bench_streams_run(&s, urls, nb_urls, bench_stream_counts[i]) < 0)
+            break;
+
+    sched_report(&s);
+    sched_destroy(&s);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include "histogram.h"
+#include "alloc_count.h"
+
+// Video frames decoded before allocations are counted
+#define BENCH_ALLOC_WARMUP_FRAMES 100
+
+enum {
+    BENCH_STAGE_DEMUX,
+    BENCH_STAGE_AUDIO,
+    BENCH_STAGE_VIDEO,
+    BENCH_STAGE_SINK,
+    BENCH_STAGE_NB
+};
+
+/*
+ * Counters for one pipeline stage. Each counter is only updated from one
+ * thread: the one running the stage, except for the sink's wait, which is
+ * the video decoder blocking on the full texture queue. The report is
+ * printed once all of them stopped.
+ */
+typedef struct StageStats {
+    const char      *name;
+    int64_t         packets;
+    int64_t         frames;
+    int64_t         bytes;
+    Histogram       latency;        // Work per packet/frame, in us
+    Histogram       wait;           // Time blocked on a queue, in us
+} StageStats;
+
+/*
+ * Process-wide I/O counters, compared before and after a run to tell how the
+ * input was read: read() syscalls for the file protocol, page faults for mmap.
+ */
+typedef struct BenchIO {
+    int64_t         read_syscalls;  // syscr from /proc/self/io
+    int64_t         read_chars;     // rchar, bytes passed through read()
+    int64_t         minor_faults;
+    int64_t         major_faults;
+} BenchIO;
+
+typedef struct BenchStats {
+    StageStats      stages[BENCH_STAGE_NB];
+    int             convert;        // Upload video frames instead of discarding them
+    int64_t         open_time;      // Time spent opening input and codecs, in us
+    int64_t         start;
+    int64_t         end;
+    int64_t         bytes_read;     // Bytes read from the input
+    BenchIO         io_start;
+    BenchIO         io_end;
+    AllocCount      alloc_start;    // After BENCH_ALLOC_WARMUP_FRAMES video frames
+    AllocCount      alloc_end;
+} BenchStats;
+
+int64_t bench_now(void);
+double bench_cpu_time(void);
+void bench_io_snapshot(BenchIO *io);
+BenchStats *bench_stats_alloc(int convert);
+void bench_stats_free(BenchStats **b);
+void bench_report(BenchStats *b, const char *url);
+void bench_report_wakeup(const char *name, const Histogram *h);
+
+int bench_audio(void);
+int bench_decoder_threads(const char *url);
+int bench_log(void);
+int bench_formats(int threads);
+int bench_streams(const char **urls, int nb_urls);
+
+#endif /* BENCH_H_ */
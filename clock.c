@@ -0,0 +1,149 @@
+#include <math.h>
+
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include "clock.h"
+
+// Last stretch of clock_sleep_until spent spinning, longer than the usual
+// oversleep of a timed sleep
+#define CLOCK_SPIN_TIME 0.0005
+
+
+/**
+ * Current wall time in seconds, monotonic
+ */
+double clock_time(void) {
+    return av_gettime_relative() / 1000000.0;
+}
+
+/**
+ * Sleep until a wall time, to within a few microseconds: the OS sleep is
+ * stopped short of it and the rest spun
+ * @param time clock_time() to return at
+ */
+void clock_sleep_until(double time) {
+    double remaining;
+
+    while ((remaining = time - clock_time()) > 0) {
+        if (remaining > CLOCK_SPIN_TIME)
+            av_usleep((remaining - CLOCK_SPIN_TIME) * 1000000);
+    }
+}
+
+/**
+ * Initialize clock, it reads NAN until the first clock_set
+ * @param c pointer to Clock
+ * @param queue_serial serial of the queue feeding the clock, NULL for none
+ */
+void clock_init(Clock *c, SDL_atomic_t *queue_serial) {
+    c->speed = 1.0;
+    c->paused = 0;
+    c->queue_serial = queue_serial;
+    clock_set(c, NAN, -1);
+}
+
+/**
+ * Get the current value of the clock
+ * @param c pointer to Clock
+ */
+double clock_get(Clock *c) {
+    double time;
+
+    if (c->queue_serial && SDL_AtomicGet(c->queue_serial) != c->serial)
+        return NAN;
+    if (c->paused)
+        return c->pts;
+
+    time = clock_time();
+    return c->pts_drift + time - (time - c->last_updated) * (1.0 - c->speed);
+}
+
+/**
+ * Set the clock to pts as of the given wall time
+ * @param c pointer to Clock
+ * @param pts new clock value in seconds
+ * @param serial serial of the frame pts comes from
+ * @param time wall time pts is valid at, from clock_time()
+ */
+void clock_set_at(Clock *c, double pts, int serial, double time) {
+    c->pts = pts;
+    c->serial = serial;
+    c->last_updated = time;
+    c->pts_drift = c->pts - time;
+}
+
+void clock_set(Clock *c, double pts, int serial) {
+    clock_set_at(c, pts, serial, clock_time());
+}
+
+/**
+ * Pull c towards slave when they disagree by more than AV_NOSYNC_THRESHOLD,
+ * or when c has not been set yet
+ * @param c clock to adjust
+ * @param slave clock to follow
+ */
+void clock_sync_to_slave(Clock *c, Clock *slave) {
+    double clock = clock_get(c);
+    double slave_clock = clock_get(slave);
+
+    if (!isnan(slave_clock) && (isnan(clock) || fabs(clock - slave_clock) > AV_NOSYNC_THRESHOLD))
+        clock_set(c, slave_clock, slave->serial);
+}
+
+/**
+ * Resolve the requested master clock against the streams that are open
+ * @param wanted one of AV_SYNC_*
+ * @param has_audio audio stream is playing
+ * @param has_video video stream is playing
+ */
+int clock_master_type(int wanted, int has_audio, int has_video) {
+    if (wanted == AV_SYNC_VIDEO_MASTER)
+        return has_video ? AV_SYNC_VIDEO_MASTER : AV_SYNC_AUDIO_MASTER;
+    if (wanted == AV_SYNC_AUDIO_MASTER)
+        return has_audio ? AV_SYNC_AUDIO_MASTER : AV_SYNC_EXTERNAL_CLOCK;
+    return AV_SYNC_EXTERNAL_CLOCK;
+}
+
+const char *clock_master_name(int type) {
+    switch (type) {
+        case AV_SYNC_AUDIO_MASTER:
+            return "audio";
+        case AV_SYNC_VIDEO_MASTER:
+            return "video";
+        default:
+            return "external";
+    }
+}
+
+/**
+ * Adjust the nominal delay until the next frame so video follows the master.
+ * When video is behind the delay shrinks (down to 0), when it is ahead the
+ * frame is held longer, which shows up as a duplicated frame.
+ * @param delay nominal duration of the frame on screen
+ * @param diff video clock minus master clock, NAN if unknown
+ * @param max_frame_duration largest sane frame duration for this stream
+ * @param dup set to 1 if the current frame is held for longer than delay
+ */
+double clock_target_delay(double delay, double diff, double max_frame_duration, int *dup) {
+    double sync_threshold;
+
+    *dup = 0;
+
+    // Skip or repeat frame. We take into account the delay to compute the
+    // threshold. I still don't know if it is the best guess
+    sync_threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX, delay));
+    if (!isnan(diff) && fabs(diff) < max_frame_duration) {
+        if (diff <= -sync_threshold) {
+            delay = FFMAX(0, delay + diff);
+        } else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD) {
+            delay = delay + diff;
+            *dup = 1;
+        } else if (diff >= sync_threshold) {
+            delay = 2 * delay;
+            *dup = 1;
+        }
+    }
+
+    return delay;
+}
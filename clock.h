@@ -0,0 +1,49 @@
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <SDL2/SDL.h>
+
+// No A/V correction is done if the error is too big
+#define AV_NOSYNC_THRESHOLD 10.0
+// Min/max sync threshold, in seconds
+#define AV_SYNC_THRESHOLD_MIN 0.04
+#define AV_SYNC_THRESHOLD_MAX 0.1
+// Frames longer than this are not duplicated to compensate for drift
+#define AV_SYNC_FRAMEDUP_THRESHOLD 0.1
+
+enum {
+    AV_SYNC_AUDIO_MASTER,
+    AV_SYNC_VIDEO_MASTER,
+    AV_SYNC_EXTERNAL_CLOCK
+};
+
+/*
+ * A clock is a pts plus the wall time it was set at, so it keeps running
+ * between updates: clock_get() = pts + (now - last_updated) * speed.
+ * A clock tied to a packet queue reads NAN once the queue moved on to a new
+ * serial, until it is set from a frame of that serial.
+ */
+typedef struct Clock {
+    double          pts;            // Clock base
+    double          pts_drift;      // Clock base minus time at which we updated the clock
+    double          last_updated;
+    double          speed;
+    int             paused;
+    int             serial;         // Serial of the frame the clock was set from
+    SDL_atomic_t    *queue_serial;  // Serial of the feeding queue, NULL for none
+} Clock;
+
+double clock_time(void);
+void clock_sleep_until(double time);
+
+void clock_init(Clock *c, SDL_atomic_t *queue_serial);
+double clock_get(Clock *c);
+void clock_set_at(Clock *c, double pts, int serial, double time);
+void clock_set(Clock *c, double pts, int serial);
+void clock_sync_to_slave(Clock *c, Clock *slave);
+
+int clock_master_type(int wanted, int has_audio, int has_video);
+const char *clock_master_name(int type);
+double clock_target_delay(double delay, double diff, double max_frame_duration, int *dup);
+
+#endif /* CLOCK_H_ */
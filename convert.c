@@ -0,0 +1,416 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "convert.h"
+
+// Slice heights stay a multiple of this, so no slice starts inside a chroma row
+#define CONVERT_SLICE_ALIGN 16
+// Conversion is memory bound, more threads than this rarely help
+#define CONVERT_AUTO_THREADS 8
+
+static const struct {
+    enum AVPixelFormat  pix_fmt;
+    Uint32              texture_format;
+} texture_format_map[] = {
+    { AV_PIX_FMT_YUV420P,   SDL_PIXELFORMAT_IYUV },
+    { AV_PIX_FMT_YUVJ420P,  SDL_PIXELFORMAT_IYUV },
+    { AV_PIX_FMT_NV12,      SDL_PIXELFORMAT_NV12 },
+    { AV_PIX_FMT_NV21,      SDL_PIXELFORMAT_NV21 },
+    { AV_PIX_FMT_YUYV422,   SDL_PIXELFORMAT_YUY2 },
+    { AV_PIX_FMT_UYVY422,   SDL_PIXELFORMAT_UYVY },
+    { AV_PIX_FMT_RGB24,     SDL_PIXELFORMAT_RGB24 },
+    { AV_PIX_FMT_BGR24,     SDL_PIXELFORMAT_BGR24 },
+    { AV_PIX_FMT_RGB32,     SDL_PIXELFORMAT_ARGB8888 },
+    { AV_PIX_FMT_RGB32_1,   SDL_PIXELFORMAT_RGBA8888 },
+    { AV_PIX_FMT_BGR32,     SDL_PIXELFORMAT_ABGR8888 },
+    { AV_PIX_FMT_BGR32_1,   SDL_PIXELFORMAT_BGRA8888 },
+    { AV_PIX_FMT_0RGB32,    SDL_PIXELFORMAT_RGB888 },
+    { AV_PIX_FMT_0BGR32,    SDL_PIXELFORMAT_BGR888 },
+};
+
+
+static int convert_native(Converter *c, Uint32 format) {
+    int i;
+
+    // Renderer did not say, assume it takes everything
+    if (!c->nb_native)
+        return 1;
+    for (i = 0; i < c->nb_native; i++)
+        if (c->native[i] == format)
+            return 1;
+    return 0;
+}
+
+/**
+ * Row offset of a slice in one plane
+ * @param desc pixel format
+ * @param nb_planes image planes of the format, a palette is not one
+ * @param plane plane index
+ * @param y first row of the slice
+ */
+static int plane_row(const AVPixFmtDescriptor *desc, int nb_planes, int plane, int y) {
+    if (plane >= nb_planes)
+        return 0;
+    return (plane == 1 || plane == 2) ? y >> desc->log2_chroma_h : y;
+}
+
+/**
+ * Convert one slice of the current job. Every slice is scaled on its own,
+ * so resampling does not look across slice edges.
+ */
+static void convert_slice(Converter *c, ConvertSlice *s) {
+    const AVFrame *frame = c->frame;
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(frame->format);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(c->dst_format);
+    int src_planes = av_pix_fmt_count_planes(frame->format);
+    int dst_planes = av_pix_fmt_count_planes(c->dst_format);
+    const uint8_t *src[4];
+    uint8_t *dst[4];
+    int i;
+
+    if (!s->h || !s->src_h)
+        return;
+
+    s->sws = sws_getCachedContext(s->sws, frame->width, s->src_h, frame->format,
+                                  AV_CEIL_RSHIFT(frame->width, c->reduce), s->h, c->dst_format,
+                                  SWS_BILINEAR, NULL, NULL, NULL);
+    if (!s->sws) {
+        s->error = 1;
+        return;
+    }
+
+    for (i = 0; i < 4; i++) {
+        src[i] = frame->data[i] ? frame->data[i]
+            + plane_row(src_desc, src_planes, i, s->src_y) * frame->linesize[i] : NULL;
+        dst[i] = c->dst[i] ? c->dst[i]
+            + plane_row(dst_desc, dst_planes, i, s->y) * c->dst_linesize[i] : NULL;
+    }
+
+    if (sws_scale(s->sws, src, frame->linesize, 0, s->src_h, dst, c->dst_linesize) <= 0)
+        s->error = 1;
+}
+
+static int convert_worker(void *arg) {
+    ConvertSlice *s = arg;
+    Converter *c = s->converter;
+    int generation = 0;
+
+    SDL_LockMutex(c->mutex);
+    for (;;) {
+        while (!c->quit && c->generation == generation)
+            SDL_CondWait(c->start_cond, c->mutex);
+        if (c->quit)
+            break;
+        generation = c->generation;
+        SDL_UnlockMutex(c->mutex);
+
+        convert_slice(c, s);
+
+        SDL_LockMutex(c->mutex);
+        if (--c->pending == 0)
+            SDL_CondSignal(c->done_cond);
+    }
+    SDL_UnlockMutex(c->mutex);
+
+    return 0;
+}
+
+/**
+ * Cut a picture into one slice per thread. Output slices are aligned, so
+ * each one maps to a whole number of source rows when reducing.
+ * @param c pointer to Converter
+ * @param width source width
+ * @param height source height
+ * @param reduce output is the source halved this many times
+ */
+static void convert_cut_slices(Converter *c, int width, int height, int reduce) {
+    int out_height = AV_CEIL_RSHIFT(height, reduce);
+    int rows, y = 0, i;
+    ConvertSlice *s;
+
+    rows = FFALIGN((out_height + c->nb_slices - 1) / c->nb_slices, CONVERT_SLICE_ALIGN);
+    for (i = 0; i < c->nb_slices; i++) {
+        s = &c->slices[i];
+        s->y = y;
+        s->h = FFMIN(rows, out_height - y);
+        s->src_y = FFMIN(y << reduce, height);
+        s->src_h = FFMIN(s->h << reduce, height - s->src_y);
+        y += s->h;
+    }
+
+    c->width = width;
+    c->height = height;
+    c->reduce = reduce;
+}
+
+/**
+ * Start the conversion workers
+ * @param c pointer to Converter
+ * @param renderer renderer the textures are created on
+ * @param threads slices converted in parallel, 0 for automatic
+ */
+int convert_init(Converter *c, SDL_Renderer *renderer, int threads) {
+    SDL_RendererInfo info;
+    int i;
+
+    memset(c, 0, sizeof(Converter));
+    c->src_format = AV_PIX_FMT_NONE;
+
+    if (renderer && SDL_GetRendererInfo(renderer, &info) == 0) {
+        c->nb_native = FFMIN(info.num_texture_formats, sizeof(c->native) / sizeof(c->native[0]));
+        memcpy(c->native, info.texture_formats, c->nb_native * sizeof(Uint32));
+    }
+
+    if (threads <= 0)
+        threads = FFMIN(FFMAX(SDL_GetCPUCount() / 2, 1), CONVERT_AUTO_THREADS);
+    c->nb_slices = FFMIN(threads, CONVERT_MAX_THREADS);
+
+    c->mutex = SDL_CreateMutex();
+    c->start_cond = SDL_CreateCond();
+    c->done_cond = SDL_CreateCond();
+    if (!c->mutex || !c->start_cond || !c->done_cond) {
+        LOG_ERR("Could not create conversion locks: %s", SDL_GetError());
+        return -1;
+    }
+
+    for (i = 0; i < c->nb_slices; i++) {
+        c->slices[i].converter = c;
+        if (i == 0)
+            continue;
+        c->slices[i].tid = SDL_CreateThread(convert_worker, "convert", &c->slices[i]);
+        if (!c->slices[i].tid) {
+            LOG_ERR("Could not create conversion thread: %s", SDL_GetError());
+            c->nb_slices = i;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void convert_destroy(Converter *c) {
+    int i;
+
+    SDL_LockMutex(c->mutex);
+    c->quit = 1;
+    SDL_CondBroadcast(c->start_cond);
+    SDL_UnlockMutex(c->mutex);
+
+    for (i = 0; i < c->nb_slices; i++) {
+        if (c->slices[i].tid)
+            SDL_WaitThread(c->slices[i].tid, NULL);
+        sws_freeContext(c->slices[i].sws);
+    }
+
+    SDL_DestroyCond(c->done_cond);
+    SDL_DestroyCond(c->start_cond);
+    SDL_DestroyMutex(c->mutex);
+    memset(c, 0, sizeof(Converter));
+}
+
+/**
+ * Pick the texture format for frames of a pixel format: the same layout if
+ * the renderer takes it natively, otherwise whichever of IYUV and ARGB8888
+ * it takes that loses the least in conversion. Reduced frames always go
+ * through swscale.
+ * @param c pointer to Converter
+ * @param pix_fmt AVPixelFormat of the frames
+ * @param reduce frames are halved this many times before upload
+ * @return SDL pixel format, SDL_PIXELFORMAT_UNKNOWN if it cannot be shown
+ */
+Uint32 convert_texture_format(Converter *c, int pix_fmt, int reduce) {
+    const AVPixFmtDescriptor *desc;
+    Uint32 match = SDL_PIXELFORMAT_UNKNOWN, preferred[2];
+    int i;
+
+    if (pix_fmt == c->src_format && !reduce == !c->src_reduce)
+        return c->texture_format;
+
+    if (!reduce)
+        for (i = 0; i < sizeof(texture_format_map) / sizeof(texture_format_map[0]); i++)
+            if (texture_format_map[i].pix_fmt == pix_fmt)
+                match = texture_format_map[i].texture_format;
+
+    c->src_format = pix_fmt;
+    c->src_reduce = reduce;
+    c->texture_format = match;
+    c->direct = 1;
+
+    if (match == SDL_PIXELFORMAT_UNKNOWN || !convert_native(c, match)) {
+        desc = av_pix_fmt_desc_get(pix_fmt);
+        if (desc && sws_isSupportedInput(pix_fmt)) {
+            preferred[0] = (desc->flags & AV_PIX_FMT_FLAG_RGB) ? SDL_PIXELFORMAT_ARGB8888 : SDL_PIXELFORMAT_IYUV;
+            preferred[1] = (desc->flags & AV_PIX_FMT_FLAG_RGB) ? SDL_PIXELFORMAT_IYUV : SDL_PIXELFORMAT_ARGB8888;
+            for (i = 0; i < 2; i++) {
+                if (convert_native(c, preferred[i])) {
+                    c->texture_format = preferred[i];
+                    c->direct = 0;
+                    break;
+                }
+            }
+            // Nothing suitable is native, SDL converts either way
+            if (c->texture_format == SDL_PIXELFORMAT_UNKNOWN) {
+                c->texture_format = preferred[0];
+                c->direct = 0;
+            }
+        }
+    }
+
+    if (c->texture_format == SDL_PIXELFORMAT_UNKNOWN)
+        LOG_ERR("No way to show %s frames", av_get_pix_fmt_name(pix_fmt));
+    else
+        log_info("Video frames: %s -> %s, %s", av_get_pix_fmt_name(pix_fmt),
+                 SDL_GetPixelFormatName(c->texture_format),
+                 c->direct ? "direct upload" : reduce ? "swscale, reduced" : "swscale");
+
+    return c->texture_format;
+}
+
+/**
+ * Copy a frame whose layout matches the texture
+ */
+static int convert_upload_direct(SDL_Texture *texture, Uint32 format, const AVFrame *frame) {
+    uint8_t *pixels;
+    int pitch, uv_pitch;
+
+    switch (format) {
+        case SDL_PIXELFORMAT_IYUV:
+            return SDL_UpdateYUVTexture(texture, NULL,
+                                        frame->data[0], frame->linesize[0],
+                                        frame->data[1], frame->linesize[1],
+                                        frame->data[2], frame->linesize[2]);
+        case SDL_PIXELFORMAT_NV12:
+        case SDL_PIXELFORMAT_NV21:
+            if (SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch) < 0)
+                return -1;
+
+            // Interleaved chroma plane right below the luma plane
+            uv_pitch = 2 * ((pitch + 1) / 2);
+            av_image_copy_plane(pixels, pitch, frame->data[0], frame->linesize[0],
+                                frame->width, frame->height);
+            av_image_copy_plane(pixels + pitch * frame->height, uv_pitch,
+                                frame->data[1], frame->linesize[1],
+                                2 * ((frame->width + 1) / 2), (frame->height + 1) / 2);
+
+            SDL_UnlockTexture(texture);
+            return 0;
+        default:
+            return SDL_UpdateTexture(texture, NULL, frame->data[0], frame->linesize[0]);
+    }
+}
+
+/**
+ * Convert a frame into a locked texture, one slice per thread
+ */
+static int convert_upload_sws(Converter *c, SDL_Texture *texture, Uint32 format,
+                              const AVFrame *frame, int reduce) {
+    uint8_t *pixels;
+    int pitch, height, i, ret = 0;
+
+    if (frame->width != c->width || frame->height != c->height || reduce != c->reduce)
+        convert_cut_slices(c, frame->width, frame->height, reduce);
+    height = AV_CEIL_RSHIFT(frame->height, reduce);
+
+    if (SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch) < 0)
+        return -1;
+
+    memset(c->dst, 0, sizeof(c->dst));
+    memset(c->dst_linesize, 0, sizeof(c->dst_linesize));
+    c->dst[0] = pixels;
+    c->dst_linesize[0] = pitch;
+    if (format == SDL_PIXELFORMAT_IYUV) {
+        c->dst_format = AV_PIX_FMT_YUV420P;
+        c->dst_linesize[1] = c->dst_linesize[2] = (pitch + 1) / 2;
+        c->dst[1] = pixels + pitch * height;
+        c->dst[2] = c->dst[1] + c->dst_linesize[1] * ((height + 1) / 2);
+    } else {
+        c->dst_format = AV_PIX_FMT_RGB32;
+    }
+    c->frame = frame;
+
+    SDL_LockMutex(c->mutex);
+    c->pending = c->nb_slices - 1;
+    c->generation++;
+    SDL_CondBroadcast(c->start_cond);
+    SDL_UnlockMutex(c->mutex);
+
+    convert_slice(c, &c->slices[0]);
+
+    SDL_LockMutex(c->mutex);
+    while (c->pending > 0)
+        SDL_CondWait(c->done_cond, c->mutex);
+    SDL_UnlockMutex(c->mutex);
+
+    SDL_UnlockTexture(texture);
+    c->frame = NULL;
+
+    for (i = 0; i < c->nb_slices; i++) {
+        if (c->slices[i].error)
+            ret = -1;
+        c->slices[i].error = 0;
+    }
+    if (ret < 0)
+        LOG_ERR("Could not convert %s frame", av_get_pix_fmt_name(frame->format));
+
+    return ret;
+}
+
+/**
+ * Get a frame into a texture created with convert_texture_format
+ * @param c pointer to Converter
+ * @param texture streaming texture of the frame's size, shifted right by reduce
+ * @param frame decoded video frame
+ * @param reduce halve the frame this many times, up to CONVERT_MAX_REDUCE
+ */
+int convert_upload(Converter *c, SDL_Texture *texture, const AVFrame *frame, int reduce) {
+    Uint32 format = convert_texture_format(c, frame->format, reduce);
+
+    if (format == SDL_PIXELFORMAT_UNKNOWN)
+        return -1;
+
+    if (c->direct) {
+        c->frames_direct++;
+        if (convert_upload_direct(texture, format, frame) < 0) {
+            LOG_ERR("Texture upload failed: %s", SDL_GetError());
+            return -1;
+        }
+        return 0;
+    }
+
+    c->frames_converted++;
+    return convert_upload_sws(c, texture, format, frame, reduce);
+}
+
+/**
+ * Bytes of pixel data in a texture
+ */
+int64_t convert_texture_bytes(Uint32 format, int width, int height) {
+    switch (format) {
+        case SDL_PIXELFORMAT_IYUV:
+        case SDL_PIXELFORMAT_YV12:
+        case SDL_PIXELFORMAT_NV12:
+        case SDL_PIXELFORMAT_NV21:
+            return (int64_t)width * height + 2LL * ((width + 1) / 2) * ((height + 1) / 2);
+        case SDL_PIXELFORMAT_YUY2:
+        case SDL_PIXELFORMAT_UYVY:
+            return 4LL * ((width + 1) / 2) * height;
+        default:
+            return (int64_t)SDL_BYTESPERPIXEL(format) * width * height;
+    }
+}
+
+void convert_report(Converter *c) {
+    if (!c->frames_direct && !c->frames_converted)
+        return;
+
+    log_info("Conversion: %"PRId64" frames uploaded directly, %"PRId64" through swscale in %d slices",
+             c->frames_direct, c->frames_converted, c->nb_slices);
+}
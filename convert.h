@@ -0,0 +1,79 @@
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+
+#include <SDL2/SDL.h>
+
+#define CONVERT_MAX_THREADS 16
+
+struct Converter;
+
+// Largest downscale before upload, as a power of two
+#define CONVERT_MAX_REDUCE 3
+
+/*
+ * One horizontal band of the picture, always converted by the same thread
+ * with its own SwsContext
+ */
+typedef struct ConvertSlice {
+    struct Converter *converter;
+    struct SwsContext *sws;
+    int             y;              // First output row
+    int             h;              // Output rows, 0 if the picture has too few
+    int             src_y;          // Source rows the band is scaled from
+    int             src_h;
+    int             error;
+    SDL_Thread      *tid;           // NULL for slice 0, run by the caller
+} ConvertSlice;
+
+/*
+ * Gets decoded frames into textures. Pixel formats SDL can take as they are
+ * are uploaded directly; anything else is converted by swscale straight into
+ * the locked texture, cut into horizontal slices that run in parallel on a
+ * small worker pool. Frames shown much smaller than their size can be
+ * halved once or more on the way, instead of uploading every pixel for the
+ * renderer to throw away. Only used from the thread owning the renderer.
+ */
+typedef struct Converter {
+    Uint32          native[16];     // Texture formats the renderer supports
+    int             nb_native;
+
+    // Mapping for the last source format and reduction seen
+    int             src_format;
+    int             src_reduce;
+    Uint32          texture_format;
+    int             direct;         // Uploaded without swscale
+
+    ConvertSlice    slices[CONVERT_MAX_THREADS];
+    int             nb_slices;
+    int             width;          // Picture size and reduction the slices are cut for
+    int             height;
+    int             reduce;
+
+    // Current job, published to the workers by bumping generation
+    const AVFrame   *frame;
+    int             dst_format;
+    uint8_t         *dst[4];
+    int             dst_linesize[4];
+
+    SDL_mutex       *mutex;
+    SDL_cond        *start_cond;
+    SDL_cond        *done_cond;
+    int             generation;
+    int             pending;        // Worker slices not done yet
+    int             quit;
+
+    int64_t         frames_direct;
+    int64_t         frames_converted;
+} Converter;
+
+int convert_init(Converter *c, SDL_Renderer *renderer, int threads);
+void convert_destroy(Converter *c);
+Uint32 convert_texture_format(Converter *c, int pix_fmt, int reduce);
+int convert_upload(Converter *c, SDL_Texture *texture, const AVFrame *frame, int reduce);
+int64_t convert_texture_bytes(Uint32 format, int width, int height);
+void convert_report(Converter *c);
+
+#endif /* CONVERT_H_ */
@@ -0,0 +1,210 @@
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "trace.h"
+#include "decoder.h"
+
+/**
+ * Allocate a codec context for a stream, not opened yet so the owner can
+ * set threads and options first. Open it with avcodec_open2(ctx, ctx->codec).
+ * @param st stream to decode
+ * @return the context, NULL on error
+ */
+AVCodecContext *decoder_alloc_context(AVStream *st) {
+    AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    AVCodecContext *codecContext;
+
+    if (!codec) {
+        LOG_ERR("Unsupported codec");
+        return NULL;
+    }
+
+    codecContext = avcodec_alloc_context3(codec);
+    if (!codecContext) {
+        LOG_ERR("Could not allocate codec context");
+        return NULL;
+    }
+
+    if (avcodec_parameters_to_context(codecContext, st->codecpar) < 0) {
+        LOG_ERR("Could not create codec context from parameters");
+        avcodec_free_context(&codecContext);
+        return NULL;
+    }
+    codecContext->pkt_timebase = st->time_base;
+
+    return codecContext;
+}
+
+/**
+ * Set up a decoder and its task, which does not run before decoder_start
+ * @param d pointer to Decoder
+ * @param codecContext opened codec, owned by the decoder from here on
+ * @param queue packets to decode
+ * @param run the task's run function, calling decoder_decode_frame
+ * @param opaque for run, as task->opaque
+ * @param priority scheduling weight of the task
+ */
+int decoder_init(Decoder *d, AVCodecContext *codecContext, PacketQueue *queue,
+                 int (*run)(SchedTask *task), void *opaque, int priority) {
+    memset(d, 0, sizeof(Decoder));
+    d->codecContext = codecContext;
+    d->queue = queue;
+    d->pkt_serial = -1;
+    d->metric = -1;
+    sched_task_init(&d->task, run, opaque, priority);
+
+    d->frame = av_frame_alloc();
+    if (!d->frame) {
+        LOG_ERR("Could not allocate memory for frame");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start decoding: the queue takes packets and wakes the decoder's task
+ * @param d pointer to Decoder
+ * @param s scheduler to run the task on
+ * @param producer task filling the queue, woken as it drains
+ * @param wakeup receives the task's wakeup latency, NULL for none
+ */
+void decoder_start(Decoder *d, Scheduler *s, SchedTask *producer, Histogram *wakeup) {
+    d->task.wakeup = wakeup;
+    packet_queue_set_tasks(d->queue, s, producer, &d->task);
+    packet_queue_start(d->queue);
+    sched_submit(s, &d->task);
+}
+
+/**
+ * Stop the decoder's task, waiting for a slice it is running. The queue
+ * keeps its packets but no longer wakes the task. Safe to call more than
+ * once, and on a decoder that never started.
+ * @param d pointer to Decoder
+ * @param s scheduler running the task
+ */
+void decoder_stop(Decoder *d, Scheduler *s) {
+    if (!d->task.run)
+        return;
+
+    sched_task_stop(s, &d->task);
+    if (d->queue->consumer == &d->task)
+        packet_queue_set_tasks(d->queue, s, d->queue->producer, NULL);
+}
+
+/**
+ * Decode the next frame from the decoder's packet queue, without blocking.
+ * Frames still buffered in the codec are returned before more packets are sent.
+ * Packets queued before a seek are dropped and the codec is flushed when the
+ * serial changes; the frame returned belongs to d->pkt_serial.
+ * @param d pointer to Decoder
+ * @param frame frame to be set
+ * @return 1 if a frame was decoded, 0 at end of stream, AVERROR(EAGAIN) if
+ *         the queue ran dry, QUIT if it was aborted
+ */
+int decoder_decode_frame(Decoder *d, AVFrame *frame) {
+    AVCodecContext *context = d->codecContext;
+    AVPacket packet;
+    int64_t t0 = 0, dt;
+    int response, old_serial;
+
+    for (;;) {
+        if (d->pkt_serial == SDL_AtomicGet(&d->queue->serial)) {
+            TRACE_BEGIN("receive frame");
+            t0 = bench_now();
+            response = avcodec_receive_frame(context, frame);
+            dt = bench_now() - t0;
+            TRACE_END("receive frame");
+            d->pkt_time += dt;
+            d->frame_time += dt;
+
+            if (response >= 0) {
+                if (d->metric >= 0)
+                    metric_time(d->metric, d->frame_time);
+                d->frame_time = 0;
+                if (d->stats)
+                    d->stats->frames++;
+                return 1;
+            }
+
+            if (response == AVERROR_EOF) {
+                avcodec_flush_buffers(context);
+                return 0;
+            } else if (response != AVERROR(EAGAIN)) {
+                // Skip the frame and feed the next packet, asking again would
+                // only get the same error back
+                LOG_ERR("Something went wrong with the stream, skipping frame: %s - %s",
+                        context->codec->name, av_err2str(response));
+            }
+        }
+
+        // Previous packet is fully decoded
+        if (d->stats && d->pkt_pending) {
+            histogram_add(&d->stats->latency, d->pkt_time);
+            d->pkt_pending = 0;
+        }
+
+        // Codec needs more data
+        old_serial = d->pkt_serial;
+        response = packet_queue_get(d->queue, &packet, &d->pkt_serial);
+        if (response < 0)
+            return response;
+        if (response == 0) {
+            // The demuxer submits our task with the next packet
+            if (d->stats && !d->wait_start)
+                d->wait_start = bench_now();
+            LOG_WARN("Queue empty!");
+            return AVERROR(EAGAIN);
+        }
+
+        // First packet after a seek, drop what the codec still holds
+        if (d->pkt_serial != old_serial)
+            avcodec_flush_buffers(context);
+
+        // Queued before the last seek
+        if (d->pkt_serial != SDL_AtomicGet(&d->queue->serial)) {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        if (d->stats) {
+            histogram_add(&d->stats->wait, d->wait_start ? bench_now() - d->wait_start : 0);
+            d->wait_start = 0;
+            d->stats->packets++;
+            d->stats->bytes += packet.size;
+        }
+
+        TRACE_BEGIN("send packet");
+        t0 = bench_now();
+        response = avcodec_send_packet(context, &packet);
+        if (response < 0) {
+            LOG_ERR("Error while sending packet to the decoder: %d - %s - %s", response, context->codec->name,
+                    av_err2str(response));
+            LOG_DEBUG("Codec %s, ID, %d, bit_rate %ld", context->codec->long_name,
+                      context->codec->id, context->bit_rate);
+        }
+        av_packet_unref(&packet);
+
+        dt = bench_now() - t0;
+        TRACE_END("send packet");
+        d->frame_time += dt;
+        if (d->stats) {
+            d->pkt_time = dt;
+            d->pkt_pending = 1;
+        }
+    }
+}
+
+/**
+ * Free the codec and the held frame. The task must be stopped.
+ * @param d pointer to Decoder
+ */
+void decoder_destroy(Decoder *d) {
+    av_frame_free(&d->frame);
+    avcodec_free_context(&d->codecContext);
+}
@@ -0,0 +1,53 @@
+#ifndef DECODER_H_
+#define DECODER_H_
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "packet_queue.h"
+#include "sched.h"
+#include "bench.h"
+
+/*
+ * Decoding stage, turning the packets of one PacketQueue into frames. It
+ * runs as a scheduler task whose run function, supplied by the owner, calls
+ * decoder_decode_frame and passes the frames on. Nothing blocks: with the
+ * queue empty the task goes idle until the demuxer queues a packet, and a
+ * frame with no room downstream is held in frame across slices.
+ *
+ * Packets queued before a seek are dropped and the codec is flushed once
+ * the queue serial moves on. Used by the player's audio and video decoders
+ * and by SPlayer.
+ */
+typedef struct Decoder {
+    PacketQueue     *queue;
+    AVCodecContext  *codecContext;
+    SchedTask       task;           // Runs the owner's decode loop
+    AVFrame         *frame;         // Frame being passed on, kept across slices
+    int             frame_held;     // frame waits for room downstream
+    int             last_serial;    // Serial of the last frame passed on, owner's
+
+    StageStats      *stats;         // Only set in benchmark mode
+    int64_t         pkt_time;       // Decode time spent on the current packet
+    int             pkt_pending;
+    int64_t         wait_start;     // bench_now() the queue ran dry at, 0 if it did not
+
+    int             pkt_serial;     // Serial of the last packet, and of the frames returned
+
+    int             metric;         // METRIC_* receiving the decode time per frame, -1 for none
+    int64_t         frame_time;     // Decode time spent towards the next frame
+
+    int             finished;       // Reported its stream drained, owner's
+} Decoder;
+
+AVCodecContext *decoder_alloc_context(AVStream *st);
+int decoder_init(Decoder *d, AVCodecContext *codecContext, PacketQueue *queue,
+                 int (*run)(SchedTask *task), void *opaque, int priority);
+void decoder_start(Decoder *d, Scheduler *s, SchedTask *producer, Histogram *wakeup);
+void decoder_stop(Decoder *d, Scheduler *s);
+int decoder_decode_frame(Decoder *d, AVFrame *frame);
+void decoder_destroy(Decoder *d);
+
+#endif /* DECODER_H_ */
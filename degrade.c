@@ -0,0 +1,158 @@
+#include <math.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "degrade.h"
+
+// Frames this late against the master clock count as behind, in seconds
+#define DEGRADE_LATE 0.1
+// Decoded frames waiting, as a share of the queue, below which the
+// decoder is not ahead enough to absorb lateness
+#define DEGRADE_FILL_LOW 0.125
+// Above which, with frames no longer late, it is caught up
+#define DEGRADE_FILL_HIGH 0.5
+// Seconds behind before stepping down, also the minimum between two steps
+#define DEGRADE_DOWN_TIME 0.5
+// Seconds caught up before stepping back up, doubled up to the max every
+// time the decoder falls behind again right after a step up
+#define DEGRADE_UP_TIME 3.0
+#define DEGRADE_UP_TIME_MAX 30.0
+
+typedef struct DegradeLevel {
+    const char      *name;
+    enum AVDiscard  skip_loop_filter;
+    enum AVDiscard  skip_idct;
+    enum AVDiscard  skip_frame;
+} DegradeLevel;
+
+static const DegradeLevel levels[DEGRADE_NB] = {
+    [DEGRADE_FULL]        = { "full",                AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+    [DEGRADE_LOOP_FILTER] = { "skip loop filter",    AVDISCARD_ALL,     AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+    [DEGRADE_IDCT]        = { "skip non-ref IDCT",   AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_DEFAULT },
+    [DEGRADE_NONREF]      = { "skip non-ref frames", AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_NONREF },
+    [DEGRADE_NONKEY]      = { "skip non-key frames", AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_NONKEY },
+};
+
+
+/**
+ * Clear the counts, once per file. The level gauge is left to
+ * degrade_reset, the file may be opened ahead while another one plays.
+ */
+void degrade_init(DegradeControl *dc, double now) {
+    memset(dc, 0, sizeof(DegradeControl));
+    dc->level_since = now;
+    dc->up_wait = DEGRADE_UP_TIME;
+}
+
+/**
+ * Start over at full decoding for a new decoder, keeping the counts and
+ * times at each level for the report
+ */
+void degrade_reset(DegradeControl *dc, double now) {
+    dc->time_at[dc->level] += now - dc->level_since;
+    dc->level = DEGRADE_FULL;
+    dc->level_since = now;
+    dc->behind_since = 0;
+    dc->caught_up_since = 0;
+    dc->last_up = 0;
+    dc->up_wait = DEGRADE_UP_TIME;
+    metric_set(METRIC_DECODE_LEVEL, DEGRADE_FULL);
+}
+
+const char *degrade_level_name(int level) {
+    return levels[level].name;
+}
+
+static void degrade_set_level(DegradeControl *dc, int level, double now) {
+    dc->time_at[dc->level] += now - dc->level_since;
+    dc->level = level;
+    dc->level_since = now;
+    dc->behind_since = 0;
+    dc->caught_up_since = 0;
+    metric_set(METRIC_DECODE_LEVEL, level);
+}
+
+/**
+ * Feed the controller with a frame just decoded
+ * @param dc pointer to DegradeControl
+ * @param late master clock minus the frame's pts in seconds, NAN if unknown
+ *        (no clock yet, or right after a seek)
+ * @param fill decoded frames waiting to be shown, as a share of the queue
+ * @param now wall time
+ * @return 1 if the level changed, degrade_apply it
+ */
+int degrade_update(DegradeControl *dc, double late, double fill, double now) {
+    int behind, caught_up;
+
+    if (isnan(late)) {
+        dc->behind_since = 0;
+        dc->caught_up_since = 0;
+        return 0;
+    }
+
+    behind = late > DEGRADE_LATE && fill < DEGRADE_FILL_LOW;
+    caught_up = late <= 0 && fill >= DEGRADE_FILL_HIGH;
+
+    if (!behind)
+        dc->behind_since = 0;
+    else if (!dc->behind_since)
+        dc->behind_since = now;
+    if (!caught_up)
+        dc->caught_up_since = 0;
+    else if (!dc->caught_up_since)
+        dc->caught_up_since = now;
+
+    if (behind && dc->level < DEGRADE_NB - 1 && now - dc->behind_since >= DEGRADE_DOWN_TIME
+            && now - dc->level_since >= DEGRADE_DOWN_TIME) {
+        // The last step up did not hold, wait longer before the next one
+        if (dc->last_up > 0 && now - dc->last_up < dc->up_wait)
+            dc->up_wait = FFMIN(dc->up_wait * 2, DEGRADE_UP_TIME_MAX);
+        degrade_set_level(dc, dc->level + 1, now);
+        dc->entered[dc->level]++;
+        metric_add(METRIC_DECODE_DEGRADES, 1);
+        LOG_WARN("Video decoder falling behind (%.0f ms late): %s", late * 1000, levels[dc->level].name);
+        return 1;
+    }
+
+    if (caught_up && dc->level > DEGRADE_FULL && now - dc->caught_up_since >= dc->up_wait) {
+        degrade_set_level(dc, dc->level - 1, now);
+        dc->last_up = now;
+        log_info("Video decoder caught up: %s", levels[dc->level].name);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Set the codec's skip options for the current level. Frame threads pick
+ * them up with the next packet.
+ */
+void degrade_apply(const DegradeControl *dc, AVCodecContext *codecContext) {
+    const DegradeLevel *l = &levels[dc->level];
+
+    codecContext->skip_loop_filter = l->skip_loop_filter;
+    codecContext->skip_idct = l->skip_idct;
+    codecContext->skip_frame = l->skip_frame;
+}
+
+void degrade_report(DegradeControl *dc, double now) {
+    int i;
+
+    dc->time_at[dc->level] += now - dc->level_since;
+    dc->level_since = now;
+
+    for (i = DEGRADE_FULL + 1; i < DEGRADE_NB; i++)
+        if (dc->entered[i])
+            break;
+    if (i == DEGRADE_NB)
+        return;
+
+    for (i = DEGRADE_FULL; i < DEGRADE_NB; i++)
+        log_info("Decode level %-20s entered %3d times, %7.1f s", levels[i].name,
+                 dc->entered[i], dc->time_at[i]);
+}
@@ -0,0 +1,44 @@
+#ifndef DEGRADE_H_
+#define DEGRADE_H_
+
+#include <libavcodec/avcodec.h>
+
+enum {
+    DEGRADE_FULL,                   // Everything decoded
+    DEGRADE_LOOP_FILTER,            // No deblocking
+    DEGRADE_IDCT,                   // No IDCT on non-reference frames
+    DEGRADE_NONREF,                 // Non-reference frames skipped
+    DEGRADE_NONKEY,                 // Only keyframes decoded
+    DEGRADE_NB
+};
+
+/*
+ * Steps the video decoder down to cheaper decoding while it cannot keep up,
+ * and back up once it does again. Falling behind means frames come out of
+ * the decoder late against the master clock while few decoded frames wait
+ * to be shown; being caught up means frames are early and the queue is
+ * well filled. Stepping down takes a short spell behind, stepping up a much
+ * longer spell caught up, which grows every time a step up did not last.
+ * Only used from the video decoder task, and by the report once it is
+ * gone. The counts cover every decoder of the file, also across switches.
+ */
+typedef struct DegradeControl {
+    int             level;          // DEGRADE_*
+    double          level_since;    // Wall time the level was entered
+    double          behind_since;   // Wall time the decoder fell behind, 0 if it is not
+    double          caught_up_since; // Wall time it has been caught up since, 0 if it is not
+    double          last_up;        // Wall time of the last step back up
+    double          up_wait;        // Time caught up needed to step back up
+
+    int             entered[DEGRADE_NB]; // Times each level was stepped down to
+    double          time_at[DEGRADE_NB]; // Seconds spent at each level
+} DegradeControl;
+
+void degrade_init(DegradeControl *dc, double now);
+void degrade_reset(DegradeControl *dc, double now);
+int degrade_update(DegradeControl *dc, double late, double fill, double now);
+void degrade_apply(const DegradeControl *dc, AVCodecContext *codecContext);
+const char *degrade_level_name(int level);
+void degrade_report(DegradeControl *dc, double now);
+
+#endif /* DEGRADE_H_ */
@@ -0,0 +1,330 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "probe_cache.h"
+#include "trace.h"
+#include "demux.h"
+
+/**
+ * Prepare a Demuxer with no input and no streams selected
+ * @param d pointer to Demuxer
+ */
+int demux_init(Demuxer *d) {
+    int type;
+
+    memset(d, 0, sizeof(Demuxer));
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        d->stream[type] = -1;
+    d->pending = -1;
+
+    d->packet = av_packet_alloc();
+    if (!d->packet) {
+        LOG_ERR("Could not allocate memory for packet");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open the input and read its header
+ * @param d pointer to Demuxer
+ * @param url file to open
+ * @param pb custom I/O to read from, NULL to have libavformat open url.
+ *           Still the caller's to close afterwards.
+ * @param interrupt lets blocking reads give up, NULL for none
+ * @param opaque for interrupt
+ * @param probesize bytes to probe, 0 for libavformat's default
+ * @param analyzeduration seconds to analyze, 0 for libavformat's default
+ */
+int demux_open(Demuxer *d, const char *url, AVIOContext *pb, int (*interrupt)(void *), void *opaque,
+               int64_t probesize, double analyzeduration) {
+    AVFormatContext *ic;
+
+    ic = avformat_alloc_context();
+    if (!ic) {
+        LOG_ERR("Could not allocate format context");
+        return -1;
+    }
+    ic->interrupt_callback.callback = interrupt;
+    ic->interrupt_callback.opaque = opaque;
+
+    if (probesize > 0)
+        ic->probesize = probesize;
+    if (analyzeduration > 0)
+        ic->max_analyze_duration = analyzeduration * AV_TIME_BASE;
+    if (pb) {
+        ic->pb = pb;
+        ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // Frees ic on failure
+    if (avformat_open_input(&ic, url, NULL, NULL) < 0) {
+        LOG_ERR("Could not open %s", url);
+        return -1;
+    }
+    d->ic = ic;
+
+    return 0;
+}
+
+/**
+ * Find the stream parameters, from the probe cache if allowed and valid
+ * @param d pointer to Demuxer, opened
+ * @param url file opened, the cache is kept next to it
+ * @param use_cache load and save the probe cache
+ * @return 1 if the parameters came from the cache, 0 if probed, < 0 on error
+ */
+int demux_probe(Demuxer *d, const char *url, int use_cache) {
+    int nb_opened_streams = d->ic->nb_streams;
+
+    if (use_cache && probe_cache_load(d->ic, url) == 0)
+        return 1;
+
+    if (avformat_find_stream_info(d->ic, NULL) < 0) {
+        LOG_ERR("Could not find stream info: %s", url);
+        return -1;
+    }
+    if (use_cache)
+        probe_cache_save(d->ic, url, nb_opened_streams);
+
+    return 0;
+}
+
+/**
+ * Pick the stream of a type to play. A spec selects by stream index,
+ * language tag or codec name; without one, or when nothing matches, the
+ * stream libavformat considers best is taken.
+ * @param ic format context with the stream parameters known
+ * @param type AVMEDIA_TYPE_AUDIO or AVMEDIA_TYPE_VIDEO
+ * @param spec --audio-stream/--video-stream value, NULL for none
+ * @param related stream the pick should belong with, -1 for none
+ * @return the stream index, -1 if the file has no stream of the type
+ */
+int demux_find_stream(AVFormatContext *ic, enum AVMediaType type, const char *spec, int related) {
+    AVDictionaryEntry *lang;
+    AVStream *st;
+    char *end;
+    long index;
+    int i, ret;
+
+    if (spec) {
+        index = strtol(spec, &end, 10);
+        if (*spec && !*end) {
+            if (index >= 0 && index < ic->nb_streams
+                    && ic->streams[index]->codecpar->codec_type == type)
+                return index;
+        } else {
+            for (i = 0; i < ic->nb_streams; i++) {
+                st = ic->streams[i];
+                if (st->codecpar->codec_type != type)
+                    continue;
+                lang = av_dict_get(st->metadata, "language", NULL, 0);
+                if ((lang && av_strcasecmp(lang->value, spec) == 0)
+                        || av_strcasecmp(avcodec_get_name(st->codecpar->codec_id), spec) == 0)
+                    return i;
+            }
+        }
+        LOG_WARN("No %s stream matches %s, using the default one", av_get_media_type_string(type), spec);
+    }
+
+    ret = av_find_best_stream(ic, type, -1, related, NULL, 0);
+    return ret >= 0 ? ret : -1;
+}
+
+/**
+ * Queue the packets of the given streams and have the demuxer drop all
+ * others, so unused tracks are neither parsed nor, where the container
+ * allows skipping them, read
+ * @param d pointer to Demuxer, opened
+ * @param video stream index, -1 for none
+ * @param audio stream index, -1 for none
+ * @return the number of streams selected
+ */
+int demux_select(Demuxer *d, int video, int audio) {
+    int i;
+
+    d->stream[AVMEDIA_TYPE_VIDEO] = video;
+    d->stream[AVMEDIA_TYPE_AUDIO] = audio;
+    for (i = 0; i < d->ic->nb_streams; i++)
+        d->ic->streams[i]->discard = (i == video || i == audio) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    return (video >= 0) + (audio >= 0);
+}
+
+/**
+ * Queue the packet waiting for room
+ */
+static int demux_put(Demuxer *d) {
+    int type = d->pending;
+
+    // Its stream was deselected meanwhile
+    if (d->packet->stream_index != d->stream[type] || !d->queue[type]) {
+        av_packet_unref(d->packet);
+        d->pending = -1;
+        return DEMUX_PACKET;
+    }
+
+    if (packet_queue_put(d->queue[type], d->packet) == AVERROR(EAGAIN)) {
+        if (d->stats && !d->wait_start)
+            d->wait_start = bench_now();
+        return DEMUX_FULL;
+    }
+
+    if (d->stats) {
+        histogram_add(&d->stats->wait, d->wait_start ? bench_now() - d->wait_start : 0);
+        d->wait_start = 0;
+    }
+    d->pending = -1;
+    return DEMUX_PACKET;
+}
+
+/**
+ * Queue the null packets that make the decoders drain their last frames
+ */
+static int demux_flush(Demuxer *d) {
+    int type;
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (!d->flush[type])
+            continue;
+        if (packet_queue_put_nullpacket(d->queue[type]) == AVERROR(EAGAIN))
+            return DEMUX_FULL;
+        d->flush[type] = 0;
+    }
+    return DEMUX_EOF;
+}
+
+/**
+ * Read the next packet and queue it for its decoder
+ * @param d pointer to Demuxer, opened
+ * @return DEMUX_*, or a read error < 0
+ */
+int demux_step(Demuxer *d) {
+    AVFormatContext *ic = d->ic;
+    int64_t t0 = 0;
+    int type, ret;
+
+    if (d->pending >= 0)
+        return demux_put(d);
+
+    if (d->stats)
+        t0 = bench_now();
+
+    TRACE_BEGIN("demux");
+    ret = av_read_frame(ic, d->packet);
+    TRACE_END("demux");
+    if (ret < 0) {
+        if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !d->eof) {
+            d->eof = 1;
+            for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+                d->flush[type] = d->stream[type] >= 0 && d->queue[type];
+        }
+        if (d->eof && demux_flush(d) == DEMUX_FULL)
+            return DEMUX_FULL;
+        if (ic->pb && ic->pb->error)
+            return ic->pb->error;
+        // At EOF nothing comes until a seek, other errors (e.g. EAGAIN)
+        // are retried shortly
+        return d->eof ? DEMUX_EOF : DEMUX_RETRY;
+    }
+
+    d->packets++;
+    if (d->stats) {
+        histogram_add(&d->stats->latency, bench_now() - t0);
+        d->stats->packets++;
+        d->stats->bytes += d->packet->size;
+    }
+    if (d->on_packet)
+        d->on_packet(d->opaque, d->packet);
+
+    // Only queue packets for streams that have a decoder draining them,
+    // otherwise the bounded queue fills up and stops the demuxer
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (d->queue[type] && d->packet->stream_index == d->stream[type]) {
+            d->pending = type;
+            return demux_put(d);
+        }
+    }
+
+    av_packet_unref(d->packet);
+    return DEMUX_PACKET;
+}
+
+/**
+ * Check whether every active queue reached its read-ahead limit
+ */
+static int demux_readahead_full(Demuxer *d) {
+    int type, active = 0, full = 0;
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (d->stream[type] >= 0 && d->queue[type]) {
+            active++;
+            full += packet_queue_has_enough(d->queue[type]);
+        }
+    }
+
+    return active > 0 && full == active;
+}
+
+/**
+ * Check whether any active queue drained below its low-water mark
+ */
+static int demux_readahead_low(Demuxer *d) {
+    int type;
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        if (d->stream[type] >= 0 && d->queue[type] && packet_queue_below_low_water(d->queue[type]))
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Check whether to stop reading for now: once every active queue holds
+ * enough read-ahead, until one of the decoders drains its queue below the
+ * low-water mark. Their gets submit the producer task then.
+ * @param d pointer to Demuxer
+ * @return 1 to stop reading
+ */
+int demux_readahead_wait(Demuxer *d) {
+    if (d->readahead_wait && !demux_readahead_low(d))
+        return 1;
+
+    d->readahead_wait = demux_readahead_full(d);
+    return d->readahead_wait;
+}
+
+/**
+ * Forget the position read so far after the owner seeked the input: the
+ * packet waiting for room is dropped and the end is no longer reached
+ * @param d pointer to Demuxer
+ */
+void demux_seeked(Demuxer *d) {
+    int type;
+
+    if (d->pending >= 0)
+        av_packet_unref(d->packet);
+    d->pending = -1;
+    d->eof = 0;
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        d->flush[type] = 0;
+    d->readahead_wait = 0;
+    d->wait_start = 0;
+}
+
+/**
+ * Close the input and free the packet. Custom I/O given to demux_open is
+ * left to the caller.
+ * @param d pointer to Demuxer
+ */
+void demux_close(Demuxer *d) {
+    avformat_close_input(&d->ic);
+    av_packet_free(&d->packet);
+}
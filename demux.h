@@ -0,0 +1,58 @@
+#ifndef DEMUX_H_
+#define DEMUX_H_
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include "packet_queue.h"
+#include "bench.h"
+
+// What demux_step did, errors are < 0
+enum {
+    DEMUX_PACKET,                   // Read a packet and queued or dropped it
+    DEMUX_FULL,                     // Its queue is full, it is queued on the next call
+    DEMUX_EOF,                      // At the end, the decoders got their null packets
+    DEMUX_RETRY                     // Nothing to read right now, try again shortly
+};
+
+/*
+ * Demuxing stage, reading packets and queueing them for the decoders of
+ * the selected streams. It runs a packet per demux_step call from the run
+ * function of the owner's task. Nothing blocks on a queue: a packet whose
+ * queue is full is kept for the next call, and the task goes idle until
+ * the decoder takes a packet and submits it.
+ *
+ * Besides the hard queue limits, the owner can stop at the read-ahead
+ * limits with demux_readahead_wait. Used by the player's parse task and by
+ * SPlayer.
+ */
+typedef struct Demuxer {
+    AVFormatContext *ic;
+    PacketQueue     *queue[AVMEDIA_TYPE_NB]; // Where each type's packets go, NULL for none
+    int             stream[AVMEDIA_TYPE_NB]; // Stream index queued per type, -1 for none
+    AVPacket        *packet;
+    int             pending;        // Type of the packet waiting for room, -1 for none
+    int             eof;            // Read to the end, until demux_seeked
+    int             flush[AVMEDIA_TYPE_NB]; // Null packet still to queue at eof
+    int             readahead_wait; // Stopped at the read-ahead limits, until below low water
+
+    StageStats      *stats;         // Only set in benchmark mode
+    int64_t         wait_start;     // bench_now() a queue was found full at, 0 if not
+    void            (*on_packet)(void *opaque, AVPacket *pkt); // Every packet read, NULL for none
+    void            *opaque;
+    int64_t         packets;        // Read so far
+} Demuxer;
+
+int demux_init(Demuxer *d);
+int demux_open(Demuxer *d, const char *url, AVIOContext *pb, int (*interrupt)(void *), void *opaque,
+               int64_t probesize, double analyzeduration);
+int demux_probe(Demuxer *d, const char *url, int use_cache);
+int demux_find_stream(AVFormatContext *ic, enum AVMediaType type, const char *spec, int related);
+int demux_select(Demuxer *d, int video, int audio);
+int demux_step(Demuxer *d);
+int demux_readahead_wait(Demuxer *d);
+void demux_seeked(Demuxer *d);
+void demux_close(Demuxer *d);
+
+#endif /* DEMUX_H_ */
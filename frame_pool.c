@@ -0,0 +1,169 @@
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "frame_pool.h"
+
+// Slack past each plane for SIMD overreads and pointer alignment, as
+// libavcodec's own pool leaves
+#define FRAME_POOL_PADDING (16 + 64 - 1)
+
+
+static AVBufferRef *frame_pool_alloc(void *opaque, int size) {
+    FramePool *fp = opaque;
+
+    SDL_AtomicAdd(&fp->allocs, 1);
+    return av_buffer_allocz(size);
+}
+
+/**
+ * Size the plane pools for a new frame layout, with the same alignment
+ * avcodec_default_get_buffer2 uses. Buffers of the old layout still in use
+ * are freed when they come back.
+ * @param fp pointer to FramePool, mutex held
+ * @param codecContext codec asking for the frame
+ * @param frame frame with format, width and height set
+ */
+static int frame_pool_resize(FramePool *fp, AVCodecContext *codecContext, AVFrame *frame) {
+    uint8_t *data[4];
+    int linesize[4], linesize_align[AV_NUM_DATA_POINTERS];
+    int sizes[4] = { 0 };
+    int w = frame->width, h = frame->height;
+    int i, size, unaligned;
+
+    for (i = 0; i < 4; i++)
+        av_buffer_pool_uninit(&fp->pools[i]);
+    fp->format = AV_PIX_FMT_NONE;
+
+    avcodec_align_dimensions2(codecContext, &w, &h, linesize_align);
+    do {
+        if ((size = av_image_fill_linesizes(linesize, frame->format, w)) < 0)
+            return size;
+        w += w & ~(w - 1);
+
+        unaligned = 0;
+        for (i = 0; i < 4; i++)
+            unaligned |= linesize[i] % linesize_align[i];
+    } while (unaligned);
+
+    size = av_image_fill_pointers(data, frame->format, h, NULL, linesize);
+    if (size < 0)
+        return size;
+    for (i = 0; i < 3 && data[i + 1]; i++)
+        sizes[i] = data[i + 1] - data[i];
+    sizes[i] = size - (data[i] - data[0]);
+
+    for (i = 0; i < 4 && sizes[i]; i++) {
+        fp->pools[i] = av_buffer_pool_init2(sizes[i] + FRAME_POOL_PADDING, fp, frame_pool_alloc, NULL);
+        if (!fp->pools[i])
+            return AVERROR(ENOMEM);
+        fp->linesize[i] = linesize[i];
+    }
+
+    fp->format = frame->format;
+    fp->width = frame->width;
+    fp->height = frame->height;
+    SDL_AtomicAdd(&fp->resizes, 1);
+    LOG_DEBUG("Frame pool sized for %s %dx%d", av_get_pix_fmt_name(frame->format),
+              frame->width, frame->height);
+
+    return 0;
+}
+
+/**
+ * get_buffer2 callback handing out pooled buffers
+ */
+static int frame_pool_get_buffer(AVCodecContext *codecContext, AVFrame *frame, int flags) {
+    FramePool *fp = codecContext->opaque;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int i, ret = 0;
+
+    // Hardware frames and palettes are left to libavcodec
+    if (codecContext->hw_frames_ctx || !desc
+            || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+        return avcodec_default_get_buffer2(codecContext, frame, flags);
+
+    SDL_LockMutex(fp->mutex);
+    if (frame->format != fp->format || frame->width != fp->width || frame->height != fp->height)
+        ret = frame_pool_resize(fp, codecContext, frame);
+
+    for (i = 0; ret >= 0 && i < 4 && fp->pools[i]; i++) {
+        frame->buf[i] = av_buffer_pool_get(fp->pools[i]);
+        if (!frame->buf[i]) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = fp->linesize[i];
+    }
+    SDL_UnlockMutex(fp->mutex);
+
+    if (ret < 0) {
+        av_frame_unref(frame);
+        return ret;
+    }
+
+    frame->extended_data = frame->data;
+    SDL_AtomicAdd(&fp->gets, 1);
+
+    return 0;
+}
+
+/**
+ * Make a video codec allocate its frames from the pool. Must be called
+ * before avcodec_open2; the pool lives as long as the codec context.
+ * Codecs that cannot decode into caller buffers keep their own.
+ * @param fp pointer to FramePool
+ * @param codecContext video codec context, not opened yet
+ */
+int frame_pool_init(FramePool *fp, AVCodecContext *codecContext) {
+    memset(fp, 0, sizeof(FramePool));
+    fp->format = AV_PIX_FMT_NONE;
+
+    if (!(codecContext->codec->capabilities & AV_CODEC_CAP_DR1))
+        return 0;
+
+    fp->mutex = SDL_CreateMutex();
+    if (!fp->mutex) {
+        LOG_ERR("Could not create frame pool mutex: %s", SDL_GetError());
+        return -1;
+    }
+
+    codecContext->opaque = fp;
+    codecContext->get_buffer2 = frame_pool_get_buffer;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+    // Frame threads call get_buffer2 themselves instead of waiting on the decoder thread
+    codecContext->thread_safe_callbacks = 1;
+#endif
+
+    return 0;
+}
+
+/**
+ * Release the pools. Buffers still held by frames stay valid and are freed
+ * with their last reference.
+ * @param fp pointer to FramePool, the codec using it must be freed already
+ */
+void frame_pool_destroy(FramePool *fp) {
+    int i;
+
+    for (i = 0; i < 4; i++)
+        av_buffer_pool_uninit(&fp->pools[i]);
+    if (fp->mutex)
+        SDL_DestroyMutex(fp->mutex);
+    fp->mutex = NULL;
+}
+
+void frame_pool_report(FramePool *fp) {
+    if (!fp->mutex)
+        return;
+
+    log_info("Frame pool: %d buffers handed out, %d allocated, %d resizes",
+             SDL_AtomicGet(&fp->gets), SDL_AtomicGet(&fp->allocs), SDL_AtomicGet(&fp->resizes));
+}
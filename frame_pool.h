@@ -0,0 +1,32 @@
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+
+#include <SDL2/SDL.h>
+
+/*
+ * Decoder frame buffers recycled through one AVBufferPool per plane. The
+ * codec's get_buffer2 takes its buffers from here; a frame holds references
+ * to them until its last AVFrame is unreferenced, then they go back to the
+ * pool. Steady-state decoding then allocates no frame buffers at all.
+ */
+typedef struct FramePool {
+    SDL_mutex       *mutex;         // Guards resizing, frame threads allocate concurrently
+    AVBufferPool    *pools[4];
+    int             linesize[4];
+    int             format;         // Frame layout the pools are sized for
+    int             width;
+    int             height;
+
+    SDL_atomic_t    gets;           // Buffers handed to the codec
+    SDL_atomic_t    allocs;         // Buffers created because the pool was empty
+    SDL_atomic_t    resizes;        // Pools recreated for a new format or size
+} FramePool;
+
+int frame_pool_init(FramePool *fp, AVCodecContext *codecContext);
+void frame_pool_destroy(FramePool *fp);
+void frame_pool_report(FramePool *fp);
+
+#endif /* FRAME_POOL_H_ */
@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "histogram.h"
+
+
+static int bucket_index(uint64_t value) {
+    int e;
+
+    if (value < HISTOGRAM_SUB)
+        return value;
+
+    e = 63 - __builtin_clzll(value);
+    return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+        + ((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+/**
+ * Midpoint of the values that land in a bucket
+ */
+static int64_t bucket_value(int index) {
+    int octave, e;
+
+    if (index < HISTOGRAM_SUB)
+        return index;
+
+    octave = index / HISTOGRAM_SUB;
+    e = octave + HISTOGRAM_SUB_BITS - 1;
+    return ((int64_t)(HISTOGRAM_SUB + index % HISTOGRAM_SUB) << (e - HISTOGRAM_SUB_BITS))
+        + ((int64_t)1 << (e - HISTOGRAM_SUB_BITS)) / 2;
+}
+
+void histogram_reset(Histogram *h) {
+    memset(h, 0, sizeof(Histogram));
+}
+
+/**
+ * Add a sample, negative values are counted as 0
+ * @param h pointer to Histogram
+ * @param value sample to add
+ */
+void histogram_add(Histogram *h, int64_t value) {
+    if (value < 0)
+        value = 0;
+
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+}
+
+/**
+ * Approximate the value below which p percent of the samples fall
+ * @param h pointer to Histogram
+ * @param p percentile, 0 - 100
+ */
+int64_t histogram_percentile(const Histogram *h, double p) {
+    uint64_t target, seen = 0;
+    int64_t value;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (uint64_t)(h->count * p / 100.0);
+    if (target >= h->count)
+        target = h->count - 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target) {
+            value = bucket_value(i);
+            if (value < h->min)
+                return h->min;
+            if (value > h->max)
+                return h->max;
+            return value;
+        }
+    }
+
+    return h->max;
+}
+
+double histogram_mean(const Histogram *h) {
+    return h->count ? h->sum / h->count : 0;
+}
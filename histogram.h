@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB * (64 - HISTOGRAM_SUB_BITS + 1))
+
+/*
+ * Log-linear histogram of non-negative integer samples (usually microseconds).
+ * Every power of two is split into HISTOGRAM_SUB buckets, which keeps the
+ * relative error of percentiles around 6% with no allocation on add.
+ * Not thread safe, each histogram should have a single writer.
+ */
+typedef struct Histogram {
+    uint32_t        buckets[HISTOGRAM_BUCKETS];
+    uint64_t        count;
+    int64_t         min;
+    int64_t         max;
+    double          sum;
+} Histogram;
+
+void histogram_reset(Histogram *h);
+void histogram_add(Histogram *h, int64_t value);
+int64_t histogram_percentile(const Histogram *h, double p);
+double histogram_mean(const Histogram *h);
+
+#endif /* HISTOGRAM_H_ */
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "logging.h"
+#include "keyframe_index.h"
+
+#define KEYFRAME_CACHE_SUFFIX ".kfi"
+#define KEYFRAME_CACHE_MAGIC 0x49464b53 // "SKFI"
+#define KEYFRAME_CACHE_VERSION 1
+
+/*
+ * Sidecar file layout, native endianness since the cache never leaves the
+ * machine: header followed by nb_entries KeyframeEntry records.
+ */
+typedef struct KeyframeCacheHeader {
+    uint32_t        magic;
+    uint32_t        version;
+    int64_t         file_size;      // Of the media file, to detect changes
+    int64_t         file_mtime;
+    int32_t         stream_index;
+    int32_t         tb_num;
+    int32_t         tb_den;
+    int32_t         nb_entries;
+} KeyframeCacheHeader;
+
+
+void keyframe_index_init(KeyframeIndex *idx, int stream_index, AVRational time_base) {
+    memset(idx, 0, sizeof(KeyframeIndex));
+    idx->stream_index = stream_index;
+    idx->time_base = time_base;
+    idx->last = -1;
+}
+
+void keyframe_index_free(KeyframeIndex *idx) {
+    av_freep(&idx->entries);
+    idx->nb_entries = 0;
+    idx->size = 0;
+}
+
+/**
+ * Find the first entry with a pts greater than or equal to pts
+ */
+static int lower_bound(const KeyframeIndex *idx, int64_t pts) {
+    int lo = 0, hi = idx->nb_entries, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (idx->entries[mid].pts < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Record a keyframe that was just read
+ * @param idx pointer to KeyframeIndex
+ * @param pts keyframe timestamp, in the stream time base
+ * @param dts keyframe decode timestamp, in the stream time base
+ * @param pos byte position of the packet
+ */
+int keyframe_index_add(KeyframeIndex *idx, int64_t pts, int64_t dts, int64_t pos) {
+    KeyframeEntry *e;
+    int i;
+
+    i = lower_bound(idx, pts);
+    if (i < idx->nb_entries && idx->entries[i].pts == pts) {
+        e = &idx->entries[i];
+    } else {
+        if (idx->nb_entries == idx->size) {
+            if (av_reallocp_array(&idx->entries, FFMAX(256, idx->size * 2), sizeof(KeyframeEntry)) < 0) {
+                idx->nb_entries = idx->size = 0;
+                return -1;
+            }
+            idx->size = FFMAX(256, idx->size * 2);
+        }
+
+        memmove(&idx->entries[i + 1], &idx->entries[i],
+                (idx->nb_entries - i) * sizeof(KeyframeEntry));
+        idx->nb_entries++;
+        if (idx->last >= i)
+            idx->last++;
+
+        e = &idx->entries[i];
+        e->pts = pts;
+        e->dts = dts;
+        e->pos = pos;
+        e->linked = 0;
+        idx->dirty = 1;
+    }
+
+    // Read straight after the keyframe before it, no GOP can be missing
+    if (idx->last >= 0 && idx->last == i - 1 && !e->linked) {
+        e->linked = 1;
+        idx->dirty = 1;
+    }
+    idx->last = i;
+
+    return 0;
+}
+
+/**
+ * Mark a discontinuity in reading, e.g. after a seek
+ */
+void keyframe_index_break(KeyframeIndex *idx) {
+    idx->last = -1;
+}
+
+/**
+ * Find the keyframe that starts the GOP containing pts. Only succeeds when
+ * the GOP is known to be complete, i.e. the next entry is linked to it.
+ * @param idx pointer to KeyframeIndex
+ * @param pts target timestamp, in the stream time base
+ * @return the entry, or NULL if the index does not cover pts
+ */
+const KeyframeEntry *keyframe_index_lookup(const KeyframeIndex *idx, int64_t pts) {
+    int i;
+
+    i = lower_bound(idx, pts + 1) - 1;
+    if (i < 0 || i + 1 >= idx->nb_entries || !idx->entries[i + 1].linked)
+        return NULL;
+
+    return &idx->entries[i];
+}
+
+static int cache_key(const char *url, int64_t *size, int64_t *mtime) {
+    struct stat st;
+
+    if (stat(url, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+/**
+ * Load the sidecar cache of a local file, if it matches the file
+ * @param idx initialized KeyframeIndex, the stream must match the cache
+ * @param url media file path
+ */
+int keyframe_index_load(KeyframeIndex *idx, const char *url) {
+    char path[1024];
+    KeyframeCacheHeader hdr;
+    KeyframeEntry *entries;
+    struct stat st;
+    int64_t size, mtime;
+    FILE *f;
+    int i;
+
+    if (cache_key(url, &size, &mtime) < 0)
+        return -1;
+
+    av_strlcpy(path, url, sizeof(path));
+    av_strlcat(path, KEYFRAME_CACHE_SUFFIX, sizeof(path));
+
+    f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+            || hdr.magic != KEYFRAME_CACHE_MAGIC || hdr.version != KEYFRAME_CACHE_VERSION
+            || hdr.file_size != size || hdr.file_mtime != mtime
+            || hdr.stream_index != idx->stream_index
+            || hdr.tb_num != idx->time_base.num || hdr.tb_den != idx->time_base.den
+            || hdr.nb_entries <= 0) {
+        LOG_WARN("Ignoring stale keyframe cache %s", path);
+        fclose(f);
+        return -1;
+    }
+
+    // The count has to match the entries actually there before it is
+    // trusted with an allocation
+    if (fstat(fileno(f), &st) < 0
+            || st.st_size != sizeof(hdr) + (int64_t)hdr.nb_entries * sizeof(KeyframeEntry)) {
+        LOG_WARN("Ignoring corrupt keyframe cache %s", path);
+        fclose(f);
+        return -1;
+    }
+
+    entries = av_malloc_array(hdr.nb_entries, sizeof(KeyframeEntry));
+    if (!entries || fread(entries, sizeof(KeyframeEntry), hdr.nb_entries, f) != hdr.nb_entries) {
+        av_free(entries);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    // Lookups are binary searches
+    for (i = 1; i < hdr.nb_entries; i++) {
+        if (entries[i].pts <= entries[i - 1].pts) {
+            LOG_WARN("Ignoring corrupt keyframe cache %s", path);
+            av_free(entries);
+            return -1;
+        }
+    }
+
+    keyframe_index_free(idx);
+    idx->entries = entries;
+    idx->nb_entries = idx->size = hdr.nb_entries;
+    idx->last = -1;
+    idx->dirty = 0;
+
+    log_info("Loaded %d keyframes from %s", idx->nb_entries, path);
+    return 0;
+}
+
+/**
+ * Write the index next to a local media file, if it changed
+ * @param idx pointer to KeyframeIndex
+ * @param url media file path
+ */
+int keyframe_index_save(KeyframeIndex *idx, const char *url) {
+    char path[1024];
+    KeyframeCacheHeader hdr;
+    FILE *f;
+    int ret = 0;
+
+    if (!idx->dirty || !idx->nb_entries)
+        return 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (cache_key(url, &hdr.file_size, &hdr.file_mtime) < 0)
+        return -1;
+
+    hdr.magic = KEYFRAME_CACHE_MAGIC;
+    hdr.version = KEYFRAME_CACHE_VERSION;
+    hdr.stream_index = idx->stream_index;
+    hdr.tb_num = idx->time_base.num;
+    hdr.tb_den = idx->time_base.den;
+    hdr.nb_entries = idx->nb_entries;
+
+    av_strlcpy(path, url, sizeof(path));
+    av_strlcat(path, KEYFRAME_CACHE_SUFFIX, sizeof(path));
+
+    f = fopen(path, "wb");
+    if (!f) {
+        LOG_WARN("Could not write keyframe cache %s", path);
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+            || fwrite(idx->entries, sizeof(KeyframeEntry), idx->nb_entries, f) != idx->nb_entries)
+        ret = -1;
+
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret < 0)
+        LOG_WARN("Could not write keyframe cache %s", path);
+    else
+        idx->dirty = 0;
+
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef KEYFRAME_INDEX_H_
+#define KEYFRAME_INDEX_H_
+
+#include <stdint.h>
+
+#include <libavutil/rational.h>
+
+typedef struct KeyframeEntry {
+    int64_t         pts;            // In the stream time base
+    int64_t         dts;            // Some demuxers seek by dts
+    int64_t         pos;            // Byte position of the packet, -1 if unknown
+    int             linked;         // The previous entry was read right before this one
+} KeyframeEntry;
+
+/*
+ * Sorted index of keyframes of one stream, built while packets are read.
+ * An entry is linked when it was read directly after its predecessor, so a
+ * timestamp between two linked entries is known to be in the GOP of the first.
+ * Only used from the parse task.
+ */
+typedef struct KeyframeIndex {
+    int             stream_index;
+    AVRational      time_base;
+    KeyframeEntry   *entries;
+    int             nb_entries;
+    int             size;
+    int             last;           // Entry added last, -1 after a seek
+    int             dirty;          // Changed since loaded from the cache
+} KeyframeIndex;
+
+void keyframe_index_init(KeyframeIndex *idx, int stream_index, AVRational time_base);
+void keyframe_index_free(KeyframeIndex *idx);
+int keyframe_index_add(KeyframeIndex *idx, int64_t pts, int64_t dts, int64_t pos);
+void keyframe_index_break(KeyframeIndex *idx);
+const KeyframeEntry *keyframe_index_lookup(const KeyframeIndex *idx, int64_t pts);
+
+int keyframe_index_load(KeyframeIndex *idx, const char *url);
+int keyframe_index_save(KeyframeIndex *idx, const char *url);
+
+#endif /* KEYFRAME_INDEX_H_ */
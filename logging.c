@@ -1,80 +1,430 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <SDL2/SDL.h>
 
 #include "logging.h"
 
+#define LOG_MSG_SIZE 256
+#define LOG_RING_SIZE 512           // Records per thread, a power of two
+#define LOG_RATE_SLOTS 32           // Call sites tracked per thread
+#define LOG_RATE_BURST 5            // Default messages per call site per window
+#define LOG_RATE_WINDOW 1.0         // Seconds
+#define LOG_IDLE_TIMEOUT 100        // ms the writer sleeps when nothing is signalled
 
-void log_va(FILE *ostream, const char *format, va_list args) {
-    vfprintf(stderr, format, args);
-    fprintf(ostream, "\n");
+typedef struct LogRecord {
+    Uint64          time;           // Performance counter
+    int             level;
+    const char      *filename;      // __FILE__, NULL for none
+    int             line;
+    char            msg[LOG_MSG_SIZE];
+} LogRecord;
 
-    va_end(args);
-    fflush(ostream);
+/*
+ * Repeats of a call site (keyed by its format string) within the current
+ * window. Only used by the owning thread.
+ */
+typedef struct LogRate {
+    const char      *format;
+    Uint64          window_start;
+    int             count;
+    int             suppressed;
+} LogRate;
+
+/*
+ * Per-thread single-producer/single-consumer ring. The thread formats its
+ * message into the next record and publishes it through windex; the writer
+ * thread outputs it and releases it through rindex. A full ring drops the
+ * message instead of blocking the caller. Rings stay on the list for good;
+ * when its thread exits a ring is released, and taken over by the next new
+ * thread once the writer emptied it.
+ */
+typedef struct LogRing {
+    struct LogRing  *next;
+    char            name[16];
+    SDL_atomic_t    in_use;         // A thread owns it
+
+    LogRecord       records[LOG_RING_SIZE];
+    SDL_atomic_t    windex;
+    SDL_atomic_t    rindex;
+    SDL_atomic_t    dropped;
+
+    LogRate         rates[LOG_RATE_SLOTS];
+} LogRing;
+
+static const char *level_names[] = {
+    [LOG_LERR]      = "ERROR",
+    [LOG_LWARN]     = "WARNING",
+    [LOG_LINFO]     = "INFO",
+    [LOG_LDEBUG]    = "DEBUG",
+};
+
+static int log_max_level = LOG_LDEBUG;
+static int log_rate_burst = LOG_RATE_BURST;
+static FILE *log_output_file;       // NULL for stdout/stderr by level
+static Uint64 log_start;
+
+static void *log_rings;             // LogRing list, pushed lock-free
+static SDL_atomic_t log_next_ring;
+static __thread LogRing *log_local;
+static SDL_atomic_t log_tls;        // SDL_TLSID whose destructor releases a thread's ring
+
+// Writer thread, messages are written synchronously while it is not running
+static SDL_Thread *log_tid;
+static SDL_sem *log_sem;
+static SDL_atomic_t log_running;
+static SDL_atomic_t log_sleeping;
+
+
+static void log_ring_release(void *data) {
+    SDL_AtomicSet(&((LogRing *)data)->in_use, 0);
 }
 
-void log_level(int level) {
-    FILE *ostream;
-    char level_str[8] = {0};
+/**
+ * Have the ring released when the calling thread exits. Only threads made
+ * with SDL_CreateThread run TLS destructors, the others keep theirs.
+ */
+static void log_ring_attach(LogRing *r) {
+    SDL_TLSID id = SDL_AtomicGet(&log_tls);
 
-    switch (level) {
-        default:
-        case LOG_LINFO:
-            ostream = stdout;
-            strcpy(level_str, "INFO");
-            break;
-        case LOG_LDEBUG:
-            ostream = stdout;
-            strcpy(level_str, "DEBUG");
-            break;
-        case LOG_LWARN:
-            ostream = stdout;
-            strcpy(level_str, "WARNING");
+    if (!id) {
+        SDL_AtomicCAS(&log_tls, 0, SDL_TLSCreate());
+        id = SDL_AtomicGet(&log_tls);
+    }
+    if (id)
+        SDL_TLSSet(id, r, log_ring_release);
+    log_local = r;
+}
+
+static LogRing *log_ring(void) {
+    LogRing *r = log_local;
+    void *head;
+
+    if (r)
+        return r;
+
+    // An exited thread's ring, once its last messages are out
+    for (r = SDL_AtomicGetPtr(&log_rings); r; r = r->next) {
+        if (SDL_AtomicGet(&r->rindex) == SDL_AtomicGet(&r->windex)
+                && SDL_AtomicCAS(&r->in_use, 0, 1)) {
+            memset(r->rates, 0, sizeof(r->rates));
+            snprintf(r->name, sizeof(r->name), "thread-%d", SDL_AtomicAdd(&log_next_ring, 1) + 1);
+            log_ring_attach(r);
+            return r;
+        }
+    }
+
+    r = calloc(1, sizeof(LogRing));
+    if (!r)
+        return NULL;
+    snprintf(r->name, sizeof(r->name), "thread-%d", SDL_AtomicAdd(&log_next_ring, 1) + 1);
+    SDL_AtomicSet(&r->in_use, 1);
+
+    do {
+        head = SDL_AtomicGetPtr(&log_rings);
+        r->next = head;
+    } while (!SDL_AtomicCASPtr(&log_rings, head, r));
+
+    log_ring_attach(r);
+    return r;
+}
+
+static FILE *log_stream(int level) {
+    if (log_output_file)
+        return log_output_file;
+    return level <= LOG_LWARN ? stderr : stdout;
+}
+
+/**
+ * Write one record as a single line on one stream
+ */
+static void log_output(const LogRecord *rec, const char *thread) {
+    FILE *f = log_stream(rec->level);
+    double t = (double)(rec->time - log_start) / SDL_GetPerformanceFrequency();
+
+    if (rec->filename)
+        fprintf(f, "[%9.3f] [%-8s] [%-14s] <%s:%d> %s\n", t, level_names[rec->level],
+                thread, rec->filename, rec->line, rec->msg);
+    else
+        fprintf(f, "[%9.3f] [%-8s] [%-14s] %s\n", t, level_names[rec->level], thread, rec->msg);
+}
+
+/**
+ * Check the call site against the rate limit
+ * @param suppressed set to the number of messages suppressed in the window
+ *        that just ended, to be mentioned in this one
+ * @return 1 if the message should be dropped
+ */
+static int log_rate_limited(LogRing *r, const char *format, Uint64 now, int *suppressed) {
+    LogRate *rate = &r->rates[((uintptr_t)format >> 3) % LOG_RATE_SLOTS];
+
+    *suppressed = 0;
+    if (log_rate_burst <= 0)
+        return 0;
+
+    if (rate->format != format) {
+        rate->format = format;
+        rate->window_start = now;
+        rate->count = 0;
+        rate->suppressed = 0;
+    } else if (now - rate->window_start >= LOG_RATE_WINDOW * SDL_GetPerformanceFrequency()) {
+        *suppressed = rate->suppressed;
+        rate->window_start = now;
+        rate->count = 0;
+        rate->suppressed = 0;
+    }
+
+    if (++rate->count > log_rate_burst) {
+        rate->suppressed++;
+        return 1;
+    }
+    return 0;
+}
+
+static void log_format(LogRecord *rec, int suppressed, const char *format, va_list args) {
+    int len;
+
+    len = vsnprintf(rec->msg, sizeof(rec->msg), format, args);
+    if (suppressed && len >= 0 && len < sizeof(rec->msg))
+        snprintf(rec->msg + len, sizeof(rec->msg) - len, " (%d similar suppressed)", suppressed);
+}
+
+static void log_write(int level, const char *filename, int line, const char *format, va_list args) {
+    LogRecord local, *rec;
+    LogRing *r;
+    Uint64 now;
+    unsigned int windex;
+    int suppressed;
+
+    if (level > LOG_MAX_LEVEL || level > log_max_level)
+        return;
+
+    now = SDL_GetPerformanceCounter();
+    if (!log_start)
+        log_start = now;        // Set by the first message, before any other thread logs
+    r = log_ring();
+    if (r && log_rate_limited(r, format, now, &suppressed))
+        return;
+
+    if (!r || !SDL_AtomicGet(&log_running)) {
+        // No writer thread, output right away
+        local.time = now;
+        local.level = level;
+        local.filename = filename;
+        local.line = line;
+        log_format(&local, r ? suppressed : 0, format, args);
+        log_output(&local, r ? r->name : "?");
+        fflush(log_stream(level));
+        return;
+    }
+
+    windex = SDL_AtomicGet(&r->windex);
+    if (windex - (unsigned int)SDL_AtomicGet(&r->rindex) >= LOG_RING_SIZE) {
+        SDL_AtomicAdd(&r->dropped, 1);
+        return;
+    }
+
+    rec = &r->records[windex & (LOG_RING_SIZE - 1)];
+    rec->time = now;
+    rec->level = level;
+    rec->filename = filename;
+    rec->line = line;
+    log_format(rec, suppressed, format, args);
+
+    // Publish, and wake the writer if it went to sleep
+    SDL_AtomicSet(&r->windex, windex + 1);
+    if (SDL_AtomicCAS(&log_sleeping, 1, 0))
+        SDL_SemPost(log_sem);
+}
+
+/**
+ * Output everything queued, oldest first across all threads
+ * @return number of records written
+ */
+static int log_drain(void) {
+    LogRing *r, *best;
+    LogRecord *rec, *best_rec;
+    int written = 0, dropped;
+
+    for (;;) {
+        best = NULL;
+        best_rec = NULL;
+        for (r = SDL_AtomicGetPtr(&log_rings); r; r = r->next) {
+            if (SDL_AtomicGet(&r->rindex) == SDL_AtomicGet(&r->windex))
+                continue;
+            rec = &r->records[SDL_AtomicGet(&r->rindex) & (LOG_RING_SIZE - 1)];
+            if (!best_rec || rec->time < best_rec->time) {
+                best = r;
+                best_rec = rec;
+            }
+        }
+        if (!best)
             break;
-        case LOG_LERR:
-            ostream = stderr;
-            strcpy(level_str, "ERROR");
+
+        log_output(best_rec, best->name);
+        SDL_AtomicAdd(&best->rindex, 1);
+        written++;
+    }
+
+    for (r = SDL_AtomicGetPtr(&log_rings); r; r = r->next) {
+        dropped = SDL_AtomicSet(&r->dropped, 0);
+        if (dropped) {
+            fprintf(log_stream(LOG_LWARN), "[%9s] [%-8s] [%-14s] %d messages dropped, log ring full\n",
+                    "", level_names[LOG_LWARN], r->name, dropped);
+            written++;
+        }
+    }
+
+    if (written) {
+        fflush(log_stream(LOG_LINFO));
+        fflush(log_stream(LOG_LERR));
+    }
+    return written;
+}
+
+static int log_writer(void *arg) {
+    for (;;) {
+        if (log_drain())
+            continue;
+        if (!SDL_AtomicGet(&log_running))
             break;
+
+        // Announce the sleep before the last check, so a message published
+        // in between either gets drained here or posts the semaphore
+        SDL_AtomicSet(&log_sleeping, 1);
+        if (!log_drain())
+            SDL_SemWaitTimeout(log_sem, LOG_IDLE_TIMEOUT);
+        SDL_AtomicSet(&log_sleeping, 0);
     }
+    log_drain();
 
-    fprintf(ostream, "[%-8s] ", level_str);
+    return 0;
 }
 
-void log_info(const char *format, ...) {
-    log_level(LOG_LINFO);
-    fflush(stdout);
+/**
+ * Start the writer thread. Until then, and if it fails to start, every
+ * message is written synchronously.
+ */
+int log_init(void) {
+    if (SDL_AtomicGet(&log_running))
+        return 0;
+
+    log_sem = SDL_CreateSemaphore(0);
+    if (!log_sem)
+        return -1;
+
+    SDL_AtomicSet(&log_running, 1);
+    log_tid = SDL_CreateThread(log_writer, "log", NULL);
+    if (!log_tid) {
+        SDL_AtomicSet(&log_running, 0);
+        SDL_DestroySemaphore(log_sem);
+        log_sem = NULL;
+        return -1;
+    }
+    atexit(log_shutdown);
+
+    return 0;
+}
 
+/**
+ * Write out what is queued and stop the writer thread. Safe to call more
+ * than once; logging continues synchronously afterwards.
+ */
+void log_shutdown(void) {
+    if (!SDL_AtomicCAS(&log_running, 1, 0))
+        return;
+
+    SDL_SemPost(log_sem);
+    SDL_WaitThread(log_tid, NULL);
+    log_tid = NULL;
+    SDL_DestroySemaphore(log_sem);
+    log_sem = NULL;
+}
+
+/**
+ * Wait until every message logged so far has been written
+ */
+void log_flush(void) {
+    LogRing *r;
+    int pending;
+
+    do {
+        pending = 0;
+        for (r = SDL_AtomicGetPtr(&log_rings); r; r = r->next)
+            pending |= SDL_AtomicGet(&r->rindex) != SDL_AtomicGet(&r->windex);
+        if (pending && SDL_AtomicGet(&log_running)) {
+            if (SDL_AtomicCAS(&log_sleeping, 1, 0))
+                SDL_SemPost(log_sem);
+            SDL_Delay(1);
+        }
+    } while (pending && SDL_AtomicGet(&log_running));
+}
+
+/**
+ * Runtime filter, messages above level are dropped before formatting
+ * @param level one of LOG_L*
+ */
+void log_set_level(int level) {
+    log_max_level = level;
+}
+
+/**
+ * Send all messages to one stream
+ * @param out stream, NULL for stdout (info, debug) and stderr (warnings, errors)
+ */
+void log_set_output(FILE *out) {
+    log_output_file = out;
+}
+
+/**
+ * Messages allowed per call site per second before repeats are suppressed
+ * @param burst limit, 0 for no limit
+ */
+void log_set_rate_limit(int burst) {
+    log_rate_burst = burst;
+}
+
+/**
+ * Name the calling thread in its log lines
+ */
+void log_thread_name(const char *name) {
+    LogRing *r = log_ring();
+
+    if (r)
+        snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+void log_info(const char *format, ...) {
     va_list args;
+
     va_start(args, format);
-    log_va(stdout, format, args);
+    log_write(LOG_LINFO, NULL, 0, format, args);
+    va_end(args);
 }
 
 void log_warn(const char *filename, int line, const char *format, ...) {
-    log_level(LOG_LWARN);
-    fprintf(stderr, "<%s:%d> ", filename, line);
-
     va_list args;
+
     va_start(args, format);
-    log_va(stderr, format, args);
+    log_write(LOG_LWARN, filename, line, format, args);
+    va_end(args);
 }
 
 void log_err(const char *filename, int line, const char *format, ...) {
-    log_level(LOG_LERR);
-    fprintf(stderr, "<%s:%d> ", filename, line);
-
     va_list args;
+
     va_start(args, format);
-    log_va(stderr, format, args);
+    log_write(LOG_LERR, filename, line, format, args);
+    va_end(args);
 }
 
 void log_debug(const char *filename, int line, const char *format, ...) {
-    log_level(LOG_LDEBUG);
-    fprintf(stdout, "<%s:%d> ", filename, line);
-    fflush(stdout);
-
     va_list args;
+
     va_start(args, format);
-    log_va(stdout, format, args);
+    log_write(LOG_LDEBUG, filename, line, format, args);
+    va_end(args);
 }
@@ -1,21 +1,39 @@
 #ifndef LOGGING_H_
 #define LOGGING_H_
 
-enum log_levels {
-    LOG_LINFO,
-    LOG_LWARN,
-    LOG_LERR,
-    LOG_LDEBUG
-};
+#include <stdio.h>
+
+// Levels, in order of verbosity
+#define LOG_LERR 0
+#define LOG_LWARN 1
+#define LOG_LINFO 2
+#define LOG_LDEBUG 3
+
+// Compile-time filter, calls above this level are compiled out
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LDEBUG
+#endif
+
+int log_init(void);
+void log_shutdown(void);
+void log_flush(void);
+void log_set_level(int level);
+void log_set_output(FILE *out);
+void log_set_rate_limit(int burst);
+void log_thread_name(const char *name);
 
 void log_info(const char *format, ...);
 void log_warn(const char *filename, int line, const char *format, ...);
 void log_err(const char *filename, int line, const char *format, ...);
 void log_debug(const char *filename, int line, const char *format, ...);
 
-#define LOG_WARN(...) log_warn(__FILE__, __LINE__, __VA_ARGS__)
 #define LOG_ERR(...) log_err(__FILE__, __LINE__, __VA_ARGS__)
-#ifdef DEBUG
+#if LOG_MAX_LEVEL >= LOG_LWARN
+#define LOG_WARN(...) log_warn(__FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOG_WARN(...)
+#endif
+#if defined(DEBUG) && LOG_MAX_LEVEL >= LOG_LDEBUG
 #define LOG_DEBUG(...) log_debug(__FILE__, __LINE__, __VA_ARGS__)
 #else
 #define LOG_DEBUG(...)
@@ -1,69 +1,176 @@
 #include <stdio.h>
+#include <inttypes.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 
 #include <SDL2/SDL.h>
 
 #define DEBUG
 #include "logging.h"
+#include "packet_queue.h"
+#include "sched.h"
+#include "demux.h"
+#include "decoder.h"
+#include "texture_pool.h"
+#include "audio_out.h"
+#include "bench.h"
+#include "clock.h"
+#include "options.h"
+#include "keyframe_index.h"
+#include "mmap_io.h"
+#include "prefetch_io.h"
+#include "throttle_io.h"
+#include "metrics.h"
+#include "trace.h"
+#include "frame_pool.h"
+#include "alloc_count.h"
+#include "convert.h"
+#include "degrade.h"
+#include "probe_cache.h"
+#include "thumbs.h"
 
 #define FF_REFRESH_EVENT SDL_USEREVENT
 #define FF_QUIT_EVENT (SDL_USEREVENT + 1)
+#define FF_STATS_EVENT (SDL_USEREVENT + 2)
+#define FF_OPENED_EVENT (SDL_USEREVENT + 3)
+#define FF_EOF_EVENT (SDL_USEREVENT + 4)
 
-#define QUIT -42
-
-#define TEXTURE_QUEUE_SIZE 16
-#define MAX_AUDIO_QUEUE_SIZE 10000
+// About 0.7s of 48kHz stereo float, so reading is not starved between audio throttles
+#define MAX_AUDIO_QUEUE_SIZE (256 * 1024)
 #define PACKET_QUEUE_SIZE 1000
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
+// Events are handled until this long before a refresh is due, the rest of
+// the wait is a precise sleep
+#define PRESENT_WAKE_EARLY 0.002
+// Audio minus master clock is averaged over about this many frames
+#define AUDIO_DIFF_AVG_NB 20
+// Most a frame is stretched or squeezed by, in percent, well below what
+// can be heard as a pitch change
+#define AUDIO_COMPENSATION_MAX 2
 #define MAX_URL_SIZE 1024
 
-typedef struct PacketQueue {
-    AVPacketList  *first_pkt, *last_pkt;
-    int             nb_packets;
-    int             quit;
+// Probe limits with --fast-start, enough for the headers of common containers
+#define FAST_START_PROBESIZE (256 * 1024)
+#define FAST_START_ANALYZEDURATION 0.5
 
-    SDL_mutex       *mutex;
-    SDL_cond        *cond;
-} PacketQueue;
+// Scheduler running the parse and decoder tasks of all playlist items. Two
+// parse tasks may sit in blocking reads at once, the decoders need the rest.
+#define PLAYER_SCHED_MIN_WORKERS 4
+#define PLAYER_SCHED_QUANTUM_US 5000
 
-typedef struct Decoder {
-    PacketQueue     *queue;
-    AVCodecContext  *codecContext;
-    SDL_cond        *empty_queue_cond;
-    SDL_Thread      *decoder_tid;
-} Decoder;
+// What the parse task does next
+enum {
+    PARSE_OPEN,                     // Open the input and decoders on the first run
+    PARSE_READ,
+    PARSE_FAILED                    // Could not open or read, FF_QUIT_EVENT posted
+};
 
 typedef struct VideoState {
-    AVFormatContext *pFormatContext;
+    const PlayerOptions *opts;
+    Scheduler       *sched;         // Shared by all items
+    Demuxer         demux;
+    AVIOContext     *input_io;      // Custom I/O given to libavformat, NULL for none
+    void            (*input_io_close)(AVIOContext **pb);
+    AVIOContext     *mmap_io;       // input_io when it is a mapped file
+    AVIOContext     *prefetch_io;   // input_io when prefetching
+    int             nb_active_streams;
 
     int             audio_stream_index;
     int             audioDevice;
+    SDL_AudioSpec   audio_spec;     // What audioDevice was opened with
+    int             audio_reuse;    // Previous item's device, taken over by the next
+    int             audio_shared;   // audioDevice is audio_reuse
+    int             audio_go;       // Samples may go to the device, under audio_mutex
+    int             audio_done;     // Audio decoder drained, under audio_mutex
     AVCodecContext  *audioContext;
     AVStream        *audioStream;
+    AudioConverter  audio_conv;     // Decoded frames to the audio_spec format
+    int             audio_bytes_per_sec;
+    int             audio_hw_buf_size;
+    double          audio_clock;    // pts at the end of the last queued frame
+    double          audio_diff_cum; // Weighted sum of audio minus master clock
+    double          audio_diff_avg_coef;
+    double          audio_diff_threshold; // Left alone below, the device buffer's length
+    int             audio_diff_avg_count;
 
     int             video_stream_index;
     AVCodecContext  *videoContext;
     AVStream        *videoStream;
-
-    SDL_Texture     *textureQueue[TEXTURE_QUEUE_SIZE];
+    FramePool       video_frames;   // Buffers the video decoder decodes into
+    DegradeControl  degrade;        // Cheaper decoding while video falls behind
+    double          frame_duration; // Nominal duration from the stream frame rate
+    double          max_frame_duration;
+
+    // A/V sync
+    Clock           audclk;
+    Clock           vidclk;
+    Clock           extclk;
+    int             av_sync_type;
+    int             framedrop;
+    double          frame_timer;    // Wall time the current frame was due
+    double          frame_last_pts;
+    int             frame_last_serial;
+    double          av_drift;       // Last video clock minus master clock
+    double          last_report;
+
+    // Presentation, main thread only
+    double          refresh_due;    // Wall time video_refresh_timer is due again, 0 for none
+    double          last_present;   // Wall time the last frame went up
+    double          last_present_due; // and when it was due
+    Histogram       *present_jitter; // Frame to frame interval off the planned one, in us
+    Histogram       *present_late;  // Frame up after its due time, in us
+
+    TexturePool     textureQueue;
+    Converter       *convert;       // Frame to texture upload, shared, main thread only
     int             textureQueue_size;
     int             textureQueue_windex; // Write index
     int             textureQueue_rindex; // Read index
     SDL_mutex       *textureQueueMutex;
-    SDL_cond        *textureQueueCond;
+    int             video_waiting;  // Video task idle on a full queue, under textureQueueMutex
+    int64_t         sink_wait_start; // bench_now() it found the queue full at, video task only
 
-    SDL_Thread      *parse_tid;
+    SchedTask       parse_task;     // Opens the input, then demuxes and seeks
+    int             parse_state;    // PARSE_*, parse task only
+    Histogram       parse_wakeup;   // Wakeup latency of the tasks, in us
+    Histogram       audio_wakeup;
+    Histogram       video_wakeup;
 
+    SDL_Window      *window;
     SDL_Renderer    *renderer;
+    SDL_atomic_t    output_width;   // Renderer output size, for the decoders
+    SDL_atomic_t    output_height;
+    SDL_Rect        display_rect;   // Where the current frame goes, letterboxed
+
+    // Resolution adaptation: decoder lowres picked at open, then halvings
+    // before upload picked per frame. Counters are main thread only.
+    int             lowres;
+    int             reduce;
+    int64_t         source_pixels;  // Pixels of the frames at full resolution
+    int64_t         decoded_pixels;
+    int64_t         full_upload_bytes; // Bytes a full resolution upload would take
+    int64_t         upload_bytes;
+    double          resolution_start; // Wall time of the first upload
+
+    // Telemetry
+    MetricsSnapshot stats;          // Latest snapshot, main thread only
+    FILE            *stats_file;    // JSON lines, NULL for none
+    int             show_stats;     // Overlay and window title on
 
     char            url[MAX_URL_SIZE];
     int             quit;
+    int             eof;
+
+    BenchStats      *bench;         // Headless benchmark with a null sink
+    SDL_atomic_t    decoders_running;
 
 
     SDL_Thread      *decode_tid;
@@ -78,664 +185,2088 @@ typedef struct VideoState {
 
     Decoder         auddec;
     Decoder         viddec;
-    SDL_cond        *continue_thread_read;
+    SDL_mutex       *wait_mutex;    // Seek and switch requests
+
+    SDL_mutex       *audio_mutex;   // Audio device handover
+    int             audio_waiting;  // Audio task idle until audio_go, under audio_mutex
+
+    int             refresh_on_frame; // Refresh waits for the next queued frame
+
+    double          idle_start;     // Wall/CPU time the decoders drained at EOF
+    double          idle_cpu_start;
+
+    // Seeking, requested under wait_mutex and carried out by the parser
+    int             seek_req;
+    int64_t         seek_pos;       // Target, in AV_TIME_BASE units
+    int64_t         seek_rel;       // Distance from the position at request time
+    double          seek_start;     // Wall time of the last request
+    double          seek_target;    // Target of the last request, in seconds
+    int             seek_by_bytes;  // Indexed seeks go to the byte position
+    KeyframeIndex   keyframes;
+    Histogram       seek_latency;   // Request to first frame shown, in us
+
+    // Stream switch, requested under wait_mutex together with a seek to
+    // where playback is, and carried out by the parser before that seek
+    int             switch_req;     // AVMEDIA_TYPE_* to move to its next stream, -1 for none
+
+    // Playlist
+    int             index;          // Position in the playlist
+    struct VideoState *next;        // Opened item playing after this one, under audio_mutex
+    double          open_start;     // Wall time the item was opened
+    double          frame_end;      // Wall time the frame on screen is due to be replaced
+    double          end_time;       // Wall time the item finished playing
+    int             end_pushed;     // FF_EOF_EVENT sent for end_time
+    double          switch_due;     // Previous item's end_time until our first frame is shown
+    Histogram       *gaps;          // Previous item's end to our first frame, in us
+    int             preopened;      // Opened ahead while another item played
+    int             close_keep_audio; // For stream_close_async
+
+    // Startup, wall times from open_start
+    double          input_time;     // avformat_open_input done
+    double          probe_time;     // Stream parameters known
+    double          decoders_time;  // Decoders and audio device open
+    int             first_frame_shown;
+    int             first_audio_queued;
 } VideoState;
 
-int audio_thread(void *arg);
-int video_thread(void *arg);
+/*
+ * Stream component opened on its own thread, next to the other one
+ */
+typedef struct OpenJob {
+    struct VideoState *is;
+    int             stream_index;
+} OpenJob;
+
+static int audio_run(SchedTask *task);
+static int video_run(SchedTask *task);
 
 void fatal(char *msg) {
     LOG_ERR(msg);
     exit(-1);
 }
 
-/**
- * Add a packet to the packet queue
- * @param q the queue to add to
- * @param pkt pointer to the packet to add
- */
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
-    AVPacketList *pkt_ind;
-    int ret = 0;
-
-    if (q->quit)
-        ret = QUIT;
-
-    SDL_LockMutex(q->mutex);
-
-        pkt_ind = av_malloc(sizeof(AVPacketList));
-        if (!pkt_ind)
-            ret = -1;
-        pkt_ind->pkt = *pkt;
-        pkt_ind->next = NULL;
-
-        if (!q->last_pkt)
-            q->first_pkt = pkt_ind;
-        else
-            q->last_pkt->next = pkt_ind;
-
-        q->last_pkt = pkt_ind;
-        q->nb_packets++;
-        SDL_CondSignal(q->cond);
-
-    SDL_UnlockMutex(q->mutex);
-
-    if (ret < 0)
-        av_packet_unref(pkt);
-
-    return ret;
-
+static void push_event(VideoState *is, Uint32 type) {
+    SDL_Event event;
+    event.type = type;
+    event.user.data1 = is;
+    SDL_PushEvent(&event);
 }
 
-/**
- * Prepare PacketQueue, clear memory and create mutex/cond
- * @param q pointer to PacketQueue to initialize
- */
-static int packet_queue_init(PacketQueue *q) {
-    memset(q, 0, sizeof(PacketQueue));
-    q->mutex = SDL_CreateMutex();
-    if (!q->mutex) {
-        LOG_ERR("Could not create mutex: %s", SDL_GetError());
-        return -1;
-    }
-
-    q->cond = SDL_CreateCond();
-    if (!q->cond) {
-        LOG_ERR("Could not create cond: %s", SDL_GetError());
-        return -1;
-    }
-    q->quit = 1;
-    
-    return 0;
+static void push_refresh_event(VideoState *is) {
+    push_event(is, FF_REFRESH_EVENT);
 }
 
 /**
- * Flush PacketQueue and free all memory
- * @param q pointer to PacketQueue to flush
+ * Fit a picture inside the output, keeping its display aspect ratio
+ * @param rect receives the letterboxed rectangle
+ * @param out_w output width
+ * @param out_h output height
+ * @param pic_w picture width
+ * @param pic_h picture height
+ * @param sar sample aspect ratio, 0 or less for square pixels
  */
-static void packet_queue_flush(PacketQueue *q) {
-    AVPacketList *pkt, *pkt1;
+static void calculate_display_rect(SDL_Rect *rect, int out_w, int out_h,
+                                   int pic_w, int pic_h, AVRational sar) {
+    AVRational  aspect;
+    int64_t     width, height;
+
+    if (av_cmp_q(sar, av_make_q(0, 1)) <= 0)
+        sar = av_make_q(1, 1);
+    aspect = av_mul_q(av_make_q(pic_w, pic_h), sar);
+
+    height = out_h;
+    width = av_rescale(height, aspect.num, aspect.den) & ~1;
+    if (width > out_w) {
+        width = out_w;
+        height = av_rescale(width, aspect.den, aspect.num) & ~1;
+    }
 
-    SDL_LockMutex(q->mutex);
-        for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-            pkt1 = pkt->next;
-            av_packet_unref(&pkt->pkt);
-            av_freep(&pkt);
-        }
-        q->first_pkt = NULL;
-        q->last_pkt = NULL;
-        q->nb_packets = 0;
-    SDL_UnlockMutex(q->mutex);
+    rect->x = (out_w - width) / 2;
+    rect->y = (out_h - height) / 2;
+    rect->w = FFMAX((int)width, 1);
+    rect->h = FFMAX((int)height, 1);
 }
 
 /**
- * Destroy PacketQueue by flushing, then destroying mutex/cond
- * @param q pointer to PacketQueue
+ * How many times a picture can be halved and still cover its display
+ * rectangle, so the renderer never has to scale it up
+ * @param pic_w picture width
+ * @param pic_h picture height
+ * @param rect display rectangle
+ * @param max largest value to return
  */
-static void packet_queue_destroy(PacketQueue *q) {
-    packet_queue_flush(q);
-    SDL_DestroyMutex(q->mutex);
-    SDL_DestroyCond(q->cond);
+static int resolution_reduce(int pic_w, int pic_h, const SDL_Rect *rect, int max) {
+    int reduce = 0;
+
+    while (reduce < max
+            && AV_CEIL_RSHIFT(pic_w, reduce + 1) >= rect->w
+            && AV_CEIL_RSHIFT(pic_h, reduce + 1) >= rect->h)
+        reduce++;
+    return reduce;
 }
 
 /**
- * Set quit flag to 0, enabeling the use of the PacketQueue
- * @param q pointer to PacketQueue
+ * Log the time from opening the item to its first frame on screen, or out
+ * of the benchmark sink
  */
-static void packet_queue_start(PacketQueue *q) {
-    SDL_LockMutex(q->mutex);
-    q->quit = 0;
-    SDL_UnlockMutex(q->mutex);
+static void startup_first_frame(VideoState *is) {
+    if (is->first_frame_shown)
+        return;
+    is->first_frame_shown = 1;
+
+    // Pre-opened playlist items report their gap instead
+    if (!is->preopened)
+        log_info("Time to first frame: %.0f ms", (clock_time() - is->open_start) * 1000);
 }
 
 /**
- * Get a packet from the PacketQueue
- * @param q pointer to PacketQueue
- * @param pkt pointer to AVPacket to be set
+ * Log what resolution adaptation saved since the first frame was uploaded
  */
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt) {
-    AVPacketList *pkt1;
-    int ret;
-
-    SDL_LockMutex(q->mutex);
-
-        for (;;) {
-            if (q->quit) {
-                ret = QUIT;
-                break;
-            }
-
-            pkt1 = q->first_pkt;
-            if (pkt1) {
-                q->first_pkt = pkt1->next;
-                if (!q->first_pkt)
-                    q->last_pkt = NULL;
-                q->nb_packets--;
-                *pkt = pkt1->pkt;
-
-                av_free(pkt1);
-                ret = 1;
-                break;
-            } else {
-                // Wait for new packets
-                SDL_CondWait(q->cond, q->mutex);
-            }
-        }
-
-    SDL_UnlockMutex(q->mutex);
-    return ret;
-}
-
-static void decoder_init(Decoder *d, AVCodecContext *codecContext, PacketQueue *queue, SDL_cond *empty_queue_cond) {
-    memset(d, 0, sizeof(Decoder));
-    d->codecContext = codecContext;
-    d->queue = queue;
-    d->empty_queue_cond = empty_queue_cond;
-}
-
-static int decoder_start(Decoder *d, int (*fn)(void *), void *arg) {
-    packet_queue_start(d->queue);
-    d->decoder_tid = SDL_CreateThread(fn, "decoder", arg);
-    if (!d->decoder_tid) {
-        LOG_ERR("Could not create decoding thread: %s", SDL_GetError());
-        return -1;
-    }
-    return 0;
-}
-
-static void decoder_destroy(Decoder *d) {
-    /* av_packet_unref(&d->pkt); */
-    avcodec_free_context(&d->codecContext);
-}
-
-static int decoder_decode_frame(Decoder *d, AVFrame *frame) {
-    AVCodecContext *context = d->codecContext;
-    AVPacket packet;
-    int response;
-
-    if (d->queue->nb_packets == 0) {
-        /* SDL_CondSignal(d->empty_queue_cond); */
-        LOG_WARN("Queue empty!");
-        do {
-            SDL_Delay(10);
-        } while (d->queue->nb_packets == 0);
-        if (packet_queue_get(d->queue, &packet) < 0)
-            return -1;
-    } else {
-        if (packet_queue_get(d->queue, &packet) < 0)
-            return -1;
-    }
-
-    response = avcodec_send_packet(context, &packet);
-    if (response < 0) {
-        LOG_ERR("Error while sending packet to the decoder: %d - %s - %s", response, context->codec->name,
-                av_err2str(response));
-        LOG_DEBUG("Codec %s, ID, %d, bit_rate %ld", context->codec->long_name,
-                  context->codec->id, context->bit_rate);
-        return -1;
-    }
-
-    // While there are still frames to unpack from the packet
-    while (response >= 0) {
-        response = avcodec_receive_frame(context, frame);
-
-        // If no more data to be had from the packet
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
-            break;
-        else if (response < 0) {
-            printf("Something went wrong with the stream, skipping frame: %s - %s\n",
-                   context->codec->name, av_err2str(response));
-            continue;
-        }
+static void resolution_report(VideoState *is) {
+    double elapsed = clock_time() - is->resolution_start;
 
-    }
-    av_packet_unref(&packet);
+    if (!is->source_pixels || elapsed <= 0)
+        return;
 
-    return 0;
+    log_info("Resolution: lowres %d, reduce %d, decoded %.1f of %.1f Mpx/s, uploaded %.1f of %.1f MB/s",
+             is->lowres, is->reduce,
+             is->decoded_pixels / elapsed / 1e6, is->source_pixels / elapsed / 1e6,
+             is->upload_bytes / elapsed / 1e6, is->full_upload_bytes / elapsed / 1e6);
 }
 
 int open_stream_component(VideoState *is, int stream_index) {
-    AVFormatContext     *pFormatContext = is->pFormatContext;
+    AVFormatContext     *pFormatContext = is->demux.ic;
     AVCodecParameters   *codecParameters;
     AVCodecContext      *codecContext;
-    AVCodec             *codec;
+    const AVCodec       *codec;
     SDL_AudioSpec       wanted_spec, spec;
-    int                 dev;
+    AVRational          frame_rate;
+    SDL_Rect            rect;
+    int                 dev = 0, go;
 
     if (stream_index < 0 || stream_index >= pFormatContext->nb_streams) {
         return -1;
     }
 
     codecParameters = pFormatContext->streams[stream_index]->codecpar;
-    codec = avcodec_find_decoder(codecParameters->codec_id);
-    if (!codec) {
-        LOG_ERR("Unsupported codec");
-        return -1;
-    }
-
-    codecContext = avcodec_alloc_context3(codec);
-    if (avcodec_parameters_to_context(codecContext, codecParameters) != 0) {
-        LOG_ERR("Could not create codec context from parameters");
+    codecContext = decoder_alloc_context(pFormatContext->streams[stream_index]);
+    if (!codecContext)
         return -1;
-    }
+    codec = codecContext->codec;
 
-    if (codecContext->codec_type == AVMEDIA_TYPE_AUDIO) {
+    if (codecContext->codec_type == AVMEDIA_TYPE_AUDIO && !is->bench) {
         SDL_zero(wanted_spec);
         wanted_spec.freq        = codecContext->sample_rate;
         wanted_spec.format      = AUDIO_F32SYS;
-        wanted_spec.channels    = codecContext->channels;
+        wanted_spec.channels    = audio_out_channels(codecContext->channels);
         wanted_spec.samples     = SDL_AUDIO_BUFFER_SIZE;
         wanted_spec.callback    = NULL;
 
-        dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, 0);
-        if (dev == 0) {
-            LOG_ERR("SDL_OpenAudio: %s", SDL_GetError());
+        // Keep the previous item's device whatever it plays, the converter
+        // takes our samples to its format, so they queue up right behind
+        // its last ones
+        if (is->audio_reuse) {
+            dev = is->audio_reuse;
+            spec = is->audio_spec;
+            is->audio_shared = 1;
+        } else {
+            // Take the rate, format and channels the device prefers rather
+            // than have SDL convert a second time
+            dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, SDL_AUDIO_ALLOW_ANY_CHANGE);
+            if (dev && audio_out_sample_fmt(spec.format) == AV_SAMPLE_FMT_NONE) {
+                SDL_CloseAudioDevice(dev);
+                dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec,
+                                          SDL_AUDIO_ALLOW_ANY_CHANGE & ~SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+            }
+            if (dev == 0) {
+                LOG_ERR("SDL_OpenAudio: %s", SDL_GetError());
+                return -1;
+            }
+            log_info("Audio device: %d Hz, %s, %d channels, %d samples buffer", spec.freq,
+                     av_get_sample_fmt_name(audio_out_sample_fmt(spec.format)), spec.channels, spec.samples);
+        }
+
+        if (audio_convert_init(&is->audio_conv, &spec) < 0) {
+            if (!is->audio_shared)
+                SDL_CloseAudioDevice(dev);
+            return -1;
+        }
+    }
+    options_decoder_threads(is->opts, codecContext->codec_type, is->nb_active_streams,
+                            &codecContext->thread_count, &codecContext->thread_type);
+
+    if (codecContext->codec_type == AVMEDIA_TYPE_VIDEO) {
+        if (frame_pool_init(&is->video_frames, codecContext) < 0)
             return -1;
+
+        // Decode at reduced size when the window is much smaller. Fixed for
+        // the life of the decoder, later resizes only downscale on upload.
+        if (is->opts->adaptive_resolution && codec->max_lowres > 0
+                && codecParameters->width > 0 && codecParameters->height > 0) {
+            calculate_display_rect(&rect, SDL_AtomicGet(&is->output_width),
+                                   SDL_AtomicGet(&is->output_height),
+                                   codecParameters->width, codecParameters->height,
+                                   codecParameters->sample_aspect_ratio);
+            codecContext->lowres = resolution_reduce(codecParameters->width, codecParameters->height,
+                                                     &rect, codec->max_lowres);
+            is->lowres = codecContext->lowres;
+            if (is->lowres)
+                log_info("Video decoder: lowres %d, %dx%d decoded as %dx%d", is->lowres,
+                         codecParameters->width, codecParameters->height,
+                         AV_CEIL_RSHIFT(codecParameters->width, is->lowres),
+                         AV_CEIL_RSHIFT(codecParameters->height, is->lowres));
         }
     }
+
     if (avcodec_open2(codecContext, codec, NULL) < 0) {
         LOG_ERR("Unsupported codec");
         return -1;
     }
 
+    log_info("%s decoder: %s, %d threads (%s, active: %s)",
+             av_get_media_type_string(codecContext->codec_type), codec->name,
+             codecContext->thread_count, options_thread_type_name(codecContext->thread_type),
+             codecContext->active_thread_type ? options_thread_type_name(codecContext->active_thread_type) : "none");
+
     if (codecContext->codec_type == AVMEDIA_TYPE_AUDIO) {
         // Audio Stuff
         is->audio_stream_index  = stream_index;
         is->audioStream         = pFormatContext->streams[stream_index];
         is->audioContext        = codecContext;
-        is->audioDevice         = dev;
+        if (!is->bench) {
+            is->audio_spec          = spec;
+            is->audio_bytes_per_sec = spec.freq * spec.channels * SDL_AUDIO_BITSIZE(spec.format) / 8;
+            is->audio_hw_buf_size   = spec.size;
+
+            is->audio_diff_cum = 0;
+            is->audio_diff_avg_count = 0;
+            is->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+            is->audio_diff_threshold = (double)spec.size / is->audio_bytes_per_sec;
+        }
 
-        decoder_init(&is->auddec, codecContext, &is->audioq, is->continue_thread_read);
-        if (decoder_start(&is->auddec, audio_thread, is) < 0)
+        packet_queue_set_stream(&is->audioq, is->audioStream->time_base, 0);
+        if (decoder_init(&is->auddec, codecContext, &is->audioq, audio_run, is, 1) < 0)
             return -1;
-        
-        SDL_PauseAudioDevice(dev, 0);
+        is->auddec.metric = METRIC_AUDIO_DECODE;
+        if (is->bench)
+            is->auddec.stats = &is->bench->stages[BENCH_STAGE_AUDIO];
+
+        // A pre-opened item stays paused until its audio_handover
+        SDL_LockMutex(is->audio_mutex);
+        is->audioDevice = dev;
+        go = is->audio_go;
+        SDL_UnlockMutex(is->audio_mutex);
+        if (go && dev)
+            SDL_PauseAudioDevice(dev, 0);
+
+        is->demux.stream[AVMEDIA_TYPE_AUDIO] = stream_index;
+        SDL_AtomicAdd(&is->decoders_running, 1);
+        decoder_start(&is->auddec, is->sched, &is->parse_task, &is->audio_wakeup);
     } else if (codecContext->codec_type == AVMEDIA_TYPE_VIDEO) {
         // Video Stuff
         is->video_stream_index  = stream_index;
         is->videoStream         = pFormatContext->streams[stream_index];
         is->videoContext        = codecContext;
 
-        decoder_init(&is->viddec, codecContext, &is->videoq, is->continue_thread_read);
-        if (decoder_start(&is->viddec, video_thread, is) < 0)
+        frame_rate = av_guess_frame_rate(pFormatContext, is->videoStream, NULL);
+        is->frame_duration = (frame_rate.num && frame_rate.den) ? av_q2d(av_inv_q(frame_rate)) : 0;
+        is->max_frame_duration = (pFormatContext->iformat->flags & AVFMT_TS_DISCONT) ? 10.0 : 3600.0;
+
+        packet_queue_set_stream(&is->videoq, is->videoStream->time_base,
+                                (frame_rate.num && frame_rate.den)
+                                ? av_rescale_q(1, av_inv_q(frame_rate), is->videoStream->time_base) : 0);
+        if (decoder_init(&is->viddec, codecContext, &is->videoq, video_run, is, 1) < 0)
             return -1;
+        is->viddec.metric = METRIC_VIDEO_DECODE;
+        if (is->frame_duration > 0) {
+            metrics_set_range(METRIC_VIDEO_DECODE, is->frame_duration * 1000000);
+            metrics_set_range(METRIC_UPLOAD, is->frame_duration * 1000000);
+            metrics_set_range(METRIC_PRESENT, is->frame_duration * 1000000);
+        }
+        if (is->bench)
+            is->viddec.stats = &is->bench->stages[BENCH_STAGE_VIDEO];
+        // Each decoder, also one opened by a stream switch, starts at full
+        degrade_reset(&is->degrade, clock_time());
+
+        is->demux.stream[AVMEDIA_TYPE_VIDEO] = stream_index;
+        SDL_AtomicAdd(&is->decoders_running, 1);
+        decoder_start(&is->viddec, is->sched, &is->parse_task, &is->video_wakeup);
     }
 
     return 0;
 }
 
+/**
+ * Let an item's samples go to the audio device: at once for the item that
+ * plays first, when the previous one is done with the device for a
+ * pre-opened one. May be called from any thread, more than once.
+ * @param is pointer to VideoState
+ */
+static void audio_handover(VideoState *is) {
+    int dev, waiting;
+
+    SDL_LockMutex(is->audio_mutex);
+    is->audio_go = 1;
+    dev = is->audioDevice;
+    waiting = is->audio_waiting;
+    is->audio_waiting = 0;
+    // The audio task only runs between its start and stop, which both
+    // happen with audio_waiting clear
+    if (waiting)
+        sched_submit(is->sched, &is->auddec.task);
+    SDL_UnlockMutex(is->audio_mutex);
+
+    // Not opened yet, open_stream_component unpauses it then
+    if (dev)
+        SDL_PauseAudioDevice(dev, 0);
+}
+
+/**
+ * Called by the audio decoder once it drained. The next item sharing the
+ * device can queue its samples right behind ours, so the audio is gapless
+ * whenever the video switch happens.
+ * @param is pointer to VideoState
+ */
+static void audio_drained(VideoState *is) {
+    VideoState *next;
+
+    SDL_LockMutex(is->audio_mutex);
+    is->audio_done = 1;
+    next = is->next;
+    SDL_UnlockMutex(is->audio_mutex);
+
+    if (next && next->audio_shared)
+        audio_handover(next);
+}
+
+static double get_master_clock(VideoState *is);
+
+/**
+ * Samples a frame should last for to bring audio back to the master clock
+ * when audio is not the master. The difference is averaged first, so
+ * jitter in either clock does not make the pitch wobble.
+ * @param is pointer to VideoState
+ * @param frame decoded audio frame
+ * @return samples to play the frame as, frame->nb_samples for no change
+ */
+static int synchronize_audio(VideoState *is, const AVFrame *frame) {
+    int nb_samples = frame->nb_samples;
+    double diff, avg_diff;
+    int wanted, min, max;
+
+    if (is->av_sync_type == AV_SYNC_AUDIO_MASTER)
+        return nb_samples;
+
+    diff = clock_get(&is->audclk) - get_master_clock(is);
+    if (isnan(diff) || fabs(diff) >= AV_NOSYNC_THRESHOLD) {
+        // Too far off to steer, or not known yet: start averaging over
+        is->audio_diff_avg_count = 0;
+        is->audio_diff_cum = 0;
+        return nb_samples;
+    }
+
+    is->audio_diff_cum = diff + is->audio_diff_avg_coef * is->audio_diff_cum;
+    if (is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+        is->audio_diff_avg_count++;
+        return nb_samples;
+    }
+
+    avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+    if (fabs(avg_diff) < is->audio_diff_threshold)
+        return nb_samples;
+
+    wanted = nb_samples + (int)(diff * frame->sample_rate);
+    min = nb_samples * (100 - AUDIO_COMPENSATION_MAX) / 100;
+    max = nb_samples * (100 + AUDIO_COMPENSATION_MAX) / 100;
+    return av_clip(wanted, min, max);
+}
+
+/**
+ * Queue a decoded frame on the audio device, or keep it while the device
+ * has enough. Runs on the audio task.
+ * @return SCHED_AGAIN once the frame is queued or dropped, SCHED_IDLE or
+ *         SCHED_DELAY for the task to wait with it
+ */
 int queue_audio_frame(VideoState *is, AVFrame *frame) {
-    int data_size, i, channel;
-
-    // Get size of single sample
-    data_size = av_get_bytes_per_sample(is->audioContext->sample_fmt);
-
-    // Loop over all samples and channels, and queue the data
-    for (i = 0; i < frame->nb_samples; i++) {
-        for (channel = 0; channel < frame->channels; channel++) {
-            if (SDL_QueueAudio(is->audioDevice,
-                               frame->data[channel] + data_size*i,
-                               data_size) < 0) {
-                LOG_ERR("SDL_QueueAudio: %s", SDL_GetError());
-                return -1;
-            }
-        }
+    SchedTask *task = &is->auddec.task;
+    double queued;
+    Uint32 queued_bytes;
+    int go;
+
+    // Null sink, the decoder stage already counted the frame
+    if (is->bench)
+        return SCHED_AGAIN;
+
+    // A seek came in while waiting, this frame is no longer wanted. The
+    // seek submits the task, delayed or not.
+    if (is->auddec.pkt_serial != SDL_AtomicGet(&is->audioq.serial))
+        return SCHED_AGAIN;
+
+    // A pre-opened playlist item waits for its turn, audio_handover
+    // submits the task
+    SDL_LockMutex(is->audio_mutex);
+    go = is->audio_go;
+    is->audio_waiting = !go;
+    SDL_UnlockMutex(is->audio_mutex);
+    if (!go)
+        return SCHED_IDLE;
+
+    // Backpressure: hold the frame until the device played enough to get
+    // back under the limit, sleeping in the delayed list exactly that long
+    if ((queued_bytes = SDL_GetQueuedAudioSize(is->audioDevice)) > MAX_AUDIO_QUEUE_SIZE) {
+        task->wake_time = clock_time()
+            + (double)(queued_bytes - MAX_AUDIO_QUEUE_SIZE) / is->audio_bytes_per_sec + 0.001;
+        return SCHED_DELAY;
     }
 
-    return 0;
+    // Convert the whole frame and queue it in one call
+    if (audio_out_queue_frame(is->audioDevice, &is->audio_conv, frame,
+                              synchronize_audio(is, frame)) < 0)
+        return SCHED_AGAIN;
+
+    if (!is->first_audio_queued) {
+        is->first_audio_queued = 1;
+        if (!is->preopened)
+            log_info("Time to first audio: %.0f ms", (clock_time() - is->open_start) * 1000);
+    }
+
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+        is->audio_clock = frame->best_effort_timestamp * av_q2d(is->audioStream->time_base)
+            + (double)frame->nb_samples / frame->sample_rate;
+    else
+        is->audio_clock += (double)frame->nb_samples / frame->sample_rate;
+
+    // What is audible now is the end of this frame minus everything still
+    // waiting in SDL's queue and the device buffer
+    queued = (double)(SDL_GetQueuedAudioSize(is->audioDevice) + is->audio_hw_buf_size)
+        / is->audio_bytes_per_sec;
+    clock_set(&is->audclk, is->audio_clock - queued, is->auddec.pkt_serial);
+
+    return SCHED_AGAIN;
 }
 
+/**
+ * Hand a decoded frame over to the texture queue. Only the references move,
+ * frame is left blank for the next decode; the pixels are uploaded when the
+ * frame is shown. Runs on the video task.
+ * @return SCHED_AGAIN once the frame is queued or dropped, SCHED_IDLE for
+ *         the task to wait with it until the main thread frees a slot
+ */
 int queue_video_frame(VideoState *is, AVFrame *frame) {
-    SDL_Texture **texture;
-    SDL_Rect    rect;
+    TextureSlot *slot;
+    StageStats  *stats = NULL;
+    int         full;
+
+    if (is->bench) {
+        if (!is->bench->convert)
+            return SCHED_AGAIN;
+        stats = &is->bench->stages[BENCH_STAGE_SINK];
+    }
 
     SDL_LockMutex(is->textureQueueMutex);
-    while (is->textureQueue_size >= TEXTURE_QUEUE_SIZE && !is->quit) {
-        SDL_CondWait(is->textureQueueCond, is->textureQueueMutex);
-    }
+    full = is->textureQueue_size >= TEXTURE_QUEUE_SIZE;
+    is->video_waiting = full;
     SDL_UnlockMutex(is->textureQueueMutex);
+    if (full) {
+        if (stats && !is->sink_wait_start)
+            is->sink_wait_start = bench_now();
+        return SCHED_IDLE;
+    }
 
-    if (is->quit)
-        return -1;
+    if (stats) {
+        histogram_add(&stats->wait, is->sink_wait_start ? bench_now() - is->sink_wait_start : 0);
+        is->sink_wait_start = 0;
+    }
 
-    texture = &is->textureQueue[is->textureQueue_windex];
-
-    // Create and allocate memory for texture
-    *texture = SDL_CreateTexture(is->renderer,
-                                SDL_PIXELFORMAT_YV12,
-                                SDL_TEXTUREACCESS_STATIC, 
-                                is->videoContext->width,
-                                is->videoContext->height);
-
-    // Select area to update
-    rect.x = 0;
-    rect.y = 0;
-    rect.w = is->videoContext->width;
-    rect.h = is->videoContext->height;
-
-    // Update texture with YUV converted video frame
-    SDL_UpdateYUVTexture(*texture,
-                         &rect,
-                         frame->data[0],
-                         frame->linesize[0],
-                         frame->data[1],
-                         frame->linesize[1],
-                         frame->data[2],
-                         frame->linesize[2]);
+    slot = &is->textureQueue.slots[is->textureQueue_windex];
+    if (!slot->frame && !(slot->frame = av_frame_alloc())) {
+        LOG_ERR("Could not allocate memory for frame");
+        return SCHED_AGAIN;
+    }
+
+    slot->pts = (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        ? NAN : frame->best_effort_timestamp * av_q2d(is->videoStream->time_base);
+    slot->duration = is->frame_duration;
+    slot->serial = is->viddec.pkt_serial;
+    av_frame_move_ref(slot->frame, frame);
 
     if (++is->textureQueue_windex == TEXTURE_QUEUE_SIZE)
         is->textureQueue_windex = 0;
 
     SDL_LockMutex(is->textureQueueMutex);
     is->textureQueue_size++;
+    if (is->refresh_on_frame) {
+        is->refresh_on_frame = 0;
+        push_refresh_event(is);
+    }
     SDL_UnlockMutex(is->textureQueueMutex);
 
-    return 0;
+    return SCHED_AGAIN;
 }
 
-int decode_packet_and_queue(VideoState *is, AVPacket *packet) {
-    int (*queue_frame_func)(VideoState*, AVFrame*);
-    AVCodecContext *context;
-    AVFrame *frame;
-    int response;
+/**
+ * Request a seek, carried out by the parse task
+ * @param is pointer to VideoState
+ * @param pos target, in AV_TIME_BASE units
+ * @param rel distance from the current position, picks the seek direction
+ */
+void stream_seek(VideoState *is, int64_t pos, int64_t rel) {
+    SDL_LockMutex(is->wait_mutex);
+    is->seek_pos = pos;
+    is->seek_rel = rel;
+    is->seek_req = 1;
+    is->seek_start = clock_time();
+    is->seek_target = (double)pos / AV_TIME_BASE;
+    SDL_UnlockMutex(is->wait_mutex);
+    sched_submit(is->sched, &is->parse_task);
+}
 
+/**
+ * Seek to the GOP holding target using the keyframe index. Only works for
+ * parts of the file that were read before, or are in the sidecar cache.
+ * @return >= 0 on success
+ */
+static int stream_seek_indexed(VideoState *is, int64_t target) {
+    AVFormatContext *pFormatContext = is->demux.ic;
+    const KeyframeEntry *kf;
+    int64_t ts;
 
-    if (packet->stream_index == is->audio_stream_index) {
-        context = is->audioContext;
-        queue_frame_func = queue_audio_frame;
-    } else if (packet->stream_index == is->video_stream_index) {
-        context = is->videoContext;
-        queue_frame_func = queue_video_frame;
-    } else {
-        // Wut?
-        LOG_ERR("Unknown stream index: %d", packet->stream_index);
+    if (!is->keyframes.nb_entries)
         return -1;
-    }
 
-    response = avcodec_send_packet(context, packet);
-    if (response < 0) {
-        LOG_ERR("Error while sending packet to the decoder: %s - %s", context->codec->name,
-                av_err2str(response));
-        LOG_DEBUG("Codec %s, ID, %d, bit_rate %ld", context->codec->long_name,
-                  context->codec->id, context->bit_rate);
+    kf = keyframe_index_lookup(&is->keyframes,
+                               av_rescale_q(target, AV_TIME_BASE_Q, is->keyframes.time_base));
+    if (!kf)
         return -1;
+
+    if (is->seek_by_bytes && kf->pos >= 0
+            && avformat_seek_file(pFormatContext, -1, kf->pos, kf->pos, kf->pos, AVSEEK_FLAG_BYTE) >= 0)
+        return 0;
+
+    ts = (kf->dts == AV_NOPTS_VALUE || (pFormatContext->iformat->flags & AVFMT_SEEK_TO_PTS))
+        ? kf->pts : kf->dts;
+    return avformat_seek_file(pFormatContext, is->keyframes.stream_index, ts, ts, ts, 0);
+}
+
+/**
+ * Carry out a pending seek request. Queued packets are invalidated by
+ * bumping the queue serials, the decoders flush once they see it.
+ * @param is pointer to VideoState
+ */
+static void stream_seek_apply(VideoState *is) {
+    int64_t target, rel, min, max;
+    int indexed = 1;
+
+    SDL_LockMutex(is->wait_mutex);
+    target = is->seek_pos;
+    rel = is->seek_rel;
+    is->seek_req = 0;
+    SDL_UnlockMutex(is->wait_mutex);
+
+    if (stream_seek_indexed(is, target) < 0) {
+        indexed = 0;
+        min = rel > 0 ? target - rel + 2 : INT64_MIN;
+        max = rel < 0 ? target - rel - 2 : INT64_MAX;
+        if (avformat_seek_file(is->demux.ic, -1, min, target, max, 0) < 0) {
+            LOG_ERR("Could not seek to %.2f s", (double)target / AV_TIME_BASE);
+            return;
+        }
+    }
+    demux_seeked(&is->demux);
+
+    // Also submits the decoder tasks, wherever they wait
+    if (is->audio_stream_index >= 0)
+        packet_queue_next_serial(&is->audioq);
+    if (is->video_stream_index >= 0)
+        packet_queue_next_serial(&is->videoq);
+    clock_set(&is->extclk, (double)target / AV_TIME_BASE, 0);
+    keyframe_index_break(&is->keyframes);
+
+    // Drop the audio still waiting for the device
+    if (is->audioDevice) {
+        SDL_ClearQueuedAudio(is->audioDevice);
+        SDL_LockMutex(is->audio_mutex);
+        is->audio_done = 0;
+        SDL_UnlockMutex(is->audio_mutex);
     }
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        LOG_ERR("Could not allocate memory for frame");
-        return -1;
+    // Decoders that drained at EOF have work again
+    if (is->eof) {
+        is->eof = 0;
+        is->idle_start = 0;
+        SDL_AtomicSet(&is->decoders_running,
+                      (is->audio_stream_index >= 0) + (is->video_stream_index >= 0));
+        is->auddec.finished = 0;
+        is->viddec.finished = 0;
     }
 
-    // While there are still frames to unpack from the packet
-    while (response >= 0) {
-        response = avcodec_receive_frame(is->audioContext, frame);
+    LOG_DEBUG("Seek to %.2f s (%s)", (double)target / AV_TIME_BASE, indexed ? "indexed" : "demuxer");
+}
 
-        // If no more data to be had from the packet
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
-            break;
-        else if (response < 0) {
-            printf("Something went wrong with the stream, skipping frame: %s - %s\n",
-                   context->codec->name, av_err2str(response));
-            continue;
-        }
+/**
+ * Called by the demuxer with every packet read: adds it to the keyframe
+ * index if it starts a GOP of the indexed stream
+ */
+static void parse_packet(void *opaque, AVPacket *packet) {
+    VideoState *is = (VideoState *)opaque;
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
 
-        // Add data to the designated queue
-        if ((*queue_frame_func)(is, frame) < 0) {
-            LOG_ERR("Could not queue data");
+    if (is->bench)
+        is->bench->bytes_read = avio_tell(is->demux.ic->pb);
+
+    if (packet->stream_index != is->keyframes.stream_index
+            || !(packet->flags & AV_PKT_FLAG_KEY) || pts == AV_NOPTS_VALUE)
+        return;
+
+    keyframe_index_add(&is->keyframes, pts, packet->dts, packet->pos);
+}
+
+/**
+ * Lets blocking libavformat calls give up once the item is being closed
+ */
+static int decode_interrupt_cb(void *arg) {
+    VideoState *is = (VideoState *)arg;
+
+    return is->quit;
+}
+
+/**
+ * Set up the custom I/O chain for the input: a throttled test source or a
+ * mapped local file, optionally behind the prefetch thread. Leaves
+ * input_io NULL when libavformat should open the url itself.
+ * @param is pointer to VideoState
+ */
+static int open_input_io(VideoState *is) {
+    const PlayerOptions *o = is->opts;
+    AVIOContext *pb = NULL;
+    void (*pb_close)(AVIOContext **) = NULL;
+
+    if (o->io_rate > 0 || o->io_spike_ms > 0) {
+        pb = throttle_io_open(is->url, o->io_rate, o->io_spike_ms, o->io_spike_interval);
+        if (!pb)
             return -1;
-        }
+        pb_close = throttle_io_close;
+    } else if (o->mmap && o->prefetch <= 0) {
+        // Page faults on a mapping block the parser just like reads do,
+        // so the mapping is only used without prefetching
+        pb = is->mmap_io = mmap_io_open(is->url);
+        pb_close = mmap_io_close;
+    }
 
+    if (o->prefetch > 0) {
+        if (!pb && avio_open2(&pb, is->url, AVIO_FLAG_READ, NULL, NULL) < 0)
+            return -1;
+        pb = is->prefetch_io = prefetch_io_open(pb, pb_close, o->prefetch);
+        if (!pb)
+            return -1;
+        pb_close = prefetch_io_close;
     }
-    av_frame_unref(frame);
 
+    is->input_io = pb;
+    is->input_io_close = pb_close;
     return 0;
 }
 
-/*
-int decode_thread(void *arg) {
-    VideoState  *is = (VideoState *)arg;
-    PacketQueue *q;
-    AVPacket packet;
+static int open_stream_thread(void *arg) {
+    OpenJob *job = (OpenJob *)arg;
 
-    q = &is->audioq;
-    for (;;) {
-        if (is->quit)
+    log_thread_name("open");
+    open_stream_component(job->is, job->stream_index);
+    return 0;
+}
+
+/**
+ * Log which stream of the file plays
+ */
+static void stream_describe(AVFormatContext *ic, int index) {
+    AVStream *st = ic->streams[index];
+    AVDictionaryEntry *lang = av_dict_get(st->metadata, "language", NULL, 0);
+
+    log_info("Playing %s stream %d: %s%s%s", av_get_media_type_string(st->codecpar->codec_type),
+             index, avcodec_get_name(st->codecpar->codec_id),
+             lang ? ", " : "", lang ? lang->value : "");
+}
+
+/**
+ * Stop the decoder task of a type, so nothing but its own slices submits
+ * it any more. Its queue keeps the packets.
+ * @param is pointer to VideoState
+ * @param type AVMEDIA_TYPE_AUDIO or AVMEDIA_TYPE_VIDEO
+ */
+static void decoder_task_stop(VideoState *is, enum AVMediaType type) {
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        decoder_stop(&is->auddec, is->sched);
+        SDL_LockMutex(is->audio_mutex);
+        is->audio_waiting = 0;
+        SDL_UnlockMutex(is->audio_mutex);
+    } else {
+        decoder_stop(&is->viddec, is->sched);
+        SDL_LockMutex(is->textureQueueMutex);
+        is->video_waiting = 0;
+        SDL_UnlockMutex(is->textureQueueMutex);
+    }
+}
+
+/**
+ * Stop the decoder of a type and free it, leaving its packet queue empty.
+ * The demuxer drops the stream's packets from here on. Parse task only.
+ * @param is pointer to VideoState
+ * @param type AVMEDIA_TYPE_AUDIO or AVMEDIA_TYPE_VIDEO
+ */
+static void stream_component_close(VideoState *is, enum AVMediaType type) {
+    Decoder *d = type == AVMEDIA_TYPE_AUDIO ? &is->auddec : &is->viddec;
+    int index = type == AVMEDIA_TYPE_AUDIO ? is->audio_stream_index : is->video_stream_index;
+
+    if (index < 0)
+        return;
+
+    decoder_task_stop(is, type);
+    if (!d->finished)
+        SDL_AtomicAdd(&is->decoders_running, -1);
+    packet_queue_flush(d->queue);
+    decoder_destroy(d);
+    is->demux.stream[type] = -1;
+    is->demux.ic->streams[index]->discard = AVDISCARD_ALL;
+
+    // audioStream and videoStream stay valid, the main thread may still
+    // be showing a frame of the old stream
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        is->audio_stream_index = -1;
+        is->audioContext = NULL;
+        if (is->audioDevice)
+            SDL_ClearQueuedAudio(is->audioDevice);
+    } else {
+        is->video_stream_index = -1;
+        is->videoContext = NULL;
+        frame_pool_destroy(&is->video_frames);
+    }
+}
+
+/**
+ * Carry out a pending stream switch: the decoder of the type moves on to
+ * the next stream of that type in the file, wrapping around. The rest of
+ * the pipeline keeps running; the seek requested along with the switch
+ * then refills the queues from where playback is.
+ * @param is pointer to VideoState
+ */
+static void stream_switch_apply(VideoState *is) {
+    AVFormatContext *ic = is->demux.ic;
+    enum AVMediaType type;
+    int old, index, i, dev;
+
+    SDL_LockMutex(is->wait_mutex);
+    type = is->switch_req;
+    is->switch_req = -1;
+    SDL_UnlockMutex(is->wait_mutex);
+
+    old = type == AVMEDIA_TYPE_AUDIO ? is->audio_stream_index : is->video_stream_index;
+    if (old < 0) {
+        LOG_WARN("No %s stream playing to switch from", av_get_media_type_string(type));
+        return;
+    }
+
+    for (i = 1; i < ic->nb_streams; i++) {
+        index = (old + i) % ic->nb_streams;
+        if (ic->streams[index]->codecpar->codec_type == type)
             break;
+    }
+    if (i == ic->nb_streams) {
+        log_info("No other %s stream in %s", av_get_media_type_string(type), is->url);
+        return;
+    }
 
-        if (q->nb_packets <= 0) {
-            SDL_CondWaitTimeout(q->cond, q->mutex, 10);
-            continue;
-        }
+    // Keep the audio device, the new stream is converted to its format
+    dev = is->audioDevice;
+    stream_component_close(is, type);
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        SDL_LockMutex(is->audio_mutex);
+        is->audioDevice = 0;
+        SDL_UnlockMutex(is->audio_mutex);
+        is->audio_reuse = dev;
+    }
 
-        packet_queue_get(q, &packet);
-        if (packet.stream_index == 0)
-            continue;
+    ic->streams[index]->discard = AVDISCARD_DEFAULT;
+    if (open_stream_component(is, index) < 0) {
+        LOG_ERR("Could not open %s stream %d, staying on %d", av_get_media_type_string(type), index, old);
+        ic->streams[index]->discard = AVDISCARD_ALL;
+        index = old;
+        ic->streams[index]->discard = AVDISCARD_DEFAULT;
+        if (open_stream_component(is, index) < 0)
+            return;
+    }
 
-        decode_packet_and_queue(is, &packet);
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        if (dev && dev != is->audioDevice)
+            SDL_CloseAudioDevice(dev);
+        is->audio_shared = 0;
     }
 
-    return 0;
+    // Seeks go by the keyframes of the stream now playing
+    if (is->keyframes.stream_index == old && index != old) {
+        keyframe_index_free(&is->keyframes);
+        keyframe_index_init(&is->keyframes, index, ic->streams[index]->time_base);
+        if (is->opts->keyframe_cache)
+            keyframe_index_load(&is->keyframes, is->url);
+    }
+
+    stream_describe(ic, index);
 }
-*/
 
-int parse_thread(void *arg) {
-    VideoState      *is = (VideoState *)arg;
+/**
+ * Open the input, pick the streams and open their decoders, which start
+ * running as tasks. First run of the parse task.
+ * @param is pointer to VideoState
+ * @return 0 on success, -1 on error
+ */
+static int parse_open(VideoState *is) {
+    const PlayerOptions *o = is->opts;
     AVFormatContext *pFormatContext;
-    AVPacket        *packet;
-    PacketQueue     *q;
+    SDL_Thread      *open_tid = NULL;
+    OpenJob         job;
+    int64_t         t0 = 0;
+    int64_t         probesize;
+    double          analyzeduration;
+    int             probe_cached;
 
     int audio_index = -1;
     int video_index = -1;
     int i;
 
-    is->audio_stream_index = -1;
-    is->video_stream_index = -1;
-
-    packet_queue_start(&is->audioq);
+    if (is->bench) {
+        t0 = bench_now();
+        bench_io_snapshot(&is->bench->io_start);
+    }
 
-    if (avformat_open_input(&pFormatContext, is->url, NULL, NULL) < 0) {
+    if (open_input_io(is) < 0) {
         LOG_ERR("Could not open the file");
         return -1;
     }
-    is->pFormatContext = pFormatContext;
 
-    packet = av_packet_alloc();
-    if (!packet) {
-        LOG_ERR("Could not allocate memory for packet");
-        return -1;
-    }
+    // Bounded probing, auto keeps libavformat's limits unless starting fast
+    probesize = o->probesize != OPTIONS_AUTO ? o->probesize
+        : o->fast_start ? FAST_START_PROBESIZE : 0;
+    analyzeduration = o->analyzeduration != OPTIONS_AUTO ? o->analyzeduration
+        : o->fast_start ? FAST_START_ANALYZEDURATION : 0;
 
-    if (avformat_find_stream_info(pFormatContext, NULL) < 0)
+    if (demux_open(&is->demux, is->url, is->input_io, decode_interrupt_cb, is,
+                   probesize, analyzeduration) < 0) {
+        if (is->input_io)
+            is->input_io_close(&is->input_io);
         return -1;
+    }
+    pFormatContext = is->demux.ic;
 
-    // Find the first video and audio streams
-    // TODO: System to choose specific stream (Different audio stream)
-    for (i = 0; i < pFormatContext->nb_streams; i++) {
-        if (pFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO
-                && audio_index < 0)
-            audio_index = i;
-        else if (pFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
-                && video_index < 0)
+    is->input_time = clock_time();
 
-            video_index = i;
+    probe_cached = demux_probe(&is->demux, is->url, o->probe_cache);
+    if (probe_cached < 0)
+        return -1;
+    is->probe_time = clock_time();
+
+    // Pick the streams to play and have the demuxer drop all others
+    if (o->stream_enabled[AVMEDIA_TYPE_VIDEO])
+        video_index = demux_find_stream(pFormatContext, AVMEDIA_TYPE_VIDEO,
+                                        o->stream_spec[AVMEDIA_TYPE_VIDEO], -1);
+    if (o->stream_enabled[AVMEDIA_TYPE_AUDIO])
+        audio_index = demux_find_stream(pFormatContext, AVMEDIA_TYPE_AUDIO,
+                                        o->stream_spec[AVMEDIA_TYPE_AUDIO], video_index);
+    if (audio_index < 0 && video_index < 0) {
+        LOG_ERR("No stream to play in %s", is->url);
+        return -1;
+    }
+    is->nb_active_streams = demux_select(&is->demux, video_index, audio_index);
+    if (pFormatContext->nb_streams > is->nb_active_streams)
+        LOG_DEBUG("Discarding %d of %d streams", pFormatContext->nb_streams - is->nb_active_streams,
+                  pFormatContext->nb_streams);
+    // Queued from when their decoder runs, a stream whose decoder does not
+    // open is read and dropped
+    is->demux.stream[AVMEDIA_TYPE_VIDEO] = -1;
+    is->demux.stream[AVMEDIA_TYPE_AUDIO] = -1;
+
+    // Opening the audio device and starting the video decoder's threads
+    // take a while each, do both at once
+    if (audio_index >= 0 && video_index >= 0) {
+        job.is = is;
+        job.stream_index = audio_index;
+        open_tid = SDL_CreateThread(open_stream_thread, "open", &job);
     }
-    if (audio_index >= 0)
-        /* open_stream_component(is, audio_index); */
-        log_info("AudStream...");
+    if (audio_index >= 0 && !open_tid)
+        open_stream_component(is, audio_index);
     if (video_index >= 0)
         open_stream_component(is, video_index);
-        /* printf("VidStream...(Skip for now)"); */
+    if (open_tid)
+        SDL_WaitThread(open_tid, NULL);
+
+    is->decoders_time = clock_time();
+    if (is->video_stream_index >= 0)
+        stream_describe(pFormatContext, is->video_stream_index);
+    if (is->audio_stream_index >= 0)
+        stream_describe(pFormatContext, is->audio_stream_index);
+    log_info("Opened %s in %.0f ms: input %.0f ms, probe %.0f ms (%s), decoders %.0f ms",
+             is->url, (is->decoders_time - is->open_start) * 1000,
+             (is->input_time - is->open_start) * 1000,
+             (is->probe_time - is->input_time) * 1000,
+             probe_cached ? "cached" : probesize > 0 || analyzeduration > 0 ? "bounded" : "full",
+             (is->decoders_time - is->probe_time) * 1000);
+
+    is->av_sync_type = clock_master_type(is->av_sync_type,
+                                         is->audio_stream_index >= 0,
+                                         is->video_stream_index >= 0);
+    log_info("Master clock: %s", clock_master_name(is->av_sync_type));
+
+    // Index the stream that decides where playback can resume
+    i = is->video_stream_index >= 0 ? is->video_stream_index : is->audio_stream_index;
+    keyframe_index_init(&is->keyframes, i,
+                        i >= 0 ? pFormatContext->streams[i]->time_base : (AVRational){ 0, 1 });
+    if (i >= 0 && is->opts->keyframe_cache)
+        keyframe_index_load(&is->keyframes, is->url);
+    is->seek_by_bytes = (pFormatContext->iformat->flags & AVFMT_TS_DISCONT)
+        && strcmp("ogg", pFormatContext->iformat->name);
+
+    if (is->bench) {
+        is->bench->start = bench_now();
+        is->bench->open_time = is->bench->start - t0;
+    }
 
-    // Check if both video and audio stream index are set (meaning they are found and opened)
-    // TODO: Make it so either are optional (Just an audio or video stream)
-    /* if (is->audio_stream_index < 0 || is->video_stream_index < 0) { */
-    /*     LOG_ERR("Could not open codecs"); */
-    /*     goto fail; */
-    /* } */
+    return 0;
+}
 
-    int res;
-    for (;;) {
-        q = NULL;
-        if (is->quit)
-            break;
+/**
+ * One slice of the parse task: opens the item on its first run, then
+ * carries out stream switches and seeks and reads packets until the queues
+ * hold enough. It goes idle at the read-ahead limits, on a full queue and
+ * at the end of the file; the decoders, stream_seek and stream_switch
+ * submit it again.
+ */
+static int parse_run(SchedTask *task) {
+    VideoState *is = (VideoState *)task->opaque;
+    int64_t deadline;
+    int ret;
 
-        // TODO: Max Video queue
-        if (SDL_GetQueuedAudioSize(is->audioDevice) > MAX_AUDIO_QUEUE_SIZE) {
-            SDL_Delay(10);
-            continue;
-        }
+    if (SDL_AtomicGet(&task->stop)) {
+        // The parser owns the keyframe index, the cache is written on the way out
+        if (is->opts->keyframe_cache)
+            keyframe_index_save(&is->keyframes, is->url);
+        keyframe_index_free(&is->keyframes);
+        return SCHED_DONE;
+    }
 
-        if ((res = av_read_frame(is->pFormatContext, packet)) < 0) {
-            /* LOG_DEBUG("av_read_frame < 0: %s", av_err2str(res)); */
-            if (is->pFormatContext->pb->error == 0) {
-                SDL_Delay(100);
-                continue;
-            } else {
-                break;
-            }
+    if (is->quit || is->parse_state == PARSE_FAILED)
+        return SCHED_IDLE;
+
+    if (is->parse_state == PARSE_OPEN) {
+        TRACE_BEGIN("open");
+        ret = parse_open(is);
+        TRACE_END("open");
+        if (ret < 0) {
+            is->parse_state = PARSE_FAILED;
+            if (!is->quit)
+                push_event(is, FF_QUIT_EVENT);
+            return SCHED_IDLE;
         }
+        is->parse_state = PARSE_READ;
+        push_event(is, FF_OPENED_EVENT);
+        // Opening took a slice already
+        return SCHED_AGAIN;
+    }
 
-        if (packet->stream_index == audio_index)
-            q = &is->audioq;
-        else if (packet->stream_index == video_index)
-            q = &is->videoq;
-            // TODO: Skip video for now
-            /* continue; */
-
-        if (q) {
-            /* LOG_DEBUG("Added Packet, ind: %d, Queue size: %d\n", packet->stream_index, q->nb_packets); */
-            packet_queue_put(q, packet);
+    deadline = av_gettime_relative() + task->quantum_us;
+    do {
+        if (is->switch_req >= 0) {
+            TRACE_BEGIN("stream switch");
+            stream_switch_apply(is);
+            TRACE_END("stream switch");
+            // The playlist may pre-open the next item again
+            push_event(is, FF_OPENED_EVENT);
         }
-        /*
-        // Add packet to packet queue
-        SDL_LockMutex(is->packetQueueMutex);
-        while (is->packetQueue_size >= PACKET_QUEUE_SIZE && !is->quit) {
-            SDL_CondWait(is->packetQueueCond, is->packetQueueMutex);
+
+        if (is->seek_req) {
+            TRACE_BEGIN("seek");
+            stream_seek_apply(is);
+            TRACE_END("seek");
+            continue;
         }
-        SDL_UnlockMutex(is->packetQueueMutex);
 
-        is->packetQueue[is->packetQueue_windex] = packet;
+        // Every active queue holds enough read-ahead, until one of the
+        // decoders drains its queue below the low-water mark
+        if (demux_readahead_wait(&is->demux))
+            return SCHED_IDLE;
+
+        ret = demux_step(&is->demux);
+        switch (ret) {
+            case DEMUX_PACKET:
+                break;
+            case DEMUX_FULL:
+                // The decoder submits us as it takes a packet
+                return SCHED_IDLE;
+            case DEMUX_EOF:
+                // Nothing to do until a seek
+                is->eof = 1;
+                return SCHED_IDLE;
+            case DEMUX_RETRY:
+                task->wake_time = clock_time() + 0.01;
+                return SCHED_DELAY;
+            default:
+                // Read error, unless the item is being closed anyway
+                is->parse_state = PARSE_FAILED;
+                if (!is->quit)
+                    push_event(is, FF_QUIT_EVENT);
+                return SCHED_IDLE;
+        }
+    } while (av_gettime_relative() < deadline);
 
-        if (++is->packetQueue_windex == PACKET_QUEUE_SIZE)
-            is->packetQueue_windex = 0;
+    return SCHED_AGAIN;
+}
 
-        SDL_LockMutex(is->packetQueueMutex);
-        is->packetQueue_size++;
-        SDL_UnlockMutex(is->packetQueueMutex);
-        */
-        
-        /* decode_packet_and_queue(is, packet); */
-    }
+/**
+ * Called by a decoder task once its stream is fully drained, it goes idle
+ * until a seek. In benchmark mode the run ends as soon as the last decoder
+ * is done.
+ * @param is pointer to VideoState
+ */
+static void decoder_finished(VideoState *is) {
+    SDL_Event event;
 
+    if (SDL_AtomicAdd(&is->decoders_running, -1) != 1)
+        return;
 
-fail:
-    if(1) {
-        SDL_Event event;
+    // Last decoder drained
+    if (is->bench) {
+        is->bench->end = bench_now();
         event.type = FF_QUIT_EVENT;
         event.user.data1 = is;
         SDL_PushEvent(&event);
+        return;
     }
-    
-    av_packet_free(&packet);
-    return 0;
+
+    // From here on the player should be idle, measure how idle
+    is->idle_cpu_start = bench_cpu_time();
+    is->idle_start = clock_time();
+    // Let the main thread see the end, the next playlist item may be waiting
+    push_refresh_event(is);
 }
 
-int audio_thread(void *arg) {
-    VideoState *is = (VideoState *)arg;
-    Decoder d = is->auddec;
-    AVFrame *frame;
+/**
+ * Log and count the time from a seek request until its first frame is out
+ */
+static void seek_report(VideoState *is) {
+    double latency = clock_time() - is->seek_start;
 
-    frame = av_frame_alloc();
+    histogram_add(&is->seek_latency, latency * 1000000);
+    log_info("Seek to %.2f s: first frame after %.1f ms", is->seek_target, latency * 1000);
+}
 
-    for (;;) {
-        if (is->quit)
-            break;
+/**
+ * One slice of the audio decoder task: decodes and queues frames on the
+ * device until the queue runs dry, the device has enough, or the slice is
+ * used up
+ */
+static int audio_run(SchedTask *task) {
+    VideoState *is = (VideoState *)task->opaque;
+    Decoder *d = &is->auddec;
+    int64_t deadline;
+    int ret;
 
-        decoder_decode_frame(&d, frame);
-        queue_audio_frame(is, frame);
-    }
+    if (SDL_AtomicGet(&task->stop))
+        return SCHED_DONE;
+    if (is->quit)
+        return SCHED_IDLE;
+
+    deadline = av_gettime_relative() + task->quantum_us;
+    do {
+        if (!d->frame_held) {
+            ret = decoder_decode_frame(d, d->frame);
+            if (ret < 0)
+                return SCHED_IDLE;
+            if (ret == 0) {
+                if (!is->bench)
+                    audio_drained(is);
+                d->finished = 1;
+                decoder_finished(is);
+                return SCHED_IDLE;
+            }
 
-    return 0;
+            if (d->pkt_serial != SDL_AtomicGet(&is->audioq.serial)) {
+                av_frame_unref(d->frame);
+                continue;
+            }
+
+            // First frame after a seek, anything still queued is from before it
+            if (d->pkt_serial != d->last_serial && is->audioDevice)
+                SDL_ClearQueuedAudio(is->audioDevice);
+            d->frame_held = 1;
+        }
+
+        ret = queue_audio_frame(is, d->frame);
+        if (ret != SCHED_AGAIN)
+            return ret;
+        d->frame_held = 0;
+        av_frame_unref(d->frame);
+
+        if (d->pkt_serial != d->last_serial) {
+            d->last_serial = d->pkt_serial;
+            if (!is->videoStream && is->seek_start > 0)
+                seek_report(is);
+        }
+    } while (av_gettime_relative() < deadline);
+
+    return SCHED_AGAIN;
 }
 
-int video_thread(void *arg) {
-    VideoState *is = (VideoState *)arg;
-    Decoder d = is->viddec;
-    AVFrame *frame;
+static double get_master_clock(VideoState *is) {
+    switch (is->av_sync_type) {
+        case AV_SYNC_VIDEO_MASTER:
+            return clock_get(&is->vidclk);
+        case AV_SYNC_AUDIO_MASTER:
+            return clock_get(&is->audclk);
+        default:
+            return clock_get(&is->extclk);
+    }
+}
 
-    frame = av_frame_alloc();
+/**
+ * One slice of the video decoder task: decodes frames and hands them to
+ * the texture queue until the packet queue runs dry, the texture queue is
+ * full, or the slice is used up
+ */
+static int video_run(SchedTask *task) {
+    VideoState *is = (VideoState *)task->opaque;
+    Decoder *d = &is->viddec;
+    AVFrame *frame = d->frame;
+    int64_t deadline;
+    double pts, diff;
+    int ret, degrade;
+
+    if (SDL_AtomicGet(&task->stop))
+        return SCHED_DONE;
+    if (is->quit)
+        return SCHED_IDLE;
+
+    // Only against another master clock, video cannot be late against its own
+    degrade = is->opts->adaptive_decode && !is->bench && is->av_sync_type != AV_SYNC_VIDEO_MASTER;
+
+    deadline = av_gettime_relative() + task->quantum_us;
+    do {
+        if (!d->frame_held) {
+            ret = decoder_decode_frame(d, frame);
+            if (ret < 0)
+                return SCHED_IDLE;
+            if (ret == 0) {
+                d->finished = 1;
+                decoder_finished(is);
+                return SCHED_IDLE;
+            }
 
-    for (;;) {
-        if (is->quit)
-            break;
+            if (d->pkt_serial != SDL_AtomicGet(&is->videoq.serial)) {
+                av_frame_unref(frame);
+                continue;
+            }
+
+            diff = NAN;
+            if (is->av_sync_type != AV_SYNC_VIDEO_MASTER && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                pts = frame->best_effort_timestamp * av_q2d(is->videoStream->time_base);
+                diff = pts - get_master_clock(is);
+                if (fabs(diff) >= AV_NOSYNC_THRESHOLD)
+                    diff = NAN;
+            }
+
+            // Step decoding down or back up from how late frames come out and
+            // how many decoded ones are waiting
+            if (degrade && degrade_update(&is->degrade, -diff,
+                                          (double)is->textureQueue_size / TEXTURE_QUEUE_SIZE, clock_time()))
+                degrade_apply(&is->degrade, d->codecContext);
+
+            // Drop frames that are already late before paying for the upload,
+            // as long as there is more video waiting behind them
+            if (is->framedrop && !isnan(diff) && diff < 0 && packet_queue_nb_packets(d->queue) > 0) {
+                metric_add(METRIC_DROPS_EARLY, 1);
+                av_frame_unref(frame);
+                continue;
+            }
+            d->frame_held = 1;
+        }
 
-        decoder_decode_frame(&d, frame);
-        queue_video_frame(is, frame);
+        ret = queue_video_frame(is, frame);
+        if (ret != SCHED_AGAIN)
+            return ret;
+        d->frame_held = 0;
+        av_frame_unref(frame);
+
+        // Pools and queues are filled by now, count allocations from here
+        if (d->stats && d->stats->frames == BENCH_ALLOC_WARMUP_FRAMES)
+            alloc_count_snapshot(&is->bench->alloc_start);
+    } while (av_gettime_relative() < deadline);
+
+    return SCHED_AGAIN;
+}
+
+/**
+ * Copy the frame at the read index into its slot's texture, halved first
+ * if it is shown much smaller than it is, and work out where it goes in
+ * the output. Runs on the main thread, which owns the renderer.
+ * @return the texture, NULL on error
+ */
+static SDL_Texture *texture_queue_upload(VideoState *is) {
+    TextureSlot *slot = &is->textureQueue.slots[is->textureQueue_rindex];
+    AVFrame     *frame = slot->frame;
+    AVCodecParameters *par = is->videoStream->codecpar;
+    SDL_Texture *texture = NULL;
+    Uint32      format;
+    int64_t     t0 = bench_now();
+    int         out_w, out_h, width, height;
+
+    TRACE_BEGIN("upload");
+    if (SDL_GetRendererOutputSize(is->renderer, &out_w, &out_h) < 0) {
+        out_w = SDL_AtomicGet(&is->output_width);
+        out_h = SDL_AtomicGet(&is->output_height);
+    }
+    calculate_display_rect(&is->display_rect, out_w, out_h, frame->width, frame->height,
+                           av_guess_sample_aspect_ratio(is->demux.ic, is->videoStream, frame));
+    if (is->opts->adaptive_resolution)
+        is->reduce = resolution_reduce(frame->width, frame->height,
+                                       &is->display_rect, CONVERT_MAX_REDUCE);
+    width = AV_CEIL_RSHIFT(frame->width, is->reduce);
+    height = AV_CEIL_RSHIFT(frame->height, is->reduce);
+
+    format = convert_texture_format(is->convert, frame->format, is->reduce);
+    // Reuse the pooled texture for this slot, only recreated on size change
+    if (format != SDL_PIXELFORMAT_UNKNOWN)
+        texture = texture_pool_get(&is->textureQueue,
+                                   is->textureQueue_rindex,
+                                   format,
+                                   width,
+                                   height);
+    if (texture && convert_upload(is->convert, texture, frame, is->reduce) < 0)
+        texture = NULL;
+    TRACE_END("upload");
+
+    if (texture) {
+        if (!is->source_pixels)
+            is->resolution_start = clock_time();
+        // Full resolution is the stream's, before lowres, at the same texture format
+        is->source_pixels += (int64_t)par->width * par->height;
+        is->decoded_pixels += (int64_t)frame->width * frame->height;
+        is->full_upload_bytes += convert_texture_bytes(format, par->width, par->height);
+        is->upload_bytes += convert_texture_bytes(format, width, height);
     }
 
-    return 0;
+    metric_time(METRIC_UPLOAD, bench_now() - t0);
+    return texture;
 }
 
 // TODO: Redo whole video rendering part.
 // Probably in different file / module
 void video_display(VideoState *is) {
-    SDL_Rect    rect;
     SDL_Texture *texture;
+    int64_t     t0;
+    double      gap;
 
-    texture = is->textureQueue[is->textureQueue_rindex];
+    texture = texture_queue_upload(is);
+    if (!texture)
+        return;
 
-    // TODO: Stuff for aspect ratio and scaling
-    rect.x = 0;
-    rect.y = 0;
-    rect.w = is->videoContext->width;
-    rect.h = is->videoContext->height;
+    TRACE_BEGIN("present");
+    t0 = bench_now();
 
-    SDL_RenderCopy(is->renderer, texture, NULL, &rect);
+    // The renderer does the final scale to the letterboxed rectangle
+    SDL_RenderClear(is->renderer);
+    SDL_RenderCopy(is->renderer, texture, NULL, &is->display_rect);
+    if (is->show_stats)
+        metrics_draw(is->renderer, &is->stats);
     SDL_RenderPresent(is->renderer);
+
+    metric_time(METRIC_PRESENT, bench_now() - t0);
+    TRACE_END("present");
+    startup_first_frame(is);
+
+    // First frame of a playlist item, see how long the screen waited for it
+    if (is->switch_due > 0) {
+        gap = clock_time() - is->switch_due;
+        histogram_add(is->gaps, FFMAX(gap, 0) * 1000000);
+        log_info("Playlist: item %d on screen %.1f ms after the previous one ended",
+                 is->index + 1, gap * 1000);
+        is->switch_due = 0;
+    }
 }
 
 static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *arg) {
-    SDL_Event event;
-    event.type = FF_REFRESH_EVENT;
-    event.user.data1 = arg;
-    SDL_PushEvent(&event);
+    push_refresh_event(arg);
     return 0;
 }
 
-static void schedule_refresh (VideoState *is, int delay) {
-    SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/**
+ * Have video_refresh_timer run again at a wall time: the main loop sleeps
+ * until then, or with --refresh-timer an SDL timer sends a refresh event
+ * @param is pointer to VideoState
+ * @param due clock_time() to run at
+ */
+static void schedule_refresh(VideoState *is, double due) {
+    if (is->opts->refresh_timer) {
+        SDL_AddTimer(FFMAX(1, (int)((due - clock_time()) * 1000)), sdl_refresh_timer_cb, is);
+        return;
+    }
+    is->refresh_due = due;
+}
+
+/**
+ * Record how a frame put on screen now kept to its due time, and to the
+ * interval planned since the previous one
+ * @param is pointer to VideoState
+ * @param due wall time the frame was due
+ * @param planned 0 if due was only set now, first frame after a seek or a stall
+ */
+static void present_stats(VideoState *is, double due, int planned) {
+    double now = clock_time();
+
+    if (planned) {
+        histogram_add(is->present_late, FFMAX(now - due, 0) * 1000000);
+        if (is->last_present > 0)
+            histogram_add(is->present_jitter,
+                          fabs((now - is->last_present) - (due - is->last_present_due)) * 1000000);
+    }
+    is->last_present = now;
+    is->last_present_due = due;
+}
+
+/**
+ * Presentation over all playlist items so far
+ */
+static void present_report(VideoState *is) {
+    if (!is->present_jitter->count)
+        return;
+
+    log_info("Presentation (%s%s): %"PRIu64" frames, jitter p50 %.2f ms  p99 %.2f ms  max %.2f ms, "
+             "late p50 %.2f ms  p99 %.2f ms",
+             is->opts->refresh_timer ? "timer chain" : "render loop", is->opts->vsync ? ", vsync" : "",
+             is->present_jitter->count,
+             histogram_percentile(is->present_jitter, 50) / 1000.0,
+             histogram_percentile(is->present_jitter, 99) / 1000.0,
+             is->present_jitter->max / 1000.0,
+             histogram_percentile(is->present_late, 50) / 1000.0,
+             histogram_percentile(is->present_late, 99) / 1000.0);
+}
+
+/**
+ * Advance the texture queue read index after a frame is shown or dropped,
+ * returning its buffers to the decoder's frame pool. Submits the video
+ * task if it waits for the slot.
+ */
+static void texture_queue_next(VideoState *is) {
+    av_frame_unref(is->textureQueue.slots[is->textureQueue_rindex].frame);
+    if (++is->textureQueue_rindex == TEXTURE_QUEUE_SIZE) {
+        is->textureQueue_rindex = 0;
+    }
+
+    SDL_LockMutex(is->textureQueueMutex);
+    is->textureQueue_size--;
+    if (is->video_waiting) {
+        is->video_waiting = 0;
+        sched_submit(is->sched, &is->viddec.task);
+    }
+    SDL_UnlockMutex(is->textureQueueMutex);
+}
+
+/**
+ * Check whether the texture queue is empty. If so, the next frame queued
+ * pushes a refresh event, so an empty queue is never polled.
+ * @return 1 if the queue is empty
+ */
+static int texture_queue_wait_frame(VideoState *is) {
+    int empty;
+
+    SDL_LockMutex(is->textureQueueMutex);
+    empty = is->textureQueue_size == 0;
+    is->refresh_on_frame = empty;
+    SDL_UnlockMutex(is->textureQueueMutex);
+
+    return empty;
+}
+
+/**
+ * Once everything was decoded and shown, tell the main thread when the
+ * item is over: when its last frame has been up for its full duration, and
+ * its audio has played out unless the next item continues on the same
+ * device. Called from the refresh with an empty texture queue.
+ * @param is pointer to VideoState
+ */
+static void stream_check_end(VideoState *is) {
+    double time, end, audio_end = 0;
+    int queued;
+
+    if (!is->eof || SDL_AtomicGet(&is->decoders_running) > 0 || is->end_pushed || is->bench)
+        return;
+
+    time = clock_time();
+    end = is->frame_end;
+    if (is->audioDevice && !(is->next && is->next->audio_shared)) {
+        queued = SDL_GetQueuedAudioSize(is->audioDevice);
+        if (queued > 0)
+            audio_end = time + (double)(queued + is->audio_hw_buf_size) / is->audio_bytes_per_sec;
+        end = FFMAX(end, audio_end);
+    }
+
+    if (end > time) {
+        schedule_refresh(is, end);
+        return;
+    }
+
+    // Switching later than this shows as a gap, earlier would cut the
+    // last frame short
+    is->end_time = end > 0 ? end : time;
+    is->end_pushed = 1;
+    push_event(is, FF_EOF_EVENT);
+}
+
+/**
+ * Duration between two queued frames, falling back to the nominal duration
+ */
+static double frame_gap(VideoState *is, TextureSlot *cur, TextureSlot *next) {
+    double duration = next->pts - cur->pts;
+
+    if (isnan(duration) || duration <= 0 || duration > is->max_frame_duration)
+        return cur->duration;
+    return duration;
+}
+
+static void sync_report(VideoState *is, double time) {
+    if (time - is->last_report < 5.0)
+        return;
+    is->last_report = time;
+
+    LOG_DEBUG("A/V drift %+.3fs, drops %d early / %d late, dups %d",
+              is->av_drift, SDL_AtomicGet(&metrics[METRIC_DROPS_EARLY].value),
+              SDL_AtomicGet(&metrics[METRIC_DROPS_LATE].value),
+              SDL_AtomicGet(&metrics[METRIC_DUPS].value));
 }
 
 void video_refresh_timer(void *userdata) {
     VideoState  *is = (VideoState *)userdata;
+    TextureSlot *slot, *next;
+    StageStats  *stats;
+    AVFrame     *frame;
+    double      time, last_duration, delay, duration;
+    int64_t     t0;
+    int         dup, planned;
+
+    // Whatever is due next is decided again below
+    is->refresh_due = 0;
+
+    if (!is->videoStream) {
+        texture_queue_wait_frame(is);
+        stream_check_end(is);
+        return;
+    }
 
-    if (is->videoStream) {
-        if (is->textureQueue_size == 0) {
-            schedule_refresh(is, 1);
-        } else {
-            schedule_refresh(is, 80);
+    // Benchmark sink: upload frames as soon as they are ready
+    if (is->bench) {
+        stats = &is->bench->stages[BENCH_STAGE_SINK];
+        while (!texture_queue_wait_frame(is)) {
+            frame = is->textureQueue.slots[is->textureQueue_rindex].frame;
+            t0 = bench_now();
+            texture_queue_upload(is);
+            histogram_add(&stats->latency, bench_now() - t0);
+            startup_first_frame(is);
+            stats->frames++;
+            stats->bytes += av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+            texture_queue_next(is);
+        }
+        return;
+    }
 
-            video_display(is);
+    if (is->av_sync_type == AV_SYNC_EXTERNAL_CLOCK) {
+        if (is->audio_stream_index >= 0)
+            clock_sync_to_slave(&is->extclk, &is->audclk);
+        else
+            clock_sync_to_slave(&is->extclk, &is->vidclk);
+    }
 
-            if (++is->textureQueue_rindex == TEXTURE_QUEUE_SIZE) {
-                is->textureQueue_rindex = 0;
-            }
+retry:
+    if (texture_queue_wait_frame(is)) {
+        stream_check_end(is);
+        return;
+    }
 
-            SDL_LockMutex(is->textureQueueMutex);
-            is->textureQueue_size--;
-            SDL_CondSignal(is->textureQueueCond);
-            SDL_UnlockMutex(is->textureQueueMutex);
-        }
+    slot = &is->textureQueue.slots[is->textureQueue_rindex];
+
+    // Decoded before the last seek
+    if (slot->serial != SDL_AtomicGet(&is->videoq.serial)) {
+        texture_queue_next(is);
+        goto retry;
+    }
+
+    time = clock_time();
+
+    if (isnan(is->frame_last_pts) || slot->serial != is->frame_last_serial) {
+        // First frame, or first after a seek, start the timer on it
+        is->frame_timer = time;
+        last_duration = 0;
+        is->last_present = 0;
     } else {
-        schedule_refresh(is, 100);
+        last_duration = slot->pts - is->frame_last_pts;
+        if (isnan(last_duration) || last_duration <= 0 || last_duration > is->max_frame_duration)
+            last_duration = slot->duration;
+    }
+
+    delay = last_duration;
+    if (is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
+        is->av_drift = clock_get(&is->vidclk) - get_master_clock(is);
+        if (!isnan(is->av_drift))
+            metric_set(METRIC_AV_DRIFT, is->av_drift * 1000000);
+        delay = clock_target_delay(last_duration, is->av_drift, is->max_frame_duration, &dup);
+        if (dup)
+            metric_add(METRIC_DUPS, 1);
+    }
+
+    // Not yet time for this frame, come back when it is due
+    if (time < is->frame_timer + delay) {
+        schedule_refresh(is, is->frame_timer + delay);
+        return;
+    }
+
+    is->frame_timer += delay;
+    planned = last_duration > 0;
+    if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX) {
+        is->frame_timer = time;
+        planned = 0;
+    }
+
+    if (!isnan(slot->pts))
+        clock_set(&is->vidclk, slot->pts, slot->serial);
+    if (slot->serial != is->frame_last_serial && is->seek_start > 0)
+        seek_report(is);
+    is->frame_last_pts = slot->pts;
+    is->frame_last_serial = slot->serial;
+
+    // If the next frame is also already due, this one is late: skip it
+    if (is->textureQueue_size > 1) {
+        next = &is->textureQueue.slots[(is->textureQueue_rindex + 1) % TEXTURE_QUEUE_SIZE];
+        duration = frame_gap(is, slot, next);
+        if (is->framedrop && is->av_sync_type != AV_SYNC_VIDEO_MASTER
+                && time > is->frame_timer + duration) {
+            metric_add(METRIC_DROPS_LATE, 1);
+            texture_queue_next(is);
+            goto retry;
+        }
+    }
+
+    // The slot may be refilled once released, keep what we still need
+    duration = slot->duration;
+
+    video_display(is);
+    present_stats(is, is->frame_timer, planned);
+    texture_queue_next(is);
+    is->frame_end = is->frame_timer + duration;
+    sync_report(is, time);
+
+    schedule_refresh(is, is->frame_timer + duration);
+}
+
+/**
+ * Wait for the next event, but no longer than until the playing item's
+ * refresh is due. Events are handled up to shortly before that, the rest
+ * is slept precisely so the frame goes up on time. A frame queued while
+ * the refresh waits for one comes in as an event and is shown at once.
+ * @param is playing item
+ * @param event receives the event
+ * @return 1 with an event, 0 when the refresh is due
+ */
+static int wait_event_or_refresh(VideoState *is, SDL_Event *event) {
+    double remaining;
+
+    if (!is->refresh_due) {
+        SDL_WaitEvent(event);
+        return 1;
+    }
+
+    while ((remaining = is->refresh_due - clock_time()) > PRESENT_WAKE_EARLY) {
+        if (SDL_WaitEventTimeout(event, FFMAX(1, (int)((remaining - PRESENT_WAKE_EARLY) * 1000))))
+            return 1;
+    }
+
+    clock_sleep_until(is->refresh_due);
+    is->refresh_due = 0;
+    return 0;
+}
+
+/**
+ * Check whether the next playlist item already plays on our shared audio
+ * device, anything we queue now would land behind its samples
+ */
+static int next_playing(VideoState *is) {
+    int playing = 0;
+
+    if (is->next && is->next->audio_shared) {
+        SDL_LockMutex(is->next->audio_mutex);
+        playing = is->next->audio_go;
+        SDL_UnlockMutex(is->next->audio_mutex);
+    }
+    return playing;
+}
+
+/**
+ * Seek relative to what is playing now
+ * @param is pointer to VideoState
+ * @param incr seconds to skip, negative to go back
+ */
+static void stream_seek_relative(VideoState *is, double incr) {
+    double pos = get_master_clock(is);
+
+    if (next_playing(is)) {
+        LOG_DEBUG("Seek ignored, the next playlist item is already playing");
+        return;
+    }
+    is->end_pushed = 0;
+
+    // Clocks read NAN until the first frame after a seek is out
+    if (isnan(pos))
+        pos = is->seek_target;
+    pos += incr;
+
+    if (is->demux.ic && is->demux.ic->start_time != AV_NOPTS_VALUE
+            && pos < (double)is->demux.ic->start_time / AV_TIME_BASE)
+        pos = (double)is->demux.ic->start_time / AV_TIME_BASE;
+
+    stream_seek(is, (int64_t)(pos * AV_TIME_BASE), (int64_t)(incr * AV_TIME_BASE));
+}
+
+/**
+ * Move to the next audio or video stream of the file without restarting
+ * the player. The parser swaps the decoder, then reads the new stream
+ * from where playback is.
+ * @param is pointer to VideoState
+ * @param type AVMEDIA_TYPE_AUDIO or AVMEDIA_TYPE_VIDEO
+ */
+static void stream_switch(VideoState *is, enum AVMediaType type) {
+    double pos = get_master_clock(is);
+
+    if (next_playing(is)) {
+        LOG_DEBUG("Stream switch ignored, the next playlist item is already playing");
+        return;
     }
+    is->end_pushed = 0;
+
+    if (isnan(pos))
+        pos = is->seek_target;
+
+    SDL_LockMutex(is->wait_mutex);
+    is->switch_req = type;
+    SDL_UnlockMutex(is->wait_mutex);
+    stream_seek(is, (int64_t)(pos * AV_TIME_BASE), 0);
+}
+
+static Uint32 sdl_stats_timer_cb(Uint32 interval, void *arg) {
+    SDL_Event event;
+
+    event.type = FF_STATS_EVENT;
+    event.user.data1 = arg;
+    SDL_PushEvent(&event);
+    return interval;
+}
+
+/**
+ * Take a metrics snapshot, sampling the queue depths which are only read
+ * here instead of being updated on every put/get. Writes the JSON line and
+ * refreshes the window title when the overlay is on.
+ * @param is pointer to VideoState
+ */
+static void stats_update(VideoState *is) {
+    const MetricsSnapshot *s = &is->stats;
+    char title[256];
+
+    metric_set(METRIC_AUDIOQ_PACKETS, packet_queue_nb_packets(&is->audioq));
+    metric_set(METRIC_AUDIOQ_BYTES, SDL_AtomicGet(&is->audioq.size));
+    metric_set(METRIC_VIDEOQ_PACKETS, packet_queue_nb_packets(&is->videoq));
+    metric_set(METRIC_VIDEOQ_BYTES, SDL_AtomicGet(&is->videoq.size));
+    metric_set(METRIC_TEXTURE_QUEUE, is->textureQueue_size);
+
+    metrics_snapshot(&is->stats);
+
+    if (is->stats_file)
+        metrics_write_json(is->stats_file, s);
+
+    if (!is->show_stats)
+        return;
+
+    snprintf(title, sizeof(title),
+             "Player | vq %"PRId64" / %.1f MB  aq %"PRId64" / %.2f MB  tex %"PRId64"/%d | "
+             "dec %.1f ms  up %.2f ms  present %.2f ms | drops %"PRId64"/%"PRId64"  dups %"PRId64"  drift %+.0f ms",
+             s->v[METRIC_VIDEOQ_PACKETS].value, s->v[METRIC_VIDEOQ_BYTES].value / 1e6,
+             s->v[METRIC_AUDIOQ_PACKETS].value, s->v[METRIC_AUDIOQ_BYTES].value / 1e6,
+             s->v[METRIC_TEXTURE_QUEUE].value, TEXTURE_QUEUE_SIZE,
+             s->v[METRIC_VIDEO_DECODE].mean / 1000, s->v[METRIC_UPLOAD].mean / 1000,
+             s->v[METRIC_PRESENT].mean / 1000,
+             s->v[METRIC_DROPS_EARLY].total, s->v[METRIC_DROPS_LATE].total,
+             s->v[METRIC_DUPS].total, s->v[METRIC_AV_DRIFT].value / 1000.0);
+    SDL_SetWindowTitle(is->window, title);
+}
+
+/**
+ * Stop an item's tasks, waiting for the slices they are running. The
+ * parse task goes first, it may be opening or switching decoders.
+ * @param is pointer to VideoState, with quit set
+ */
+static void stream_stop_tasks(VideoState *is) {
+    // A parser waiting on slow input is released first
+    if (is->prefetch_io)
+        prefetch_io_abort(is->prefetch_io);
+
+    sched_task_stop(is->sched, &is->parse_task);
+    decoder_task_stop(is, AVMEDIA_TYPE_AUDIO);
+    decoder_task_stop(is, AVMEDIA_TYPE_VIDEO);
+}
+
+/*
+ * Files played back to back. The item after the playing one is opened as
+ * soon as the playing one is, so its file, decoders and first frames are
+ * ready before they are needed. It takes over the screen when the playing
+ * one ends, and the audio device as soon as the playing one's audio ran
+ * out. Main thread only.
+ */
+typedef struct Playlist {
+    const PlayerOptions *opts;
+    VideoState      *cur;
+    VideoState      *next;          // Pre-opened item after cur, NULL for none
+    int             next_opened;    // next posted FF_OPENED_EVENT
+    int             switch_pending; // cur ended before next was ready
+    int             failures;       // Items in a row that could not be played
+    Histogram       gaps;           // End of one item to the first frame of the next, in us
+    Histogram       present_jitter; // Of all items, see VideoState
+    Histogram       present_late;
+} Playlist;
+
+/**
+ * Open a playlist item: set up its queues and start the parse task, which
+ * opens the file and decoders and posts FF_OPENED_EVENT. The item decodes
+ * until its queues are full, its audio is held until audio_handover.
+ * @param shared playing item, or template for the first one, to take the
+ *               window, renderer and settings from
+ * @param url file to play
+ * @param index position in the playlist
+ * @return the new item, NULL on error
+ */
+static VideoState *stream_open(const VideoState *shared, const char *url, int index) {
+    const PlayerOptions *opts = shared->opts;
+    VideoState *is;
+
+    is = av_mallocz(sizeof(VideoState));
+    if (!is) {
+        LOG_ERR("Could not allocate memory for VideoState");
+        return NULL;
+    }
+
+    is->opts = opts;
+    is->sched = shared->sched;
+    is->av_sync_type = opts->av_sync_type;
+    is->framedrop = shared->framedrop;
+    is->bench = shared->bench;
+    is->window = shared->window;
+    is->renderer = shared->renderer;
+    is->convert = shared->convert;
+    is->show_stats = shared->show_stats;
+    is->stats_file = shared->stats_file;
+    is->gaps = shared->gaps;
+    is->present_jitter = shared->present_jitter;
+    is->present_late = shared->present_late;
+    SDL_AtomicSet(&is->output_width, SDL_AtomicGet((SDL_atomic_t *)&shared->output_width));
+    SDL_AtomicSet(&is->output_height, SDL_AtomicGet((SDL_atomic_t *)&shared->output_height));
+    is->audio_reuse = shared->audioDevice;
+    is->audio_spec = shared->audio_spec;
+
+    av_strlcpy(is->url, url, sizeof(is->url));
+    is->index = index;
+    is->open_start = clock_time();
+
+    clock_init(&is->audclk, &is->audioq.serial);
+    clock_init(&is->vidclk, &is->videoq.serial);
+    clock_init(&is->extclk, NULL);
+    degrade_init(&is->degrade, is->open_start);
+    is->frame_last_pts = NAN;
+    is->switch_req = -1;
+    is->audio_stream_index = -1;
+    is->video_stream_index = -1;
+    // The first frame decoded is shown right away
+    is->refresh_on_frame = 1;
+
+    texture_pool_init(&is->textureQueue, is->renderer);
+    is->textureQueueMutex = SDL_CreateMutex();
+    is->wait_mutex = SDL_CreateMutex();
+    is->audio_mutex = SDL_CreateMutex();
+
+    // Hard limits leave room above the read-ahead, so one queue can keep
+    // filling while the parser still looks for packets of the other
+    if (packet_queue_init(&is->videoq, PACKET_QUEUE_CAPACITY,
+                          FFMIN(2LL * opts->queue_bytes[AVMEDIA_TYPE_VIDEO], INT_MAX)) < 0
+            || packet_queue_init(&is->audioq, PACKET_QUEUE_CAPACITY,
+                                 FFMIN(2LL * opts->queue_bytes[AVMEDIA_TYPE_AUDIO], INT_MAX)) < 0) {
+        LOG_ERR("Could not initialize packet queue");
+        av_free(is);
+        return NULL;
+    }
+    packet_queue_set_readahead(&is->videoq, opts->queue_bytes[AVMEDIA_TYPE_VIDEO],
+                               opts->queue_seconds[AVMEDIA_TYPE_VIDEO], opts->queue_low_water);
+    packet_queue_set_readahead(&is->audioq, opts->queue_bytes[AVMEDIA_TYPE_AUDIO],
+                               opts->queue_seconds[AVMEDIA_TYPE_AUDIO], opts->queue_low_water);
+
+    if (demux_init(&is->demux) < 0) {
+        packet_queue_destroy(&is->videoq);
+        packet_queue_destroy(&is->audioq);
+        av_free(is);
+        return NULL;
+    }
+    is->demux.queue[AVMEDIA_TYPE_AUDIO] = &is->audioq;
+    is->demux.queue[AVMEDIA_TYPE_VIDEO] = &is->videoq;
+    is->demux.on_packet = parse_packet;
+    is->demux.opaque = is;
+    if (is->bench)
+        is->demux.stats = &is->bench->stages[BENCH_STAGE_DEMUX];
+
+    sched_task_init(&is->parse_task, parse_run, is, 1);
+    is->parse_task.wakeup = &is->parse_wakeup;
+    sched_submit(is->sched, &is->parse_task);
+
+    return is;
+}
+
+/**
+ * Stop an item's tasks and free it
+ * @param is pointer to VideoState
+ * @param keep_audio leave the audio device open for the item taking it over
+ */
+static void stream_close(VideoState *is, int keep_audio) {
+    is->quit = 1;
+    stream_stop_tasks(is);
+
+    if (is->audioDevice && !keep_audio)
+        SDL_CloseAudioDevice(is->audioDevice);
+    texture_pool_destroy(&is->textureQueue);
+    decoder_destroy(&is->auddec);
+    decoder_destroy(&is->viddec);
+    frame_pool_destroy(&is->video_frames);
+    demux_close(&is->demux);
+    if (is->input_io)
+        is->input_io_close(&is->input_io);
+
+    packet_queue_destroy(&is->audioq);
+    packet_queue_destroy(&is->videoq);
+    audio_convert_free(&is->audio_conv);
+    SDL_DestroyMutex(is->textureQueueMutex);
+    SDL_DestroyMutex(is->wait_mutex);
+    SDL_DestroyMutex(is->audio_mutex);
+    av_free(is);
+}
+
+// Items being closed in the background, waited for before exiting
+static SDL_atomic_t closers_running;
+
+static int stream_close_thread(void *arg) {
+    VideoState *is = (VideoState *)arg;
+
+    log_thread_name("closer");
+    stream_close(is, is->close_keep_audio);
+    SDL_AtomicAdd(&closers_running, -1);
+    return 0;
+}
+
+/**
+ * Close an item without holding up the main thread: joining its threads,
+ * freeing frame-threaded decoders and closing the input can take tens of
+ * ms. Its textures belong to the renderer and go right away, the rest on
+ * a detached thread.
+ * @param is item no longer shown, nor referenced by any other
+ * @param keep_audio see stream_close
+ */
+static void stream_close_async(VideoState *is, int keep_audio) {
+    SDL_Thread *tid;
+
+    texture_pool_release_textures(&is->textureQueue);
+    is->close_keep_audio = keep_audio;
+
+    SDL_AtomicAdd(&closers_running, 1);
+    tid = SDL_CreateThread(stream_close_thread, "closer", is);
+    if (!tid) {
+        SDL_AtomicAdd(&closers_running, -1);
+        stream_close(is, keep_audio);
+        return;
+    }
+    SDL_DetachThread(tid);
+}
+
+/**
+ * Pre-open the item after a given playlist position, wrapping around with
+ * --loop
+ * @param pl pointer to Playlist
+ * @param after position of the item it follows
+ */
+static void playlist_open_next(Playlist *pl, int after) {
+    const PlayerOptions *o = pl->opts;
+    int index = after + 1;
+
+    if (pl->next || pl->cur->bench || pl->failures >= o->nb_urls)
+        return;
+    if (index >= o->nb_urls) {
+        if (!o->loop)
+            return;
+        index = 0;
+    }
+
+    pl->next = stream_open(pl->cur, o->urls[index], index);
+    pl->next_opened = 0;
+    if (pl->next)
+        pl->next->preopened = 1;
+}
+
+/**
+ * Close the pre-opened item, after making sure the playing one no longer
+ * hands its audio device over to it
+ */
+static void playlist_drop_next(Playlist *pl) {
+    VideoState *next = pl->next;
+
+    SDL_LockMutex(pl->cur->audio_mutex);
+    pl->cur->next = NULL;
+    SDL_UnlockMutex(pl->cur->audio_mutex);
+
+    pl->next = NULL;
+    pl->next_opened = 0;
+    stream_close(next, next->audio_shared);
+}
+
+/**
+ * Make the pre-opened item the playing one. Its first frames are decoded
+ * already; the first is shown right away, on textures taken over from the
+ * item it replaces.
+ */
+static void playlist_switch(Playlist *pl) {
+    VideoState *prev = pl->cur, *next = pl->next;
+    int keep_audio = next->audio_shared;
+
+    pl->cur = next;
+    pl->next = NULL;
+    pl->next_opened = 0;
+    pl->switch_pending = 0;
+
+    next->show_stats = prev->show_stats;
+    next->stats = prev->stats;
+    next->switch_due = prev->end_time;
+    log_info("Playlist: item %d: %s", next->index + 1, next->url);
+
+    audio_handover(next);
+    texture_pool_take(&next->textureQueue, &prev->textureQueue);
+    video_refresh_timer(next);
+
+    // The device now belongs to next. prev's audio thread may still drain,
+    // it must not hand anything over to next any more.
+    SDL_LockMutex(prev->audio_mutex);
+    prev->next = NULL;
+    SDL_UnlockMutex(prev->audio_mutex);
+    stream_close_async(prev, keep_audio);
+    next->audio_shared = 0;
+
+    playlist_open_next(pl, next->index);
+}
+
+/**
+ * An item finished opening its file and decoders
+ * @param pl pointer to Playlist
+ * @param is item that posted FF_OPENED_EVENT
+ */
+static void playlist_opened(Playlist *pl, VideoState *is) {
+    int audio_done;
+
+    if (is == pl->cur) {
+        pl->failures = 0;
+        playlist_open_next(pl, is->index);
+        return;
+    }
+    if (is != pl->next)
+        return;
+
+    pl->next_opened = 1;
+    pl->failures = 0;
+    log_info("Playlist: item %d ready after %.0f ms%s", is->index + 1,
+             (clock_time() - is->open_start) * 1000,
+             is->audio_shared ? ", continuing on the same audio device" : "");
+
+    // From now on the playing item hands the device over when its audio runs out
+    SDL_LockMutex(pl->cur->audio_mutex);
+    pl->cur->next = is;
+    audio_done = pl->cur->audio_done;
+    SDL_UnlockMutex(pl->cur->audio_mutex);
+    if (audio_done && is->audio_shared)
+        audio_handover(is);
+
+    if (pl->switch_pending)
+        playlist_switch(pl);
+}
+
+/**
+ * The playing item is over, switch to the next one if there is one. After
+ * the last item the player stays on its last frame.
+ * @param pl pointer to Playlist
+ * @param is item that posted FF_EOF_EVENT
+ */
+static void playlist_ended(Playlist *pl, VideoState *is) {
+    if (is != pl->cur || !pl->next)
+        return;
+
+    pl->switch_pending = 1;
+    if (pl->next_opened)
+        playlist_switch(pl);
+}
+
+/**
+ * An item could not be opened or hit a read error. The pre-opened item is
+ * skipped, the playing one ends early.
+ * @param pl pointer to Playlist
+ * @param is item that posted FF_QUIT_EVENT
+ * @return 1 if the playlist goes on, 0 if the player should quit
+ */
+static int playlist_failed(Playlist *pl, VideoState *is) {
+    int index;
+
+    if (is == pl->next) {
+        index = is->index;
+        LOG_WARN("Playlist: skipping item %d: %s", index + 1, is->url);
+        playlist_drop_next(pl);
+        pl->failures++;
+        playlist_open_next(pl, index);
+        return 1;
+    }
+
+    // Posted by an item closed since
+    if (is != pl->cur)
+        return 1;
+    if (is->bench)
+        return 0;
+
+    // Nothing was pre-opened if the playing item never opened
+    index = is->index;
+    if (!pl->next) {
+        pl->failures++;
+        playlist_open_next(pl, index);
+    }
+    if (!pl->next)
+        return 0;
+
+    LOG_WARN("Playlist: item %d ended early: %s", index + 1, is->url);
+    pl->switch_pending = 1;
+    if (pl->next_opened)
+        playlist_switch(pl);
+    return 1;
 }
 
 int main(int argc, char *argv[]) {
     VideoState  *is = NULL;
     SDL_Window  *window;
     SDL_Event   event;
+    PlayerOptions opts;
+    Converter   convert;
+    Playlist    pl;
+    Scheduler   sched;
+    double      incr;
+    enum AVMediaType type;
+    Uint32      sdl_flags = SDL_INIT_EVERYTHING;
+    Uint32      window_flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
 
 
     is = av_mallocz(sizeof(VideoState));
@@ -744,78 +2275,288 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    if (argc < 2) {
-        log_info("Usage: %s <video_file>", argv[0]);
+    options_init(&opts);
+    if (options_parse_args(&opts, argc, argv) < 0) {
+        options_usage(argv[0]);
+        return -1;
+    }
+
+    log_set_level(opts.log_level);
+    if (opts.bench_log)
+        return bench_log();
+
+    log_thread_name("main");
+    log_init();
+
+    if (opts.bench_audio)
+        return bench_audio();
+
+    if (opts.bench_formats)
+        return bench_formats(opts.convert_threads);
+
+    if (!opts.url) {
+        options_usage(argv[0]);
         return -1;
     }
 
+    if (opts.bench_threads)
+        return bench_decoder_threads(opts.url);
+
+    if (opts.bench_streams)
+        return bench_streams(opts.urls, opts.nb_urls);
+
+    if (opts.thumbnails > 0)
+        return thumbs_run(&opts);
+
+    if (opts.bench_convert)
+        opts.bench = 1;
+
+    is->opts = &opts;
+    is->av_sync_type = opts.av_sync_type;
+    is->framedrop = opts.framedrop;
+
+    if (opts.bench) {
+        // Runs headless unless the environment asks for a real driver
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+        sdl_flags = SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS;
+        window_flags = SDL_WINDOW_HIDDEN;
+
+        is->bench = bench_stats_alloc(opts.bench_convert);
+        if (!is->bench) {
+            LOG_ERR("Could not allocate benchmark stats");
+            return -1;
+        }
+        is->framedrop = 0;
+    }
+
     // Initialize SDL
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
+    if (SDL_Init(sdl_flags) < 0) {
         fprintf(stderr, "Failed to initialize SDL - %s\n", SDL_GetError());
         return -1;
     }
 
+    // Parse and decoder tasks of all playlist items share the workers. A
+    // parse task blocks in reads on slow input, so keep a few spare.
+    if (sched_init(&sched, FFMAX(SDL_GetCPUCount(), PLAYER_SCHED_MIN_WORKERS), PLAYER_SCHED_QUANTUM_US) < 0)
+        return -1;
+    is->sched = &sched;
+
 
     // Create window
     window = SDL_CreateWindow("Player",
                               SDL_WINDOWPOS_UNDEFINED,
                               SDL_WINDOWPOS_UNDEFINED,
-                              /* is->videoContext->width, */
-                              /* is->videoContext->height, */
-                              1920,
-                              1080,
-                              SDL_WINDOW_SHOWN);
+                              opts.width,
+                              opts.height,
+                              window_flags);
     if (!window) {
         LOG_ERR("SDL: Could not create window");
         return -1;
     }
 
     // Create renderer
-    is->renderer = SDL_CreateRenderer(window, -1, 0);
+    is->window = window;
+    is->renderer = SDL_CreateRenderer(window, -1, opts.vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
     if (!is->renderer) {
         LOG_ERR("SDL: Could not create renderer");
         return -1;
     }
-    SDL_SetRenderDrawColor(is->renderer, 255, 0, 0, 255);
+    SDL_SetRenderDrawColor(is->renderer, 0, 0, 0, 255);
     SDL_RenderClear(is->renderer);
-
-    av_strlcpy(is->url, argv[1], sizeof(is->url));
-
-    is->textureQueueMutex = SDL_CreateMutex();
-    is->textureQueueCond = SDL_CreateCond();
-
-    if (packet_queue_init(&is->videoq) < 0 || packet_queue_init(&is->audioq) < 0) {
-        LOG_ERR("Could not initialize packet queue");
-        return -1;
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    SDL_AtomicSet(&is->output_width, opts.width);
+    SDL_AtomicSet(&is->output_height, opts.height);
+
+    audio_out_init();
+
+    metrics_init();
+    metrics_set_range(METRIC_AUDIOQ_PACKETS, PACKET_QUEUE_CAPACITY);
+    metrics_set_range(METRIC_AUDIOQ_BYTES, opts.queue_bytes[AVMEDIA_TYPE_AUDIO]);
+    metrics_set_range(METRIC_VIDEOQ_PACKETS, PACKET_QUEUE_CAPACITY);
+    metrics_set_range(METRIC_VIDEOQ_BYTES, opts.queue_bytes[AVMEDIA_TYPE_VIDEO]);
+    metrics_set_range(METRIC_TEXTURE_QUEUE, TEXTURE_QUEUE_SIZE);
+    metrics_set_range(METRIC_AV_DRIFT, AV_SYNC_THRESHOLD_MAX * 1000000);
+    is->show_stats = opts.stats;
+    if (opts.stats_file) {
+        is->stats_file = fopen(opts.stats_file, "w");
+        if (!is->stats_file)
+            LOG_WARN("Could not open stats file %s", opts.stats_file);
     }
 
-    schedule_refresh(is, 40);
-
-    is->parse_tid = SDL_CreateThread(parse_thread, "ParseThread", is);
-    if (!is->parse_tid) {
-        LOG_ERR("Could not start Parse Thread");
-        av_free(is);
+    if (convert_init(&convert, is->renderer, opts.convert_threads) < 0)
         return -1;
+    is->convert = &convert;
+
+    if (opts.stats_interval > 0)
+        SDL_AddTimer(opts.stats_interval * 1000, sdl_stats_timer_cb, NULL);
+
+    if (opts.trace_file) {
+#ifdef ENABLE_TRACE
+        trace_init(opts.trace_file);
+        TRACE_THREAD("main");
+#else
+        LOG_WARN("Built without tracing, --trace-file needs make TRACE=1");
+#endif
     }
 
-    /* is->decode_tid = SDL_CreateThread(decode_thread, "DecodeThread", is); */
-    /* if (!is->decode_tid) { */
-    /*     LOG_ERR("Could not start Decode Thread"); */
-    /*     av_free(is); */
-    /*     return -1; */
-    /* } */
+    // is only holds what the playlist items share, the first item takes it from there
+    memset(&pl, 0, sizeof(Playlist));
+    pl.opts = &opts;
+    is->gaps = &pl.gaps;
+    is->present_jitter = &pl.present_jitter;
+    is->present_late = &pl.present_late;
+    pl.cur = stream_open(is, opts.url, 0);
+    av_free(is);
+    is = pl.cur;
+    if (!is)
+        return -1;
+    audio_handover(is);
+    if (opts.nb_urls > 1 || opts.loop)
+        log_info("Playlist: item 1: %s", is->url);
 
     for (;;) {
-        SDL_WaitEvent(&event);
+        is = pl.cur;
+        if (!wait_event_or_refresh(is, &event)) {
+            video_refresh_timer(is);
+            continue;
+        }
         switch(event.type) {
             case FF_QUIT_EVENT:
+                if (event.user.data1 && playlist_failed(&pl, event.user.data1))
+                    break;
+                is = pl.cur;
+                // fallthrough
             case SDL_QUIT:
+                if (pl.next)
+                    playlist_drop_next(&pl);
+                // The parse task owns the keyframe index, stopping it saves
+                // the cache
                 is->quit = 1;
+                stream_stop_tasks(is);
+                log_info("Texture pool: %d hits, %d reallocs",
+                         SDL_AtomicGet(&is->textureQueue.hits),
+                         SDL_AtomicGet(&is->textureQueue.reallocs));
+                frame_pool_report(&is->video_frames);
+                convert_report(is->convert);
+                resolution_report(is);
+                degrade_report(&is->degrade, clock_time());
+                present_report(is);
+                if (is->audioContext && !is->bench)
+                    log_info("Audio conversion: %d converters built, %"PRId64" frames rate compensated",
+                             is->audio_conv.rebuilds, is->audio_conv.compensated);
+                if (pl.gaps.count)
+                    log_info("Playlist: %"PRIu64" switches, gap p50 %.1f ms  p99 %.1f ms  max %.1f ms",
+                             pl.gaps.count,
+                             histogram_percentile(&pl.gaps, 50) / 1000.0,
+                             histogram_percentile(&pl.gaps, 99) / 1000.0,
+                             pl.gaps.max / 1000.0);
+                log_info("A/V sync (%s master): drift %+.3fs, drops %d early / %d late, dups %d",
+                         clock_master_name(is->av_sync_type), is->av_drift,
+                         SDL_AtomicGet(&metrics[METRIC_DROPS_EARLY].value),
+                         SDL_AtomicGet(&metrics[METRIC_DROPS_LATE].value),
+                         SDL_AtomicGet(&metrics[METRIC_DUPS].value));
+                if (is->bench) {
+                    if (!is->bench->end)
+                        is->bench->end = bench_now();
+                    bench_io_snapshot(&is->bench->io_end);
+                    alloc_count_snapshot(&is->bench->alloc_end);
+                    bench_report(is->bench, is->url);
+                    if (is->mmap_io)
+                        mmap_io_report(is->mmap_io);
+                }
+                bench_report_wakeup("parse task", &is->parse_wakeup);
+                bench_report_wakeup("audio task", &is->audio_wakeup);
+                bench_report_wakeup("video task", &is->video_wakeup);
+                if (is->prefetch_io)
+                    prefetch_io_report(is->prefetch_io);
+                if (is->stats_file)
+                    fclose(is->stats_file);
+#ifdef ENABLE_TRACE
+                trace_write();
+#endif
+                if (is->seek_latency.count)
+                    log_info("Seeks: %"PRIu64", first frame p50 %.1f ms  p99 %.1f ms  max %.1f ms",
+                             is->seek_latency.count,
+                             histogram_percentile(&is->seek_latency, 50) / 1000.0,
+                             histogram_percentile(&is->seek_latency, 99) / 1000.0,
+                             is->seek_latency.max / 1000.0);
+                if (is->idle_start > 0)
+                    log_info("Idle after EOF: %.2f%% CPU over %.1f s",
+                             (bench_cpu_time() - is->idle_cpu_start) * 100
+                             / FFMAX(clock_time() - is->idle_start, 1e-6),
+                             clock_time() - is->idle_start);
+                while (SDL_AtomicGet(&closers_running) > 0)
+                    SDL_Delay(1);
+                if (is->bench)
+                    sched_report(&sched);
+                sched_destroy(&sched);
+                log_shutdown();
                 SDL_Quit();
                 return 0;
                 break;
+            case SDL_KEYDOWN:
+                switch (event.key.keysym.sym) {
+                    case SDLK_LEFT:
+                        incr = -10.0;
+                        break;
+                    case SDLK_RIGHT:
+                        incr = 10.0;
+                        break;
+                    case SDLK_DOWN:
+                        incr = -60.0;
+                        break;
+                    case SDLK_UP:
+                        incr = 60.0;
+                        break;
+                    case SDLK_a:
+                    case SDLK_v:
+                        type = event.key.keysym.sym == SDLK_a ? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_VIDEO;
+                        if (!is->bench && !next_playing(is)) {
+                            // The pre-opened item may be set to take over our
+                            // audio device, it is opened again after the switch
+                            if (type == AVMEDIA_TYPE_AUDIO && pl.next)
+                                playlist_drop_next(&pl);
+                            stream_switch(is, type);
+                        }
+                        incr = 0;
+                        break;
+                    case SDLK_i:
+                        is->show_stats = !is->show_stats;
+                        if (!is->show_stats)
+                            SDL_SetWindowTitle(is->window, "Player");
+                        incr = 0;
+                        break;
+                    default:
+                        incr = 0;
+                        break;
+                }
+                if (incr != 0 && !is->bench)
+                    stream_seek_relative(is, incr);
+                break;
+            case SDL_WINDOWEVENT:
+                if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    SDL_AtomicSet(&is->output_width, event.window.data1);
+                    SDL_AtomicSet(&is->output_height, event.window.data2);
+                    if (pl.next) {
+                        SDL_AtomicSet(&pl.next->output_width, event.window.data1);
+                        SDL_AtomicSet(&pl.next->output_height, event.window.data2);
+                    }
+                }
+                break;
+            case FF_STATS_EVENT:
+                stats_update(is);
+                break;
+            case FF_OPENED_EVENT:
+                playlist_opened(&pl, event.user.data1);
+                break;
+            case FF_EOF_EVENT:
+                playlist_ended(&pl, event.user.data1);
+                break;
             case FF_REFRESH_EVENT:
-                video_refresh_timer(event.user.data1);
+                // Timers set by items closed since still go off
+                if (event.user.data1 == is)
+                    video_refresh_timer(is);
             default:
                 break;
         }
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "metrics.h"
+
+#define METRICS_BAR_WIDTH 200
+#define METRICS_BAR_HEIGHT 8
+#define METRICS_BAR_GAP 4
+#define METRICS_MARGIN 10
+
+Metric metrics[METRIC_NB] = {
+    [METRIC_AUDIOQ_PACKETS] = { "audioq_packets",   METRIC_GAUGE },
+    [METRIC_AUDIOQ_BYTES]   = { "audioq_bytes",     METRIC_GAUGE },
+    [METRIC_VIDEOQ_PACKETS] = { "videoq_packets",   METRIC_GAUGE },
+    [METRIC_VIDEOQ_BYTES]   = { "videoq_bytes",     METRIC_GAUGE },
+    [METRIC_TEXTURE_QUEUE]  = { "texture_queue",    METRIC_GAUGE },
+    [METRIC_AUDIO_DECODE]   = { "audio_decode_us",  METRIC_TIMING },
+    [METRIC_VIDEO_DECODE]   = { "video_decode_us",  METRIC_TIMING },
+    [METRIC_UPLOAD]         = { "upload_us",        METRIC_TIMING },
+    [METRIC_PRESENT]        = { "present_us",       METRIC_TIMING },
+    [METRIC_DROPS_EARLY]    = { "drops_early",      METRIC_COUNTER },
+    [METRIC_DROPS_LATE]     = { "drops_late",       METRIC_COUNTER },
+    [METRIC_DUPS]           = { "dups",             METRIC_COUNTER },
+    [METRIC_AV_DRIFT]       = { "av_drift_us",      METRIC_GAUGE },
+    [METRIC_DECODE_LEVEL]   = { "decode_level",     METRIC_GAUGE },
+    [METRIC_DECODE_DEGRADES] = { "decode_degrades", METRIC_COUNTER },
+};
+
+static int64_t metrics_start;
+static int64_t metrics_last;
+
+
+void metrics_init(void) {
+    metrics_start = metrics_last = av_gettime_relative();
+}
+
+/**
+ * Set the value that fills a whole bar in the overlay
+ * @param id METRIC_*
+ * @param range full-scale value, for timings compared to the mean
+ */
+void metrics_set_range(int id, int range) {
+    metrics[id].range = range;
+}
+
+/**
+ * Read every metric. Counters are turned into the count since the previous
+ * snapshot and the total, timings into the count, mean and max since the
+ * previous snapshot. Must only be called from one thread.
+ * @param s snapshot to fill
+ */
+void metrics_snapshot(MetricsSnapshot *s) {
+    int64_t now = av_gettime_relative();
+    unsigned int value, count;
+    Metric *m;
+    int i;
+
+    s->time = (now - metrics_start) / 1000000.0;
+    s->interval = (now - metrics_last) / 1000000.0;
+    metrics_last = now;
+
+    for (i = 0; i < METRIC_NB; i++) {
+        m = &metrics[i];
+        value = SDL_AtomicGet(&m->value);
+
+        switch (m->type) {
+            case METRIC_GAUGE:
+                s->v[i].value = (int)value;
+                break;
+            case METRIC_COUNTER:
+                s->v[i].value = value - m->last_value;
+                m->total += s->v[i].value;
+                s->v[i].total = m->total;
+                m->last_value = value;
+                break;
+            case METRIC_TIMING:
+                count = SDL_AtomicGet(&m->count);
+                s->v[i].value = count - m->last_count;
+                s->v[i].mean = s->v[i].value ? (double)(value - m->last_value) / s->v[i].value : 0;
+                s->v[i].max = SDL_AtomicSet(&m->max, 0);
+                m->last_value = value;
+                m->last_count = count;
+                break;
+        }
+    }
+}
+
+/**
+ * Write a snapshot as one JSON object per line
+ */
+void metrics_write_json(FILE *f, const MetricsSnapshot *s) {
+    const Metric *m;
+    int i;
+
+    fprintf(f, "{\"t\":%.3f", s->time);
+    for (i = 0; i < METRIC_NB; i++) {
+        m = &metrics[i];
+        if (m->type == METRIC_TIMING)
+            fprintf(f, ",\"%s\":{\"n\":%"PRId64",\"mean\":%.1f,\"max\":%"PRId64"}",
+                    m->name, s->v[i].value, s->v[i].mean, s->v[i].max);
+        else if (m->type == METRIC_COUNTER)
+            fprintf(f, ",\"%s\":{\"n\":%"PRId64",\"total\":%"PRId64"}",
+                    m->name, s->v[i].value, s->v[i].total);
+        else
+            fprintf(f, ",\"%s\":%"PRId64, m->name, s->v[i].value);
+    }
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+/**
+ * Draw one bar per metric with a range, top left, in registry order.
+ * Bars go from green to red as they fill. There is no font, the values
+ * themselves go to the window title.
+ */
+void metrics_draw(SDL_Renderer *renderer, const MetricsSnapshot *s) {
+    SDL_Rect rect;
+    double fill;
+    int i, y = METRICS_MARGIN;
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    for (i = 0; i < METRIC_NB; i++) {
+        if (metrics[i].range <= 0)
+            continue;
+
+        fill = metrics[i].type == METRIC_TIMING ? s->v[i].mean : s->v[i].value;
+        fill = fill < 0 ? -fill : fill;
+        fill = FFMIN(fill / metrics[i].range, 1.0);
+
+        rect.x = METRICS_MARGIN;
+        rect.y = y;
+        rect.w = METRICS_BAR_WIDTH;
+        rect.h = METRICS_BAR_HEIGHT;
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+        SDL_RenderFillRect(renderer, &rect);
+
+        rect.w = fill * METRICS_BAR_WIDTH;
+        SDL_SetRenderDrawColor(renderer, 255 * fill, 255 * (1 - fill), 0, 220);
+        SDL_RenderFillRect(renderer, &rect);
+
+        y += METRICS_BAR_HEIGHT + METRICS_BAR_GAP;
+    }
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
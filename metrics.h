@@ -0,0 +1,99 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+enum {
+    METRIC_GAUGE,                   // Current value, set by whoever knows it
+    METRIC_COUNTER,                 // Events, reported per interval and in total
+    METRIC_TIMING                   // Durations in us, reported per interval
+};
+
+enum {
+    METRIC_AUDIOQ_PACKETS,
+    METRIC_AUDIOQ_BYTES,
+    METRIC_VIDEOQ_PACKETS,
+    METRIC_VIDEOQ_BYTES,
+    METRIC_TEXTURE_QUEUE,
+    METRIC_AUDIO_DECODE,
+    METRIC_VIDEO_DECODE,
+    METRIC_UPLOAD,
+    METRIC_PRESENT,
+    METRIC_DROPS_EARLY,
+    METRIC_DROPS_LATE,
+    METRIC_DUPS,
+    METRIC_AV_DRIFT,                // Video minus master clock, in us
+    METRIC_DECODE_LEVEL,            // DEGRADE_* the video decoder runs at
+    METRIC_DECODE_DEGRADES,         // Steps down to cheaper decoding
+    METRIC_NB
+};
+
+/*
+ * Global registry of pipeline metrics. The hot paths only do atomic adds and
+ * sets on it. Sums are 32 bit and wrap; a snapshot turns counters and
+ * timings into per-interval deltas, which stay correct as long as
+ * snapshots are taken more often than every ~70 minutes, and adds counter
+ * deltas up into 64 bit totals.
+ */
+typedef struct Metric {
+    const char      *name;
+    int             type;
+    int             range;          // Value drawn as a full overlay bar, 0 to hide
+
+    SDL_atomic_t    value;          // Gauge value, counter total or sum of timings
+    SDL_atomic_t    count;          // Number of timings
+    SDL_atomic_t    max;            // Longest timing since the last snapshot
+
+    // Snapshot state, only touched by the thread taking snapshots
+    unsigned int    last_value;
+    unsigned int    last_count;
+    int64_t         total;          // Counters, sum of all deltas
+} Metric;
+
+typedef struct MetricValue {
+    int64_t         value;          // Gauge, or count over the interval for counters and timings
+    double          mean;           // Timings only, over the interval
+    int64_t         max;            // Timings only
+    int64_t         total;          // Counters only, since metrics_init
+} MetricValue;
+
+typedef struct MetricsSnapshot {
+    double          time;           // Seconds since metrics_init
+    double          interval;       // Seconds covered by timings and rates
+    MetricValue     v[METRIC_NB];
+} MetricsSnapshot;
+
+extern Metric metrics[METRIC_NB];
+
+void metrics_init(void);
+void metrics_set_range(int id, int range);
+void metrics_snapshot(MetricsSnapshot *s);
+void metrics_write_json(FILE *f, const MetricsSnapshot *s);
+void metrics_draw(SDL_Renderer *renderer, const MetricsSnapshot *s);
+
+static inline void metric_set(int id, int value) {
+    SDL_AtomicSet(&metrics[id].value, value);
+}
+
+static inline void metric_add(int id, int value) {
+    SDL_AtomicAdd(&metrics[id].value, value);
+}
+
+/**
+ * Record one timing, in us
+ */
+static inline void metric_time(int id, int us) {
+    Metric *m = &metrics[id];
+    int max;
+
+    SDL_AtomicAdd(&m->value, us);
+    SDL_AtomicAdd(&m->count, 1);
+    do {
+        max = SDL_AtomicGet(&m->max);
+    } while (us > max && !SDL_AtomicCAS(&m->max, max, us));
+}
+
+#endif /* METRICS_H_ */
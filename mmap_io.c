@@ -0,0 +1,271 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "mmap_io.h"
+
+#define MMAP_IO_BUFFER_SIZE (64 * 1024)
+// Window the kernel is asked to fetch ahead of the read position
+#define MMAP_IO_READAHEAD (8 * 1024 * 1024)
+
+// Set while this thread copies out of a mapping, where SIGBUS jumps back to
+static __thread sigjmp_buf *mmap_io_jmp;
+static struct sigaction mmap_io_old_sigbus;
+static SDL_SpinLock mmap_io_sigbus_lock;
+static int mmap_io_sigbus_installed;
+
+
+/**
+ * Pages past the end of a file truncated under its mapping raise SIGBUS.
+ * Inside mmap_io_read the read is abandoned, anywhere else the signal is
+ * handed to the previous handler, or kills the process as it would have.
+ */
+static void mmap_io_sigbus(int sig, siginfo_t *info, void *ctx) {
+    if (mmap_io_jmp)
+        siglongjmp(*mmap_io_jmp, 1);
+
+    // Returning retries the access, which faults again under the old action
+    sigaction(SIGBUS, &mmap_io_old_sigbus, NULL);
+}
+
+static void mmap_io_install_sigbus(void) {
+    struct sigaction sa;
+
+    SDL_AtomicLock(&mmap_io_sigbus_lock);
+    if (!mmap_io_sigbus_installed) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = mmap_io_sigbus;
+        sigemptyset(&sa.sa_mask);
+        // Left with siglongjmp, keep SIGBUS unblocked without restoring the mask
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigaction(SIGBUS, &sa, &mmap_io_old_sigbus);
+        mmap_io_sigbus_installed = 1;
+    }
+    SDL_AtomicUnlock(&mmap_io_sigbus_lock);
+}
+
+/**
+ * Check whether the file changed size since it was mapped. From then on
+ * it is read with pread(), the mapping no longer matches the file.
+ * @return 1 if it did
+ */
+static int mmap_io_changed(MmapIO *m) {
+    struct stat st;
+
+    if (fstat(m->fd, &st) < 0 || st.st_size == m->size)
+        return 0;
+
+    if (!m->fallback)
+        LOG_WARN("%s changed size (%"PRId64" to %"PRId64" bytes), reading it with read()",
+                 m->url, m->size, (int64_t)st.st_size);
+    m->size = st.st_size;
+    m->fallback = 1;
+    return 1;
+}
+
+static int mmap_io_read_fd(MmapIO *m, uint8_t *buf, int buf_size) {
+    ssize_t len = pread(m->fd, buf, buf_size, m->pos);
+
+    if (len < 0)
+        return AVERROR(errno);
+    if (len == 0)
+        return AVERROR_EOF;
+
+    m->pos += len;
+    m->reads++;
+    return len;
+}
+
+
+/**
+ * Ask the kernel to start reading the window after pos, once the read
+ * position gets within half a window of the end of the last one
+ */
+static void mmap_io_advise(MmapIO *m) {
+    int64_t start, len;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (m->pos + MMAP_IO_READAHEAD / 2 < m->advised || m->pos >= m->size)
+        return;
+
+    start = m->pos & ~(int64_t)(page - 1);
+    len = FFMIN(MMAP_IO_READAHEAD, m->size - start);
+    madvise(m->data + start, len, MADV_WILLNEED);
+    m->advised = start + len;
+    m->advises++;
+}
+
+static int mmap_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    MmapIO *m = opaque;
+
+    sigjmp_buf jmp;
+    int len;
+
+    if (m->fallback)
+        return mmap_io_read_fd(m, buf, buf_size);
+
+    if (m->pos >= m->size) {
+        // Still being written, the rest is only in the file
+        if (mmap_io_changed(m))
+            return mmap_io_read_fd(m, buf, buf_size);
+        return AVERROR_EOF;
+    }
+
+    mmap_io_advise(m);
+
+    len = FFMIN(buf_size, m->size - m->pos);
+    if (sigsetjmp(jmp, 0)) {
+        mmap_io_jmp = NULL;
+        mmap_io_changed(m);
+        m->fallback = 1;
+        return mmap_io_read_fd(m, buf, buf_size);
+    }
+    mmap_io_jmp = &jmp;
+    memcpy(buf, m->data + m->pos, len);
+    mmap_io_jmp = NULL;
+    m->pos += len;
+    m->reads++;
+
+    return len;
+}
+
+static int64_t mmap_io_seek(void *opaque, int64_t offset, int whence) {
+    MmapIO *m = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            if (m->fallback)
+                mmap_io_changed(m);
+            return m->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = m->pos + offset;
+            break;
+        case SEEK_END:
+            pos = m->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    // Jumped outside the window read ahead so far, start a new one
+    if (pos < m->advised - MMAP_IO_READAHEAD || pos > m->advised)
+        m->advised = 0;
+
+    m->pos = pos;
+    m->seeks++;
+    return pos;
+}
+
+/**
+ * Map url into memory and wrap it in an AVIOContext. A file that grows or
+ * is truncated while open is read with pread() from then on.
+ * @param url path, optionally with a file: prefix
+ * @return the context, or NULL if url is not a regular local file or the
+ *         mapping failed, in which case the normal protocols should be used
+ */
+AVIOContext *mmap_io_open(const char *url) {
+    AVIOContext *pb;
+    MmapIO *m;
+    struct stat st;
+    uint8_t *buffer;
+    void *data;
+    int fd;
+
+    av_strstart(url, "file:", &url);
+    if (strstr(url, "://"))
+        return NULL;
+
+    fd = open(url, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_WARN("Could not map %s, falling back to read()", url);
+        close(fd);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    mmap_io_install_sigbus();
+
+    m = av_mallocz(sizeof(MmapIO));
+    buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+    if (!m || !buffer)
+        goto fail;
+
+    m->url = av_strdup(url);
+    if (!m->url)
+        goto fail;
+    m->fd = fd;
+    m->data = data;
+    m->size = m->map_size = st.st_size;
+
+    pb = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, m, mmap_io_read, NULL, mmap_io_seek);
+    if (!pb)
+        goto fail;
+
+    return pb;
+
+fail:
+    LOG_ERR("Could not allocate mmap I/O context");
+    av_free(buffer);
+    if (m)
+        av_free(m->url);
+    av_free(m);
+    munmap(data, st.st_size);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Free an AVIOContext from mmap_io_open and unmap the file.
+ * The AVFormatContext using it must be closed first.
+ * @param pb pointer to the context, set to NULL
+ */
+void mmap_io_close(AVIOContext **pb) {
+    MmapIO *m;
+
+    if (!*pb)
+        return;
+
+    m = (*pb)->opaque;
+    munmap(m->data, m->map_size);
+    close(m->fd);
+    av_free(m->url);
+    av_free(m);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+void mmap_io_report(AVIOContext *pb) {
+    MmapIO *m = pb->opaque;
+
+    log_info("mmap I/O: %.1f MB mapped, %"PRId64" reads, %"PRId64" seeks, %"PRId64" madvise%s",
+             m->map_size / 1e6, m->reads, m->seeks, m->advises,
+             m->fallback ? ", size changed, read() since" : "");
+}
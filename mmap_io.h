@@ -0,0 +1,34 @@
+#ifndef MMAP_IO_H_
+#define MMAP_IO_H_
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/*
+ * Read-only mapping of a local file behind a custom AVIOContext. Reads are
+ * a memcpy out of the page cache instead of a read() syscall each, and the
+ * kernel is told to read ahead of the current position with madvise.
+ * Files that change size while open, being written or truncated, go on
+ * with pread() on the same descriptor.
+ */
+typedef struct MmapIO {
+    char            *url;           // For messages
+    int             fd;             // Kept open to notice size changes
+    uint8_t         *data;
+    int64_t         map_size;       // Length mapped
+    int64_t         size;           // Length of the file as last seen
+    int             fallback;       // Size changed, read with pread()
+    int64_t         pos;
+    int64_t         advised;        // End of the range last passed to MADV_WILLNEED
+
+    int64_t         reads;          // Read callbacks served
+    int64_t         seeks;
+    int64_t         advises;        // madvise calls issued
+} MmapIO;
+
+AVIOContext *mmap_io_open(const char *url);
+void mmap_io_close(AVIOContext **pb);
+void mmap_io_report(AVIOContext *pb);
+
+#endif /* MMAP_IO_H_ */
@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "clock.h"
+#include "options.h"
+
+#define MAX_CONFIG_LINE 1024
+// libavcodec warns about more than 16 threads for most codecs
+#define MAX_AUTO_THREADS 16
+
+enum {
+    OPT_BOOL,
+    OPT_INT,
+    OPT_DOUBLE,
+    OPT_STRING,
+    OPT_SYNC,
+    OPT_THREADS,
+    OPT_THREAD_TYPE,
+    OPT_LOG_LEVEL,
+    OPT_CONFIG,
+    OPT_PLAYLIST
+};
+
+typedef struct OptionDef {
+    const char      *name;
+    int             type;
+    size_t          offset;
+    const char      *help;
+} OptionDef;
+
+#define OFF(field) offsetof(PlayerOptions, field)
+
+static const OptionDef options[] = {
+    { "audio",              OPT_BOOL,           OFF(stream_enabled[AVMEDIA_TYPE_AUDIO]), "play audio (default on)" },
+    { "video",              OPT_BOOL,           OFF(stream_enabled[AVMEDIA_TYPE_VIDEO]), "play video (default on)" },
+    { "audio-stream",       OPT_STRING,         OFF(stream_spec[AVMEDIA_TYPE_AUDIO]), "audio stream: index, language or codec name" },
+    { "video-stream",       OPT_STRING,         OFF(stream_spec[AVMEDIA_TYPE_VIDEO]), "video stream: index, language or codec name" },
+    { "sync",               OPT_SYNC,           OFF(av_sync_type),  "master clock: audio, video or ext" },
+    { "framedrop",          OPT_BOOL,           OFF(framedrop),     "drop late video frames (default on)" },
+    { "adaptive-decode",    OPT_BOOL,           OFF(adaptive_decode), "skip loop filter, IDCT or frames while video falls behind (default on)" },
+    { "vsync",              OPT_BOOL,           OFF(vsync),         "present frames on vertical blank" },
+    { "refresh-timer",      OPT_BOOL,           OFF(refresh_timer), "schedule refreshes with SDL timers, for comparison" },
+    { "video-threads",      OPT_THREADS,        OFF(thread_count[AVMEDIA_TYPE_VIDEO]), "video decoder threads, number or auto" },
+    { "video-thread-type",  OPT_THREAD_TYPE,    OFF(thread_type[AVMEDIA_TYPE_VIDEO]),  "video threading: frame, slice or auto" },
+    { "audio-threads",      OPT_THREADS,        OFF(thread_count[AVMEDIA_TYPE_AUDIO]), "audio decoder threads, number or auto" },
+    { "audio-thread-type",  OPT_THREAD_TYPE,    OFF(thread_type[AVMEDIA_TYPE_AUDIO]),  "audio threading: frame, slice or auto" },
+    { "video-queue-bytes",  OPT_INT,            OFF(queue_bytes[AVMEDIA_TYPE_VIDEO]),   "video read-ahead in bytes, 0 for no limit" },
+    { "video-queue-seconds", OPT_DOUBLE,        OFF(queue_seconds[AVMEDIA_TYPE_VIDEO]), "video read-ahead in seconds, 0 for no limit, at most 1000" },
+    { "audio-queue-bytes",  OPT_INT,            OFF(queue_bytes[AVMEDIA_TYPE_AUDIO]),   "audio read-ahead in bytes, 0 for no limit" },
+    { "audio-queue-seconds", OPT_DOUBLE,        OFF(queue_seconds[AVMEDIA_TYPE_AUDIO]), "audio read-ahead in seconds, 0 for no limit, at most 1000" },
+    { "convert-threads",    OPT_THREADS,        OFF(convert_threads), "pixel format conversion threads, number or auto" },
+    { "width",              OPT_INT,            OFF(width),         "initial window width" },
+    { "height",             OPT_INT,            OFF(height),        "initial window height" },
+    { "adaptive-resolution", OPT_BOOL,          OFF(adaptive_resolution), "decode or upload at reduced size in small windows (default on)" },
+    { "queue-low-water",    OPT_INT,            OFF(queue_low_water), "percent of the read-ahead to resume reading at, 1 to 100" },
+    { "mmap",               OPT_BOOL,           OFF(mmap),          "map local files into memory (default on)" },
+    { "prefetch",           OPT_INT,            OFF(prefetch),      "bytes read ahead by a separate I/O thread, 0 for off" },
+    { "io-rate",            OPT_INT,            OFF(io_rate),       "test: throttle input to this many bytes/s" },
+    { "io-spike-ms",        OPT_INT,            OFF(io_spike_ms),   "test: stall input reads for this long" },
+    { "io-spike-interval",  OPT_DOUBLE,         OFF(io_spike_interval), "test: seconds between input stalls" },
+    { "stats",              OPT_BOOL,           OFF(stats),         "show the stats overlay, toggled with i" },
+    { "stats-file",         OPT_STRING,         OFF(stats_file),    "write metrics as JSON lines to this file" },
+    { "stats-interval",     OPT_DOUBLE,         OFF(stats_interval), "seconds between metrics snapshots" },
+    { "trace-file",         OPT_STRING,         OFF(trace_file),    "write a Chrome trace on exit (make TRACE=1 builds)" },
+    { "log-level",          OPT_LOG_LEVEL,      OFF(log_level),     "error, warn, info or debug" },
+    { "keyframe-cache",     OPT_BOOL,           OFF(keyframe_cache), "save the keyframe index next to local files" },
+    { "probe-cache",        OPT_BOOL,           OFF(probe_cache),   "save stream parameters next to local files, skip probing next time" },
+    { "probesize",          OPT_INT,            OFF(probesize),     "bytes read to find stream parameters, 0 for the default" },
+    { "analyzeduration",    OPT_DOUBLE,         OFF(analyzeduration), "seconds read to find stream parameters, 0 for the default" },
+    { "fast-start",         OPT_BOOL,           OFF(fast_start),    "probe as little as possible unless probesize/analyzeduration are set" },
+    { "thumbnails",         OPT_INT,            OFF(thumbnails),    "write this many evenly spaced thumbnails and exit" },
+    { "thumb-width",        OPT_INT,            OFF(thumb_width),   "thumbnail width, the height follows the aspect ratio" },
+    { "thumb-threads",      OPT_THREADS,        OFF(thumb_threads), "thumbnail threads, number or auto" },
+    { "thumb-output",       OPT_STRING,         OFF(thumb_output),  "path prefix of the thumbnails written" },
+    { "thumb-format",       OPT_STRING,         OFF(thumb_format),  "png or ppm" },
+    { "contact-sheet",      OPT_BOOL,           OFF(contact_sheet), "write the thumbnails as one grid image" },
+    { "thumb-columns",      OPT_INT,            OFF(thumb_columns), "contact sheet columns, 0 for a square grid" },
+    { "bench",              OPT_BOOL,           OFF(bench),         "headless decode benchmark with a null sink" },
+    { "bench-convert",      OPT_BOOL,           OFF(bench_convert), "benchmark with texture uploads" },
+    { "bench-audio",        OPT_BOOL,           OFF(bench_audio),   "audio output microbenchmark" },
+    { "bench-threads",      OPT_BOOL,           OFF(bench_threads), "decode fps for each thread setting" },
+    { "bench-log",          OPT_BOOL,           OFF(bench_log),     "cost of a log call" },
+    { "bench-formats",      OPT_BOOL,           OFF(bench_formats), "texture upload time per pixel format" },
+    { "bench-streams",      OPT_BOOL,           OFF(bench_streams), "decode 1, 4, 16 and 64 streams on the shared scheduler" },
+    { "config",             OPT_CONFIG,         0,                  "read options from a key = value file" },
+    { "playlist",           OPT_PLAYLIST,       0,                  "add the files listed in a playlist, one per line" },
+    { "loop",               OPT_BOOL,           OFF(loop),          "start the playlist over after the last file" },
+    { NULL },
+};
+
+void options_init(PlayerOptions *o) {
+    memset(o, 0, sizeof(PlayerOptions));
+    o->av_sync_type = AV_SYNC_AUDIO_MASTER;
+    o->framedrop = 1;
+    o->adaptive_decode = 1;
+    o->stream_enabled[AVMEDIA_TYPE_AUDIO] = 1;
+    o->stream_enabled[AVMEDIA_TYPE_VIDEO] = 1;
+    o->mmap = 1;
+    o->width = 1920;
+    o->height = 1080;
+    o->adaptive_resolution = 1;
+    o->io_spike_interval = 5.0;
+    o->stats_interval = 1.0;
+    o->thumb_width = 320;
+    o->thumb_output = "thumb";
+    o->thumb_format = "png";
+    o->log_level = LOG_LDEBUG;
+
+    o->queue_bytes[AVMEDIA_TYPE_VIDEO] = 16 * 1024 * 1024;
+    o->queue_seconds[AVMEDIA_TYPE_VIDEO] = 5.0;
+    o->queue_bytes[AVMEDIA_TYPE_AUDIO] = 1024 * 1024;
+    o->queue_seconds[AVMEDIA_TYPE_AUDIO] = 5.0;
+    o->queue_low_water = 50;
+}
+
+static const OptionDef *find_option(const char *name) {
+    const OptionDef *po;
+
+    for (po = options; po->name; po++)
+        if (strcmp(po->name, name) == 0)
+            return po;
+    return NULL;
+}
+
+static int parse_bool(const char *arg) {
+    if (!arg)
+        return 1;
+    return !(strcmp(arg, "0") == 0 || av_strcasecmp(arg, "no") == 0
+             || av_strcasecmp(arg, "false") == 0 || av_strcasecmp(arg, "off") == 0);
+}
+
+/**
+ * Set a single option
+ * @param o pointer to PlayerOptions
+ * @param po option definition
+ * @param arg value, NULL for a bool given on the command line
+ */
+static int set_option(PlayerOptions *o, const OptionDef *po, const char *arg) {
+    int *dst = (int *)((uint8_t *)o + po->offset);
+    char *end;
+
+    switch (po->type) {
+        case OPT_BOOL:
+            *dst = parse_bool(arg);
+            break;
+        case OPT_INT: {
+            long v = strtol(arg, &end, 10);
+            if (*end || v < 0 || v > INT_MAX)
+                goto invalid;
+            *dst = v;
+            break;
+        }
+        case OPT_DOUBLE:
+            *(double *)dst = strtod(arg, &end);
+            if (*end || *(double *)dst < 0)
+                goto invalid;
+            break;
+        case OPT_STRING:
+            *(char **)dst = av_strdup(arg);
+            if (!*(char **)dst)
+                return -1;
+            break;
+        case OPT_SYNC:
+            if (strcmp(arg, "audio") == 0)
+                *dst = AV_SYNC_AUDIO_MASTER;
+            else if (strcmp(arg, "video") == 0)
+                *dst = AV_SYNC_VIDEO_MASTER;
+            else if (strcmp(arg, "ext") == 0)
+                *dst = AV_SYNC_EXTERNAL_CLOCK;
+            else
+                goto invalid;
+            break;
+        case OPT_THREADS:
+            if (strcmp(arg, "auto") == 0) {
+                *dst = OPTIONS_AUTO;
+                break;
+            }
+            *dst = strtol(arg, &end, 10);
+            if (*end || *dst < 0)
+                goto invalid;
+            break;
+        case OPT_THREAD_TYPE:
+            if (strcmp(arg, "frame") == 0)
+                *dst = FF_THREAD_FRAME;
+            else if (strcmp(arg, "slice") == 0)
+                *dst = FF_THREAD_SLICE;
+            else if (strcmp(arg, "auto") == 0)
+                *dst = OPTIONS_AUTO;
+            else
+                goto invalid;
+            break;
+        case OPT_LOG_LEVEL:
+            if (strcmp(arg, "error") == 0)
+                *dst = LOG_LERR;
+            else if (strcmp(arg, "warn") == 0)
+                *dst = LOG_LWARN;
+            else if (strcmp(arg, "info") == 0)
+                *dst = LOG_LINFO;
+            else if (strcmp(arg, "debug") == 0)
+                *dst = LOG_LDEBUG;
+            else
+                goto invalid;
+            break;
+        case OPT_CONFIG:
+            return options_parse_file(o, arg);
+        case OPT_PLAYLIST:
+            return options_parse_playlist(o, arg);
+    }
+
+    return 0;
+
+invalid:
+    LOG_ERR("Invalid value for %s: %s", po->name, arg);
+    return -1;
+}
+
+/**
+ * Append a file to the playlist
+ * @param o pointer to PlayerOptions
+ * @param url file or url, must outlive o
+ */
+static int options_add_url(PlayerOptions *o, const char *url) {
+    av_dynarray_add(&o->urls, &o->nb_urls, (void *)url);
+    if (!o->urls) {
+        LOG_ERR("Could not allocate memory for the playlist");
+        return -1;
+    }
+    o->url = o->urls[0];
+    return 0;
+}
+
+/**
+ * Parse command line options. Options are --name [value], bools can be
+ * negated with --no-name. Arguments that are not options are the files to
+ * play, in order.
+ * @param o pointer to PlayerOptions, defaults set by options_init
+ * @param argc argument count
+ * @param argv argument values
+ */
+int options_parse_args(PlayerOptions *o, int argc, char *argv[]) {
+    const OptionDef *po;
+    const char *name;
+    int i, negate;
+
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (options_add_url(o, argv[i]) < 0)
+                return -1;
+            continue;
+        }
+
+        name = argv[i] + 2;
+        negate = 0;
+        po = find_option(name);
+        if (!po && strncmp(name, "no-", 3) == 0) {
+            po = find_option(name + 3);
+            negate = 1;
+        }
+        if (!po || (negate && po->type != OPT_BOOL)) {
+            LOG_ERR("Unknown option: %s", argv[i]);
+            return -1;
+        }
+
+        if (po->type == OPT_BOOL) {
+            if (set_option(o, po, negate ? "0" : NULL) < 0)
+                return -1;
+            continue;
+        }
+
+        if (++i >= argc) {
+            LOG_ERR("Missing value for %s", argv[i - 1]);
+            return -1;
+        }
+        if (set_option(o, po, argv[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read options from a config file, one "name = value" per line,
+ * empty lines and lines starting with # are ignored
+ * @param o pointer to PlayerOptions
+ * @param filename config file path
+ */
+int options_parse_file(PlayerOptions *o, const char *filename) {
+    char line[MAX_CONFIG_LINE];
+    char *key, *value, *p;
+    const OptionDef *po;
+    FILE *f;
+    int lineno = 0, ret = 0;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        LOG_ERR("Could not open config file: %s", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        // Strip comments and trailing whitespace
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        p = line + strlen(line);
+        while (p > line && isspace((unsigned char)p[-1]))
+            *--p = '\0';
+
+        key = line;
+        while (isspace((unsigned char)*key))
+            key++;
+        if (!*key)
+            continue;
+
+        value = strchr(key, '=');
+        if (!value) {
+            LOG_ERR("%s:%d: expected name = value", filename, lineno);
+            ret = -1;
+            break;
+        }
+        p = value;
+        *value++ = '\0';
+        while (p > key && isspace((unsigned char)p[-1]))
+            *--p = '\0';
+        while (isspace((unsigned char)*value))
+            value++;
+
+        po = find_option(key);
+        if (!po || po->type == OPT_CONFIG || po->type == OPT_PLAYLIST) {
+            LOG_ERR("%s:%d: unknown option %s", filename, lineno, key);
+            ret = -1;
+            break;
+        }
+        if ((ret = set_option(o, po, value)) < 0)
+            break;
+    }
+
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Add the entries of a playlist file, one file or url per line. Empty lines
+ * and lines starting with #, such as m3u tags, are ignored.
+ * @param o pointer to PlayerOptions
+ * @param filename playlist path
+ */
+int options_parse_playlist(PlayerOptions *o, const char *filename) {
+    char line[MAX_CONFIG_LINE];
+    char *url, *p;
+    FILE *f;
+    int ret = 0;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        LOG_ERR("Could not open playlist: %s", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        p = line + strlen(line);
+        while (p > line && isspace((unsigned char)p[-1]))
+            *--p = '\0';
+
+        url = line;
+        while (isspace((unsigned char)*url))
+            url++;
+        if (!*url || *url == '#')
+            continue;
+
+        if (!(url = av_strdup(url)) || options_add_url(o, url) < 0) {
+            av_free(url);
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+void options_usage(const char *program) {
+    const OptionDef *po;
+
+    log_info("Usage: %s [options] <video_file> [<video_file> ...]", program);
+    for (po = options; po->name; po++)
+        log_info("  --%-20s %s", po->name, po->help);
+}
+
+/**
+ * Resolve the decoder threading for a stream, filling in auto settings.
+ * Auto gives video every core except one per other active stream, audio
+ * decoders are cheap and stay single threaded.
+ * @param o pointer to PlayerOptions
+ * @param type media type of the stream
+ * @param nb_streams number of streams being decoded
+ * @param thread_count set to the thread count for the codec
+ * @param thread_type set to FF_THREAD_* flags for the codec
+ */
+void options_decoder_threads(const PlayerOptions *o, enum AVMediaType type, int nb_streams,
+                             int *thread_count, int *thread_type) {
+    int cores = SDL_GetCPUCount();
+
+    *thread_count = (type >= 0 && type < AVMEDIA_TYPE_NB) ? o->thread_count[type] : 1;
+    *thread_type = (type >= 0 && type < AVMEDIA_TYPE_NB) ? o->thread_type[type] : 0;
+
+    if (*thread_count == OPTIONS_AUTO) {
+        if (type == AVMEDIA_TYPE_VIDEO)
+            *thread_count = FFMIN(MAX_AUTO_THREADS, FFMAX(1, cores - (nb_streams - 1)));
+        else
+            *thread_count = 1;
+    }
+
+    if (*thread_type == OPTIONS_AUTO)
+        *thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+const char *options_thread_type_name(int thread_type) {
+    switch (thread_type) {
+        case FF_THREAD_FRAME:
+            return "frame";
+        case FF_THREAD_SLICE:
+            return "slice";
+        default:
+            return "frame+slice";
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <libavutil/avutil.h>
+
+#define OPTIONS_AUTO 0
+
+typedef struct PlayerOptions {
+    const char      *url;           // First playlist item
+
+    // Items played one after the other, gaplessly
+    const char      **urls;
+    int             nb_urls;
+    int             loop;           // Start over after the last item
+
+    // Stream selection per media type
+    int             stream_enabled[AVMEDIA_TYPE_NB]; // 0 to leave the type out
+    const char      *stream_spec[AVMEDIA_TYPE_NB]; // Index, language or codec, NULL for the best
+
+    int             av_sync_type;
+    int             framedrop;
+    int             adaptive_decode; // Skip decoding work while video falls behind
+    int             vsync;          // Present on vertical blank
+    int             refresh_timer;  // Old SDL timer per refresh instead of the render loop
+
+    // Decoder threading per media type, OPTIONS_AUTO picks from the core count
+    int             thread_count[AVMEDIA_TYPE_NB];
+    int             thread_type[AVMEDIA_TYPE_NB];
+
+    // Packet queue read-ahead per media type
+    int             queue_bytes[AVMEDIA_TYPE_NB];
+    double          queue_seconds[AVMEDIA_TYPE_NB];
+    int             queue_low_water; // Percent of the limits to resume reading at
+
+    int             convert_threads; // Pixel format conversion slices, OPTIONS_AUTO by core count
+
+    int             width;          // Initial window size
+    int             height;
+    int             adaptive_resolution; // lowres or downscale when shown much smaller
+
+    int             keyframe_cache; // Keep the keyframe index in a sidecar file
+    int             probe_cache;    // Keep the stream parameters in a sidecar file
+    int             probesize;      // Bytes probed for stream parameters, OPTIONS_AUTO for the default
+    double          analyzeduration; // Seconds probed, OPTIONS_AUTO for the default
+    int             fast_start;     // Auto probe limits are small ones
+    int             mmap;           // Map local files instead of reading them
+    int             prefetch;       // Bytes read ahead by the I/O thread, 0 for off
+
+    // Simulated slow storage, for testing prefetch
+    int             io_rate;        // Bytes per second, 0 for unlimited
+    int             io_spike_ms;
+    double          io_spike_interval;
+
+    // Thumbnail mode, instead of playing
+    int             thumbnails;     // Number of thumbnails, 0 to play
+    int             thumb_width;
+    int             thumb_threads;  // OPTIONS_AUTO for one per core
+    const char      *thumb_output;  // Path prefix of the files written
+    const char      *thumb_format;  // png or ppm
+    int             contact_sheet;  // One image with all tiles
+    int             thumb_columns;  // Of the contact sheet, OPTIONS_AUTO for a square
+
+    int             stats;          // Show the stats overlay from the start
+    const char      *stats_file;    // JSON lines metrics dump, NULL for none
+    double          stats_interval; // Seconds between metrics snapshots
+    const char      *trace_file;    // Chrome trace written on exit, needs ENABLE_TRACE
+    int             log_level;      // LOG_L*, messages above it are dropped
+
+    int             bench;
+    int             bench_convert;
+    int             bench_audio;
+    int             bench_threads;
+    int             bench_log;
+    int             bench_formats;
+    int             bench_streams;
+} PlayerOptions;
+
+void options_init(PlayerOptions *o);
+int options_parse_args(PlayerOptions *o, int argc, char *argv[]);
+int options_parse_file(PlayerOptions *o, const char *filename);
+int options_parse_playlist(PlayerOptions *o, const char *filename);
+void options_usage(const char *program);
+
+void options_decoder_threads(const PlayerOptions *o, enum AVMediaType type, int nb_streams,
+                             int *thread_count, int *thread_type);
+const char *options_thread_type_name(int thread_type);
+
+#endif /* OPTIONS_H_ */
@@ -0,0 +1,250 @@
+#include <libavcodec/avcodec.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "packet_queue.h"
+
+static int packet_queue_empty(PacketQueue *q) {
+    return packet_queue_nb_packets(q) == 0;
+}
+
+/**
+ * Duration of a packet in us, falling back to the stream default
+ */
+static int packet_duration(PacketQueue *q, AVPacket *pkt) {
+    int64_t duration = pkt->duration;
+
+    if (!pkt->data || !q->time_base.den)
+        return 0;
+    if (duration <= 0)
+        duration = q->default_duration;
+
+    return av_rescale_q(duration, q->time_base, AV_TIME_BASE_Q);
+}
+
+/**
+ * Prepare PacketQueue and allocate the ring
+ * @param q pointer to PacketQueue to initialize
+ * @param max_packets number of packet slots, rounded up to a power of two
+ * @param max_size max total bytes queued, 0 for no limit
+ */
+int packet_queue_init(PacketQueue *q, int max_packets, int max_size) {
+    unsigned int capacity = 1;
+
+    memset(q, 0, sizeof(PacketQueue));
+
+    while (capacity < max_packets)
+        capacity <<= 1;
+    q->capacity = capacity;
+    q->max_size = max_size;
+
+    q->slots = av_mallocz_array(capacity, sizeof(PacketSlot));
+    if (!q->slots) {
+        LOG_ERR("Could not allocate packet ring");
+        return -1;
+    }
+    SDL_AtomicSet(&q->quit, 1);
+    q->low_water = 100;
+
+    return 0;
+}
+
+/**
+ * Set the tasks on the two sides of the queue, woken when the other side
+ * made progress for them
+ * @param q pointer to PacketQueue
+ * @param s scheduler running them
+ * @param producer task putting packets, NULL for none
+ * @param consumer task getting them, NULL for none
+ */
+void packet_queue_set_tasks(PacketQueue *q, Scheduler *s, SchedTask *producer, SchedTask *consumer) {
+    q->sched = s;
+    q->producer = producer;
+    q->consumer = consumer;
+}
+
+/**
+ * Set the time base of the stream feeding this queue, for duration limits
+ * @param q pointer to PacketQueue
+ * @param time_base stream time base
+ * @param default_duration duration used for packets without one, in time_base
+ */
+void packet_queue_set_stream(PacketQueue *q, AVRational time_base, int64_t default_duration) {
+    q->time_base = time_base;
+    q->default_duration = default_duration;
+}
+
+/**
+ * Set the soft read-ahead limits
+ * @param q pointer to PacketQueue
+ * @param max_bytes bytes of read-ahead, 0 for no limit
+ * @param max_seconds seconds of media of read-ahead, 0 for no limit, at most
+ *        PACKET_QUEUE_MAX_SECONDS
+ * @param low_water percentage of the limits below which reading resumes,
+ *        1 to 100
+ */
+void packet_queue_set_readahead(PacketQueue *q, int max_bytes, double max_seconds, int low_water) {
+    if (max_seconds > PACKET_QUEUE_MAX_SECONDS) {
+        LOG_WARN("Read-ahead of %.0f s too long, using %d s", max_seconds, PACKET_QUEUE_MAX_SECONDS);
+        max_seconds = PACKET_QUEUE_MAX_SECONDS;
+    }
+    // At 0 the queue never counts as drained and the reader waits forever,
+    // above 100 it counts as drained while still full
+    if (low_water < 1 || low_water > 100) {
+        LOG_WARN("Read-ahead low water of %d%% out of range, using %d%%", low_water, av_clip(low_water, 1, 100));
+        low_water = av_clip(low_water, 1, 100);
+    }
+    q->readahead_size = FFMAX(max_bytes, 0);
+    q->readahead_duration = max_seconds * AV_TIME_BASE;
+    q->low_water = low_water;
+}
+
+/**
+ * Add a packet to the packet queue. Ownership of the packet data moves
+ * into the queue, pkt is left blank. Must only be called from the producer.
+ * @param q the queue to add to
+ * @param pkt pointer to the packet to add
+ * @return 0 on success, AVERROR(EAGAIN) if the queue is full and pkt was
+ *         left alone, QUIT if the queue was aborted
+ */
+int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+    unsigned int windex;
+    PacketSlot *slot;
+    int size = pkt->size;
+    int duration = packet_duration(q, pkt);
+    int empty;
+
+    if (SDL_AtomicGet(&q->quit)) {
+        av_packet_unref(pkt);
+        return QUIT;
+    }
+    if (packet_queue_full(q))
+        return AVERROR(EAGAIN);
+
+    empty = packet_queue_empty(q);
+    windex = SDL_AtomicGet(&q->windex);
+    slot = &q->slots[windex & (q->capacity - 1)];
+    av_packet_move_ref(&slot->pkt, pkt);
+    slot->serial = SDL_AtomicGet(&q->serial);
+    SDL_AtomicAdd(&q->size, size);
+    SDL_AtomicAdd(&q->duration, duration);
+
+    // Publish the slot. A consumer that found the queue empty went idle,
+    // one that did not yet is made to look again.
+    SDL_AtomicSet(&q->windex, windex + 1);
+    if (empty && q->consumer)
+        sched_submit(q->sched, q->consumer);
+
+    return 0;
+}
+
+/**
+ * Add an empty packet, which makes the decoder drain its last frames
+ * @param q the queue to add to
+ */
+int packet_queue_put_nullpacket(PacketQueue *q) {
+    AVPacket pkt;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    return packet_queue_put(q, &pkt);
+}
+
+/**
+ * Get a packet from the PacketQueue. Must only be called from the consumer.
+ * @param q pointer to PacketQueue
+ * @param pkt pointer to AVPacket to be set
+ * @param serial set to the serial the packet was queued with, may be NULL
+ * @return 1 with a packet, 0 if the queue is empty, QUIT if it was aborted
+ */
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int *serial) {
+    unsigned int rindex;
+    PacketSlot *slot;
+    int full;
+
+    if (SDL_AtomicGet(&q->quit))
+        return QUIT;
+    if (packet_queue_empty(q))
+        return 0;
+
+    full = packet_queue_full(q);
+    rindex = SDL_AtomicGet(&q->rindex);
+    slot = &q->slots[rindex & (q->capacity - 1)];
+    SDL_AtomicAdd(&q->size, -slot->pkt.size);
+    SDL_AtomicAdd(&q->duration, -packet_duration(q, &slot->pkt));
+    av_packet_move_ref(pkt, &slot->pkt);
+    if (serial)
+        *serial = slot->serial;
+
+    // Release the slot back to the producer, which may be idle on a full
+    // queue or on enough read-ahead
+    SDL_AtomicSet(&q->rindex, rindex + 1);
+    if (q->producer && (full || packet_queue_below_low_water(q)))
+        sched_submit(q->sched, q->producer);
+
+    return 1;
+}
+
+/**
+ * Flush PacketQueue and unref all queued packets.
+ * Acts as the consumer, so must not run concurrently with packet_queue_get.
+ * @param q pointer to PacketQueue to flush
+ */
+void packet_queue_flush(PacketQueue *q) {
+    unsigned int rindex;
+    PacketSlot *slot;
+
+    while (!packet_queue_empty(q)) {
+        rindex = SDL_AtomicGet(&q->rindex);
+        slot = &q->slots[rindex & (q->capacity - 1)];
+        SDL_AtomicAdd(&q->size, -slot->pkt.size);
+        SDL_AtomicAdd(&q->duration, -packet_duration(q, &slot->pkt));
+        av_packet_unref(&slot->pkt);
+        SDL_AtomicSet(&q->rindex, rindex + 1);
+    }
+}
+
+/**
+ * Start a new serial, invalidating everything queued so far. The consumer
+ * discards the old packets itself, so this is safe from the producer. It
+ * is woken to do so, also when idle on something other than the queue.
+ * @param q pointer to PacketQueue
+ * @return the new serial
+ */
+int packet_queue_next_serial(PacketQueue *q) {
+    int serial = SDL_AtomicGet(&q->serial) + 1;
+
+    SDL_AtomicSet(&q->serial, serial);
+    if (q->consumer)
+        sched_submit(q->sched, q->consumer);
+
+    return serial;
+}
+
+/**
+ * Set quit flag to 0, enabeling the use of the PacketQueue
+ * @param q pointer to PacketQueue
+ */
+void packet_queue_start(PacketQueue *q) {
+    SDL_AtomicSet(&q->quit, 0);
+}
+
+/**
+ * Set quit flag, both sides get QUIT from then on
+ * @param q pointer to PacketQueue
+ */
+void packet_queue_abort(PacketQueue *q) {
+    SDL_AtomicSet(&q->quit, 1);
+}
+
+/**
+ * Destroy PacketQueue by flushing, then freeing the ring
+ * @param q pointer to PacketQueue
+ */
+void packet_queue_destroy(PacketQueue *q) {
+    if (q->slots)
+        packet_queue_flush(q);
+    av_freep(&q->slots);
+}
@@ -0,0 +1,117 @@
+#ifndef PACKET_QUEUE_H_
+#define PACKET_QUEUE_H_
+
+#include <libavcodec/avcodec.h>
+
+#include <SDL2/SDL.h>
+
+#include "sched.h"
+
+#define QUIT -42
+
+#define PACKET_QUEUE_CAPACITY 1024
+
+/*
+ * Bounded single-producer/single-consumer ring of AVPackets.
+ *
+ * The producer only ever writes windex and the consumer only ever writes
+ * rindex, so it is lock-free. Neither side blocks: both run as scheduler
+ * tasks, which go idle on an empty or full queue. A put that makes the
+ * queue non-empty submits the consumer task, a get that frees a full queue
+ * or leaves it below the low-water mark submits the producer task.
+ *
+ * Besides these hard limits the queue has soft read-ahead limits in bytes
+ * and seconds of media. The producer checks them to stop reading before the
+ * ring fills up, and resumes once the queue drains below the low-water mark.
+ *
+ * Every packet carries the serial of the queue at the time it was put. A seek
+ * bumps the serial from the producer side, the consumer then drops packets of
+ * older serials and flushes its decoder, without the producer touching rindex.
+ */
+typedef struct PacketSlot {
+    AVPacket        pkt;
+    int             serial;
+} PacketSlot;
+
+// Longest read-ahead duration limit in seconds. Queued durations are summed
+// in an int of microseconds, this keeps the sum and its overshoot in range
+#define PACKET_QUEUE_MAX_SECONDS 1000
+
+typedef struct PacketQueue {
+    PacketSlot      *slots;         // Packet slots, capacity entries
+    unsigned int    capacity;       // Always a power of two
+    int             max_size;       // Max total bytes queued, 0 for no limit
+
+    int             readahead_size; // Soft limit in bytes, 0 for none
+    int             readahead_duration; // Soft limit in us, 0 for none
+    int             low_water;      // Percentage of the soft limits to resume at
+    AVRational      time_base;      // Of the packets' stream
+    int64_t         default_duration; // Used for packets without duration, in time_base
+
+    SDL_atomic_t    windex;         // Next slot to write, producer owned
+    SDL_atomic_t    rindex;         // Next slot to read, consumer owned
+    SDL_atomic_t    size;           // Total bytes of queued packets
+    SDL_atomic_t    duration;       // Total duration of queued packets, in us
+    SDL_atomic_t    quit;
+    SDL_atomic_t    serial;         // Bumped on every seek, producer owned
+
+    Scheduler       *sched;         // Running the two sides, NULL until set
+    SchedTask       *producer;
+    SchedTask       *consumer;
+} PacketQueue;
+
+int packet_queue_init(PacketQueue *q, int max_packets, int max_size);
+void packet_queue_set_tasks(PacketQueue *q, Scheduler *s, SchedTask *producer, SchedTask *consumer);
+int packet_queue_put(PacketQueue *q, AVPacket *pkt);
+int packet_queue_put_nullpacket(PacketQueue *q);
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int *serial);
+void packet_queue_flush(PacketQueue *q);
+int packet_queue_next_serial(PacketQueue *q);
+void packet_queue_start(PacketQueue *q);
+void packet_queue_abort(PacketQueue *q);
+void packet_queue_destroy(PacketQueue *q);
+void packet_queue_set_stream(PacketQueue *q, AVRational time_base, int64_t default_duration);
+void packet_queue_set_readahead(PacketQueue *q, int max_bytes, double max_seconds, int low_water);
+
+/**
+ * Number of packets currently in the queue
+ * @param q pointer to PacketQueue
+ */
+static inline int packet_queue_nb_packets(PacketQueue *q) {
+    return (unsigned int)SDL_AtomicGet(&q->windex)
+        - (unsigned int)SDL_AtomicGet(&q->rindex);
+}
+
+/**
+ * Check whether either the packet or the byte limit has been reached
+ * @param q pointer to PacketQueue
+ */
+static inline int packet_queue_full(PacketQueue *q) {
+    return packet_queue_nb_packets(q) >= (int)q->capacity
+        || (q->max_size > 0 && SDL_AtomicGet(&q->size) >= q->max_size);
+}
+
+/**
+ * Check whether the queue holds as much read-ahead as it should.
+ * A queue with no soft limits only counts as full when the ring is.
+ * @param q pointer to PacketQueue
+ */
+static inline int packet_queue_has_enough(PacketQueue *q) {
+    return packet_queue_full(q)
+        || (q->readahead_size > 0 && SDL_AtomicGet(&q->size) >= q->readahead_size)
+        || (q->readahead_duration > 0 && SDL_AtomicGet(&q->duration) >= q->readahead_duration);
+}
+
+/**
+ * Check whether the queue drained below the low-water mark of its limits
+ * @param q pointer to PacketQueue
+ */
+static inline int packet_queue_below_low_water(PacketQueue *q) {
+    int64_t low = q->low_water;
+
+    return packet_queue_nb_packets(q) * 100LL < q->capacity * low
+        && (q->readahead_size <= 0 || SDL_AtomicGet(&q->size) * 100LL < q->readahead_size * low)
+        && (q->readahead_duration <= 0 || SDL_AtomicGet(&q->duration) * 100LL < q->readahead_duration * low);
+}
+
+#endif /* PACKET_QUEUE_H_ */
@@ -0,0 +1,292 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "prefetch_io.h"
+#include "trace.h"
+
+#define PREFETCH_IO_BUFFER_SIZE (64 * 1024)
+// Largest single read issued to the source
+#define PREFETCH_IO_CHUNK (256 * 1024)
+
+
+/**
+ * I/O thread: seek the source when asked, otherwise keep appending to the
+ * ring until it holds size bytes ahead of the reader
+ */
+static int prefetch_io_thread(void *arg) {
+    PrefetchIO *p = arg;
+    int64_t end, seek_pos;
+    int generation, n, ret;
+
+    TRACE_THREAD("prefetch");
+    log_thread_name("prefetch");
+
+    SDL_LockMutex(p->mutex);
+    while (!p->abort) {
+        if (p->seek_pos >= 0) {
+            seek_pos = p->seek_pos;
+            generation = p->generation;
+            p->seek_pos = -1;
+            SDL_UnlockMutex(p->mutex);
+
+            ret = avio_seek(p->src, seek_pos, SEEK_SET);
+
+            SDL_LockMutex(p->mutex);
+            if (ret < 0 && generation == p->generation) {
+                p->error = ret;
+                SDL_CondBroadcast(p->cond);
+            }
+            continue;
+        }
+
+        if (p->eof || p->error || p->end - p->pos >= p->size) {
+            p->writer_waiting = 1;
+            SDL_CondWait(p->cond, p->mutex);
+            p->writer_waiting = 0;
+            continue;
+        }
+
+        // Fill up to the reader position, without wrapping in one read
+        end = p->end;
+        generation = p->generation;
+        n = FFMIN(PREFETCH_IO_CHUNK, p->size - (end - p->pos));
+        n = FFMIN(n, p->size - end % p->size);
+
+        // The bytes about to be overwritten are gone for backward seeks
+        p->start = FFMAX(p->start, end + n - p->size);
+        SDL_UnlockMutex(p->mutex);
+
+        TRACE_BEGIN("prefetch read");
+        ret = avio_read(p->src, p->ring + end % p->size, n);
+        TRACE_END("prefetch read");
+
+        SDL_LockMutex(p->mutex);
+        // The reader seeked away while we were blocked, drop the data
+        if (generation != p->generation)
+            continue;
+
+        if (ret == AVERROR_EOF || ret == 0)
+            p->eof = 1;
+        else if (ret < 0)
+            p->error = ret;
+        else
+            p->end += ret;
+        SDL_CondBroadcast(p->cond);
+    }
+    SDL_UnlockMutex(p->mutex);
+
+    return 0;
+}
+
+static int prefetch_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    PrefetchIO *p = opaque;
+    int64_t t0;
+    int len, ret;
+
+    SDL_LockMutex(p->mutex);
+    histogram_add(&p->fill, (p->end - p->pos) * 100 / p->size);
+    p->reads++;
+
+    if (p->pos >= p->end && !p->eof && !p->error && !p->abort) {
+        TRACE_BEGIN("prefetch stall");
+        t0 = av_gettime_relative();
+        while (p->pos >= p->end && !p->eof && !p->error && !p->abort)
+            SDL_CondWait(p->cond, p->mutex);
+        histogram_add(&p->stall, av_gettime_relative() - t0);
+        TRACE_END("prefetch stall");
+    }
+
+    if (p->abort) {
+        ret = AVERROR_EXIT;
+    } else if (p->pos < p->end) {
+        len = FFMIN(buf_size, p->end - p->pos);
+        len = FFMIN(len, p->size - p->pos % p->size);
+        SDL_UnlockMutex(p->mutex);
+
+        // The I/O thread never writes over [pos, end), copy without the lock
+        memcpy(buf, p->ring + p->pos % p->size, len);
+
+        SDL_LockMutex(p->mutex);
+        p->pos += len;
+        if (p->writer_waiting)
+            SDL_CondBroadcast(p->cond);
+        ret = len;
+    } else {
+        ret = p->error ? p->error : AVERROR_EOF;
+    }
+    SDL_UnlockMutex(p->mutex);
+
+    return ret;
+}
+
+static int64_t prefetch_io_seek(void *opaque, int64_t offset, int whence) {
+    PrefetchIO *p = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return p->file_size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = p->pos + offset;
+            break;
+        case SEEK_END:
+            if (p->file_size < 0)
+                return AVERROR(ENOSYS);
+            pos = p->file_size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    SDL_LockMutex(p->mutex);
+    if (pos >= p->start && pos <= p->end) {
+        p->pos = pos;
+        p->seek_hits++;
+    } else if (!p->src->seekable) {
+        pos = AVERROR(ENOSYS);
+    } else {
+        // Outside the ring, restart the fill from the new position
+        p->generation++;
+        p->pos = p->start = p->end = pos;
+        p->seek_pos = pos;
+        p->eof = 0;
+        p->error = 0;
+        p->seek_misses++;
+        SDL_CondBroadcast(p->cond);
+    }
+    SDL_UnlockMutex(p->mutex);
+
+    return pos;
+}
+
+static void prefetch_io_close_src(AVIOContext **pb) {
+    avio_closep(pb);
+}
+
+/**
+ * Start prefetching from src
+ * @param src source context, owned by the prefetcher from here on
+ * @param src_close function freeing src, NULL for one from avio_open2
+ * @param size prefetch depth in bytes
+ * @return the context to hand to libavformat, or NULL on failure
+ */
+AVIOContext *prefetch_io_open(AVIOContext *src, void (*src_close)(AVIOContext **pb), int size) {
+    AVIOContext *pb = NULL;
+    PrefetchIO *p;
+    uint8_t *buffer = NULL;
+
+    if (!src_close)
+        src_close = prefetch_io_close_src;
+
+    p = av_mallocz(sizeof(PrefetchIO));
+    if (!p)
+        goto fail;
+
+    p->src = src;
+    p->src_close = src_close;
+    p->file_size = avio_size(src);
+    p->size = FFMAX(size, PREFETCH_IO_CHUNK);
+    p->seek_pos = -1;
+    p->pos = p->start = p->end = avio_tell(src);
+
+    p->ring = av_malloc(p->size);
+    buffer = av_malloc(PREFETCH_IO_BUFFER_SIZE);
+    p->mutex = SDL_CreateMutex();
+    p->cond = SDL_CreateCond();
+    if (!p->ring || !buffer || !p->mutex || !p->cond)
+        goto fail;
+
+    pb = avio_alloc_context(buffer, PREFETCH_IO_BUFFER_SIZE, 0, p,
+                            prefetch_io_read, NULL, prefetch_io_seek);
+    if (!pb)
+        goto fail;
+    pb->seekable = src->seekable;
+
+    p->tid = SDL_CreateThread(prefetch_io_thread, "prefetch", p);
+    if (!p->tid) {
+        LOG_ERR("Could not create prefetch thread: %s", SDL_GetError());
+        avio_context_free(&pb);
+        goto fail;
+    }
+
+    return pb;
+
+fail:
+    LOG_ERR("Could not set up prefetching");
+    if (p) {
+        av_free(p->ring);
+        if (p->mutex)
+            SDL_DestroyMutex(p->mutex);
+        if (p->cond)
+            SDL_DestroyCond(p->cond);
+        av_free(p);
+    }
+    av_free(buffer);
+    src_close(&src);
+    return NULL;
+}
+
+/**
+ * Make pending and future reads fail with AVERROR_EXIT, so a reader stuck
+ * on a slow source can quit
+ * @param pb context from prefetch_io_open
+ */
+void prefetch_io_abort(AVIOContext *pb) {
+    PrefetchIO *p = pb->opaque;
+
+    SDL_LockMutex(p->mutex);
+    p->abort = 1;
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->mutex);
+}
+
+/**
+ * Stop the I/O thread and free the context and its source.
+ * The AVFormatContext using it must be closed first.
+ * @param pb pointer to the context, set to NULL
+ */
+void prefetch_io_close(AVIOContext **pb) {
+    PrefetchIO *p;
+
+    if (!*pb)
+        return;
+
+    p = (*pb)->opaque;
+    prefetch_io_abort(*pb);
+    // Returns once the source read in progress, if any, completes
+    SDL_WaitThread(p->tid, NULL);
+
+    p->src_close(&p->src);
+    av_free(p->ring);
+    SDL_DestroyMutex(p->mutex);
+    SDL_DestroyCond(p->cond);
+    av_free(p);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+void prefetch_io_report(AVIOContext *pb) {
+    PrefetchIO *p = pb->opaque;
+
+    SDL_LockMutex(p->mutex);
+    log_info("Prefetch: depth %.1f MB, fill p10 %"PRId64"%% p50 %"PRId64"%%, seeks %"PRId64" buffered / %"PRId64" refilled",
+             p->size / 1e6, histogram_percentile(&p->fill, 10), histogram_percentile(&p->fill, 50),
+             p->seek_hits, p->seek_misses);
+    log_info("Prefetch: %"PRIu64" of %"PRId64" reads stalled, %.1f ms total, p99 %.1f ms, max %.1f ms",
+             p->stall.count, p->reads, p->stall.sum / 1000.0,
+             histogram_percentile(&p->stall, 99) / 1000.0, p->stall.max / 1000.0);
+    SDL_UnlockMutex(p->mutex);
+}
@@ -0,0 +1,56 @@
+#ifndef PREFETCH_IO_H_
+#define PREFETCH_IO_H_
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+#include <SDL2/SDL.h>
+
+#include "histogram.h"
+
+/*
+ * Read-ahead stage between a slow source and the demuxer. An I/O thread
+ * keeps a ring of file bytes filled ahead of the read position, so a
+ * blocking read on the source stalls that thread instead of the parser.
+ *
+ * The ring holds the file range [start, end). The reader moves pos through
+ * it, the I/O thread appends at end and only overwrites bytes behind pos.
+ * Seeks inside the ring are served from it, others restart the fill.
+ */
+typedef struct PrefetchIO {
+    AVIOContext     *src;
+    void            (*src_close)(AVIOContext **pb);
+    int64_t         file_size;
+
+    uint8_t         *ring;
+    int             size;           // Prefetch depth in bytes
+
+    int64_t         pos;            // Reader position, as a file offset
+    int64_t         start;          // Oldest byte still in the ring
+    int64_t         end;            // One past the newest byte in the ring
+    int64_t         seek_pos;       // Source offset the I/O thread must seek to, -1 for none
+    int             generation;     // Bumped by every refill seek, stale reads are dropped
+    int             eof;
+    int             error;
+    int             abort;
+    int             writer_waiting; // I/O thread sleeps on a full ring
+
+    SDL_Thread      *tid;
+    SDL_mutex       *mutex;
+    SDL_cond        *cond;
+
+    // Reader side stats, only touched with mutex held
+    Histogram       fill;           // Percent of the depth buffered ahead, per read
+    Histogram       stall;          // Time reads waited for the I/O thread, in us
+    int64_t         reads;
+    int64_t         seek_hits;      // Seeks served from the ring
+    int64_t         seek_misses;    // Seeks that restarted the fill
+} PrefetchIO;
+
+AVIOContext *prefetch_io_open(AVIOContext *src, void (*src_close)(AVIOContext **pb), int size);
+void prefetch_io_abort(AVIOContext *pb);
+void prefetch_io_close(AVIOContext **pb);
+void prefetch_io_report(AVIOContext *pb);
+
+#endif /* PREFETCH_IO_H_ */
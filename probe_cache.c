@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+
+#include "logging.h"
+#include "probe_cache.h"
+
+#define PROBE_CACHE_SUFFIX ".probe"
+#define PROBE_CACHE_MAGIC 0x42525053 // "SPRB"
+#define PROBE_CACHE_VERSION 2
+// Larger extradata is taken for a corrupt cache
+#define PROBE_CACHE_MAX_EXTRADATA (1 << 20)
+
+/*
+ * Sidecar file layout, native endianness like the keyframe cache: header
+ * followed by nb_streams ProbeCacheStream records, each followed by its
+ * extradata_size bytes of extradata.
+ */
+typedef struct ProbeCacheHeader {
+    uint32_t        magic;
+    uint32_t        version;
+    int64_t         file_size;      // Of the media file, to detect changes
+    int64_t         file_mtime;
+    char            format[32];     // Demuxer name, truncated
+    int64_t         start_time;
+    int64_t         duration;
+    int64_t         bit_rate;
+    int32_t         nb_streams;
+} ProbeCacheHeader;
+
+typedef struct ProbeCacheStream {
+    int32_t         codec_type;
+    int32_t         codec_id;
+    int32_t         format;
+    int32_t         width;
+    int32_t         height;
+    int32_t         sar_num;
+    int32_t         sar_den;
+    int32_t         sample_rate;
+    int32_t         channels;
+    uint64_t        channel_layout;
+    int32_t         tb_num;         // Only checked, the demuxer sets it
+    int32_t         tb_den;
+    int32_t         avg_rate_num;
+    int32_t         avg_rate_den;
+    int32_t         r_rate_num;
+    int32_t         r_rate_den;
+    int64_t         start_time;
+    int64_t         duration;
+    int32_t         profile;
+    int32_t         level;
+    int32_t         video_delay;    // has_b_frames of the decoder
+    int32_t         extradata_size;
+} ProbeCacheStream;
+
+
+static int cache_key(const char *url, int64_t *size, int64_t *mtime) {
+    struct stat st;
+
+    if (stat(url, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+/**
+ * Check that a cached stream describes what the demuxer found
+ */
+static int stream_matches(const AVStream *st, const ProbeCacheStream *c) {
+    const AVCodecParameters *par = st->codecpar;
+
+    return (par->codec_type == AVMEDIA_TYPE_UNKNOWN || par->codec_type == c->codec_type)
+        && (par->codec_id == AV_CODEC_ID_NONE || par->codec_id == c->codec_id)
+        && st->time_base.num == c->tb_num && st->time_base.den == c->tb_den;
+}
+
+/**
+ * Fill in what the demuxer left unset
+ * @param extradata padded copy of the cached extradata, taken over if used
+ */
+static void stream_apply(AVStream *st, const ProbeCacheStream *c, uint8_t **extradata) {
+    AVCodecParameters *par = st->codecpar;
+
+    par->codec_type = c->codec_type;
+    par->codec_id = c->codec_id;
+    if (par->format < 0)
+        par->format = c->format;
+    if (!par->width || !par->height) {
+        par->width = c->width;
+        par->height = c->height;
+    }
+    if (!par->sample_aspect_ratio.num)
+        par->sample_aspect_ratio = av_make_q(c->sar_num, c->sar_den);
+    if (!par->sample_rate)
+        par->sample_rate = c->sample_rate;
+    if (!par->channels)
+        par->channels = c->channels;
+    if (!par->channel_layout)
+        par->channel_layout = c->channel_layout;
+    if (par->profile == FF_PROFILE_UNKNOWN)
+        par->profile = c->profile;
+    if (par->level == FF_LEVEL_UNKNOWN)
+        par->level = c->level;
+    if (!par->video_delay)
+        par->video_delay = c->video_delay;
+    // Parameter sets find_stream_info would have taken from the packets
+    if (!par->extradata_size && *extradata) {
+        par->extradata = *extradata;
+        par->extradata_size = c->extradata_size;
+        *extradata = NULL;
+    }
+
+    if (!st->avg_frame_rate.num)
+        st->avg_frame_rate = av_make_q(c->avg_rate_num, c->avg_rate_den);
+    if (!st->r_frame_rate.num)
+        st->r_frame_rate = av_make_q(c->r_rate_num, c->r_rate_den);
+    if (st->start_time == AV_NOPTS_VALUE)
+        st->start_time = c->start_time;
+    if (st->duration == AV_NOPTS_VALUE)
+        st->duration = c->duration;
+}
+
+/**
+ * Apply the sidecar cache of a local file instead of probing it, if it
+ * matches the file and what its header says
+ * @param ic format context after avformat_open_input
+ * @param url media file path
+ * @return 0 if applied, avformat_find_stream_info can be skipped
+ */
+int probe_cache_load(AVFormatContext *ic, const char *url) {
+    char path[1024];
+    ProbeCacheHeader hdr;
+    ProbeCacheStream *streams = NULL;
+    uint8_t **extradata = NULL;
+    int64_t size, mtime;
+    FILE *f;
+    int i, ret = -1;
+
+    if (cache_key(url, &size, &mtime) < 0)
+        return -1;
+
+    av_strlcpy(path, url, sizeof(path));
+    av_strlcat(path, PROBE_CACHE_SUFFIX, sizeof(path));
+
+    f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+            || hdr.magic != PROBE_CACHE_MAGIC || hdr.version != PROBE_CACHE_VERSION
+            || hdr.file_size != size || hdr.file_mtime != mtime
+            || strncmp(hdr.format, ic->iformat->name, sizeof(hdr.format) - 1) != 0
+            || hdr.nb_streams != ic->nb_streams || hdr.nb_streams <= 0) {
+        LOG_WARN("Ignoring stale probe cache %s", path);
+        goto end;
+    }
+
+    streams = av_malloc_array(hdr.nb_streams, sizeof(ProbeCacheStream));
+    extradata = av_mallocz_array(hdr.nb_streams, sizeof(uint8_t *));
+    if (!streams || !extradata)
+        goto end;
+    for (i = 0; i < hdr.nb_streams; i++) {
+        if (fread(&streams[i], sizeof(ProbeCacheStream), 1, f) != 1
+                || streams[i].extradata_size < 0 || streams[i].extradata_size > PROBE_CACHE_MAX_EXTRADATA) {
+            LOG_WARN("Ignoring corrupt probe cache %s", path);
+            goto end;
+        }
+        if (!streams[i].extradata_size)
+            continue;
+        extradata[i] = av_mallocz(streams[i].extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!extradata[i] || fread(extradata[i], streams[i].extradata_size, 1, f) != 1) {
+            LOG_WARN("Ignoring corrupt probe cache %s", path);
+            goto end;
+        }
+    }
+
+    // Check every stream first, a mismatch leaves the context as it was
+    for (i = 0; i < hdr.nb_streams; i++) {
+        if (!stream_matches(ic->streams[i], &streams[i])) {
+            LOG_WARN("Ignoring stale probe cache %s", path);
+            goto end;
+        }
+    }
+
+    for (i = 0; i < hdr.nb_streams; i++)
+        stream_apply(ic->streams[i], &streams[i], &extradata[i]);
+    if (ic->start_time == AV_NOPTS_VALUE)
+        ic->start_time = hdr.start_time;
+    if (ic->duration == AV_NOPTS_VALUE)
+        ic->duration = hdr.duration;
+    if (!ic->bit_rate)
+        ic->bit_rate = hdr.bit_rate;
+
+    LOG_DEBUG("Loaded stream parameters from %s", path);
+    ret = 0;
+
+end:
+    for (i = 0; extradata && i < hdr.nb_streams; i++)
+        av_free(extradata[i]);
+    av_free(extradata);
+    av_free(streams);
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Write the stream parameters next to a local media file
+ * @param ic format context after avformat_find_stream_info
+ * @param url media file path
+ * @param nb_opened_streams streams known after avformat_open_input. Files
+ *        whose streams only turn up while probing are not cached, a cache
+ *        would never match them when loaded.
+ */
+int probe_cache_save(AVFormatContext *ic, const char *url, int nb_opened_streams) {
+    char path[1024];
+    ProbeCacheHeader hdr;
+    ProbeCacheStream c;
+    AVCodecParameters *par;
+    AVStream *st;
+    FILE *f;
+    int i, ret = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (cache_key(url, &hdr.file_size, &hdr.file_mtime) < 0)
+        return -1;
+
+    av_strlcpy(path, url, sizeof(path));
+    av_strlcat(path, PROBE_CACHE_SUFFIX, sizeof(path));
+
+    // Drop what an older version may have left, so it is not warned about
+    // on every open
+    if (!ic->nb_streams || nb_opened_streams != ic->nb_streams) {
+        remove(path);
+        return 0;
+    }
+
+    hdr.magic = PROBE_CACHE_MAGIC;
+    hdr.version = PROBE_CACHE_VERSION;
+    av_strlcpy(hdr.format, ic->iformat->name, sizeof(hdr.format));
+    hdr.start_time = ic->start_time;
+    hdr.duration = ic->duration;
+    hdr.bit_rate = ic->bit_rate;
+    hdr.nb_streams = ic->nb_streams;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        LOG_WARN("Could not write probe cache %s", path);
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        ret = -1;
+
+    for (i = 0; i < ic->nb_streams && ret == 0; i++) {
+        st = ic->streams[i];
+        par = st->codecpar;
+
+        memset(&c, 0, sizeof(c));
+        c.codec_type = par->codec_type;
+        c.codec_id = par->codec_id;
+        c.format = par->format;
+        c.width = par->width;
+        c.height = par->height;
+        c.sar_num = par->sample_aspect_ratio.num;
+        c.sar_den = par->sample_aspect_ratio.den;
+        c.sample_rate = par->sample_rate;
+        c.channels = par->channels;
+        c.channel_layout = par->channel_layout;
+        c.tb_num = st->time_base.num;
+        c.tb_den = st->time_base.den;
+        c.avg_rate_num = st->avg_frame_rate.num;
+        c.avg_rate_den = st->avg_frame_rate.den;
+        c.r_rate_num = st->r_frame_rate.num;
+        c.r_rate_den = st->r_frame_rate.den;
+        c.start_time = st->start_time;
+        c.duration = st->duration;
+        c.profile = par->profile;
+        c.level = par->level;
+        c.video_delay = par->video_delay;
+        c.extradata_size = par->extradata_size;
+
+        if (fwrite(&c, sizeof(c), 1, f) != 1
+                || (c.extradata_size > 0 && fwrite(par->extradata, c.extradata_size, 1, f) != 1))
+            ret = -1;
+    }
+
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret < 0)
+        LOG_WARN("Could not write probe cache %s", path);
+
+    return ret;
+}
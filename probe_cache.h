@@ -0,0 +1,16 @@
+#ifndef PROBE_CACHE_H_
+#define PROBE_CACHE_H_
+
+#include <libavformat/avformat.h>
+
+/*
+ * Stream parameters found by avformat_find_stream_info, saved next to local
+ * files so opening them again can skip probing. The cache is keyed by the
+ * file's size and mtime and only fills in what the demuxer's header left
+ * unset, so a container that describes itself fully is never overridden.
+ */
+
+int probe_cache_load(AVFormatContext *ic, const char *url);
+int probe_cache_save(AVFormatContext *ic, const char *url, int nb_opened_streams);
+
+#endif /* PROBE_CACHE_H_ */
@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "clock.h"
+#include "trace.h"
+#include "sched.h"
+
+// Longest a worker sleeps before looking for work again, in ms
+#define SCHED_IDLE_WAIT_MS 100
+
+
+static void deque_push(SchedDeque *d, SchedTask *task) {
+    SDL_LockMutex(d->mutex);
+    task->next = NULL;
+    task->prev = d->tail;
+    if (d->tail)
+        d->tail->next = task;
+    else
+        d->head = task;
+    d->tail = task;
+    d->size++;
+    SDL_UnlockMutex(d->mutex);
+}
+
+/**
+ * Take the oldest task, for the owner
+ */
+static SchedTask *deque_pop(SchedDeque *d) {
+    SchedTask *task;
+
+    SDL_LockMutex(d->mutex);
+    task = d->head;
+    if (task) {
+        d->head = task->next;
+        if (d->head)
+            d->head->prev = NULL;
+        else
+            d->tail = NULL;
+        d->size--;
+    }
+    SDL_UnlockMutex(d->mutex);
+    return task;
+}
+
+/**
+ * Take the newest task, for a thief
+ */
+static SchedTask *deque_steal(SchedDeque *d) {
+    SchedTask *task;
+
+    // Unlocked peek, a wrong guess only costs a miss or a lock
+    if (!d->size)
+        return NULL;
+
+    SDL_LockMutex(d->mutex);
+    task = d->tail;
+    if (task) {
+        d->tail = task->prev;
+        if (d->tail)
+            d->tail->next = NULL;
+        else
+            d->head = NULL;
+        d->size--;
+    }
+    SDL_UnlockMutex(d->mutex);
+    return task;
+}
+
+/**
+ * Add to the delayed list, keeping it sorted. s->mutex held.
+ */
+static void delayed_insert(Scheduler *s, SchedTask *task) {
+    SchedTask **p = &s->delayed, *prev = NULL;
+
+    while (*p && (*p)->wake_time <= task->wake_time) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    task->prev = prev;
+    task->next = *p;
+    if (*p)
+        (*p)->prev = task;
+    *p = task;
+}
+
+/**
+ * s->mutex held
+ */
+static void delayed_remove(Scheduler *s, SchedTask *task) {
+    if (task->prev)
+        task->prev->next = task->next;
+    else
+        s->delayed = task->next;
+    if (task->next)
+        task->next->prev = task->prev;
+    task->prev = task->next = NULL;
+}
+
+/**
+ * Queue a ready task on a worker and wake one if any is sleeping
+ */
+static void sched_push(Scheduler *s, SchedWorker *w, SchedTask *task) {
+    deque_push(&w->deque, task);
+    SDL_AtomicAdd(&s->nb_ready, 1);
+
+    if (SDL_AtomicGet(&s->nb_sleeping) > 0) {
+        SDL_LockMutex(s->mutex);
+        SDL_CondSignal(s->cond);
+        SDL_UnlockMutex(s->mutex);
+    }
+}
+
+/**
+ * Take the first delayed task if it is due
+ */
+static SchedTask *sched_take_due(Scheduler *s) {
+    SchedTask *task = NULL;
+
+    SDL_LockMutex(s->mutex);
+    if (s->delayed && s->delayed->wake_time <= clock_time()) {
+        task = s->delayed;
+        delayed_remove(s, task);
+        task->ready_time = task->wake_time;
+        SDL_AtomicSet(&task->state, SCHED_TASK_READY);
+    }
+    SDL_UnlockMutex(s->mutex);
+    return task;
+}
+
+/**
+ * Find work for a worker: its own deque first, then due delayed tasks,
+ * then the other workers' deques from a random one on
+ */
+static SchedTask *sched_next(Scheduler *s, SchedWorker *w) {
+    SchedTask *task;
+    int i, victim;
+
+    if ((task = deque_pop(&w->deque))) {
+        SDL_AtomicAdd(&s->nb_ready, -1);
+        return task;
+    }
+
+    if (s->delayed && (task = sched_take_due(s)))
+        return task;
+
+    w->rand = w->rand * 1103515245 + 12345;
+    victim = (w->rand >> 16) % s->nb_workers;
+    for (i = 0; i < s->nb_workers; i++, victim = (victim + 1) % s->nb_workers) {
+        if (victim == w->index)
+            continue;
+        if ((task = deque_steal(&s->workers[victim].deque))) {
+            SDL_AtomicAdd(&s->nb_ready, -1);
+            w->steals++;
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sleep until work is pushed, the first delayed task is due, or quit
+ * @return 1 on quit
+ */
+static int sched_wait(Scheduler *s) {
+    int timeout = SCHED_IDLE_WAIT_MS;
+    int quit;
+
+    SDL_LockMutex(s->mutex);
+    // Counted before checking for work, so a push either is seen here or
+    // sees us sleeping and signals
+    SDL_AtomicAdd(&s->nb_sleeping, 1);
+    if (!s->quit && SDL_AtomicGet(&s->nb_ready) == 0) {
+        if (s->delayed)
+            timeout = FFMIN(timeout, (int)ceil((s->delayed->wake_time - clock_time()) * 1000));
+        if (timeout > 0)
+            SDL_CondWaitTimeout(s->cond, s->mutex, timeout);
+    }
+    SDL_AtomicAdd(&s->nb_sleeping, -1);
+    quit = s->quit;
+    SDL_UnlockMutex(s->mutex);
+
+    return quit;
+}
+
+/**
+ * Put a task that ran back where its return value says. A submit while it
+ * ran left it RUNNING_AGAIN, which makes it ready whatever it returned.
+ * The task is not touched after it is queued: another worker may run and
+ * finish it at once.
+ */
+static void sched_requeue(Scheduler *s, SchedWorker *w, SchedTask *task, int ret) {
+    switch (ret) {
+        case SCHED_AGAIN:
+            break;
+        case SCHED_DELAY:
+            // Under the mutex, a submit racing with the insert waits for it
+            SDL_LockMutex(s->mutex);
+            if (SDL_AtomicCAS(&task->state, SCHED_TASK_RUNNING, SCHED_TASK_DELAYED)) {
+                delayed_insert(s, task);
+                // Sleepers may be waiting for a later wake time
+                if (s->delayed == task)
+                    SDL_CondSignal(s->cond);
+                SDL_UnlockMutex(s->mutex);
+                return;
+            }
+            SDL_UnlockMutex(s->mutex);
+            break;
+        default:
+            if (SDL_AtomicCAS(&task->state, SCHED_TASK_RUNNING, SCHED_TASK_IDLE))
+                return;
+            break;
+    }
+
+    SDL_AtomicSet(&task->state, SCHED_TASK_READY);
+    sched_push(s, w, task);
+}
+
+static int sched_worker(void *arg) {
+    SchedWorker *w = (SchedWorker *)arg;
+    Scheduler *s = w->sched;
+    SchedTask *task;
+    char name[16];
+    int64_t t0, dt;
+    int ret;
+
+    snprintf(name, sizeof(name), "worker %d", w->index);
+    log_thread_name(name);
+    TRACE_THREAD("sched worker");
+
+    for (;;) {
+        task = sched_next(s, w);
+        if (!task) {
+            if (sched_wait(s))
+                break;
+            continue;
+        }
+
+        SDL_AtomicSet(&task->state, SCHED_TASK_RUNNING);
+        task->quantum_us = s->quantum_us * task->priority;
+        if (task->ready_time > 0) {
+            if (task->wakeup)
+                histogram_add(task->wakeup, FFMAX(clock_time() - task->ready_time, 0) * 1000000);
+            task->ready_time = 0;
+        }
+
+        TRACE_BEGIN("task");
+        t0 = av_gettime_relative();
+        ret = task->run(task);
+        dt = av_gettime_relative() - t0;
+        TRACE_END("task");
+
+        w->runs++;
+        w->busy_time += dt;
+
+        // Left RUNNING, so later submits are ignored. The owner frees the
+        // task as soon as it sees stopped.
+        if (ret == SCHED_DONE) {
+            SDL_LockMutex(s->mutex);
+            task->stopped = 1;
+            SDL_CondBroadcast(s->stop_cond);
+            SDL_UnlockMutex(s->mutex);
+            continue;
+        }
+
+        task->runs++;
+        task->run_time += dt;
+        sched_requeue(s, w, task, ret);
+    }
+
+    return 0;
+}
+
+/**
+ * Start the worker threads
+ * @param s pointer to Scheduler
+ * @param nb_workers threads, 0 for one per core
+ * @param quantum_us slice length asked of priority 1 tasks
+ */
+int sched_init(Scheduler *s, int nb_workers, int64_t quantum_us) {
+    SchedWorker *w;
+    int i;
+
+    memset(s, 0, sizeof(Scheduler));
+    s->nb_workers = av_clip(nb_workers > 0 ? nb_workers : SDL_GetCPUCount(), 1, SCHED_MAX_WORKERS);
+    s->quantum_us = quantum_us;
+    s->start_time = clock_time();
+    s->mutex = SDL_CreateMutex();
+    s->cond = SDL_CreateCond();
+    s->stop_cond = SDL_CreateCond();
+    if (!s->mutex || !s->cond || !s->stop_cond) {
+        LOG_ERR("Could not create scheduler mutex: %s", SDL_GetError());
+        return -1;
+    }
+
+    for (i = 0; i < s->nb_workers; i++) {
+        w = &s->workers[i];
+        w->sched = s;
+        w->index = i;
+        w->rand = i + 1;
+        w->deque.mutex = SDL_CreateMutex();
+        if (!w->deque.mutex) {
+            LOG_ERR("Could not create deque mutex: %s", SDL_GetError());
+            return -1;
+        }
+    }
+
+    // Deques all exist before any worker goes stealing
+    for (i = 0; i < s->nb_workers; i++) {
+        w = &s->workers[i];
+        w->tid = SDL_CreateThread(sched_worker, "worker", w);
+        if (!w->tid) {
+            LOG_ERR("Could not create worker thread: %s", SDL_GetError());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the workers. Every task must be finished or idle by now.
+ */
+void sched_destroy(Scheduler *s) {
+    int i;
+
+    if (s->mutex) {
+        SDL_LockMutex(s->mutex);
+        s->quit = 1;
+        SDL_CondBroadcast(s->cond);
+        SDL_UnlockMutex(s->mutex);
+    }
+
+    for (i = 0; i < s->nb_workers; i++) {
+        if (s->workers[i].tid)
+            SDL_WaitThread(s->workers[i].tid, NULL);
+        if (s->workers[i].deque.mutex)
+            SDL_DestroyMutex(s->workers[i].deque.mutex);
+    }
+
+    if (s->cond)
+        SDL_DestroyCond(s->cond);
+    if (s->stop_cond)
+        SDL_DestroyCond(s->stop_cond);
+    if (s->mutex)
+        SDL_DestroyMutex(s->mutex);
+    s->cond = NULL;
+    s->stop_cond = NULL;
+    s->mutex = NULL;
+}
+
+void sched_task_init(SchedTask *task, int (*run)(SchedTask *task), void *opaque, int priority) {
+    memset(task, 0, sizeof(SchedTask));
+    task->run = run;
+    task->opaque = opaque;
+    task->priority = FFMAX(priority, 1);
+    SDL_AtomicSet(&task->state, SCHED_TASK_IDLE);
+}
+
+/**
+ * Make a task run as soon as a worker is free: queue an idle one, pull a
+ * delayed one forward, or have a running one run once more. May be called
+ * from any thread, any number of times.
+ */
+void sched_submit(Scheduler *s, SchedTask *task) {
+    SchedWorker *w;
+
+    for (;;) {
+        switch (SDL_AtomicGet(&task->state)) {
+            case SCHED_TASK_IDLE:
+                if (!SDL_AtomicCAS(&task->state, SCHED_TASK_IDLE, SCHED_TASK_READY))
+                    continue;
+                task->ready_time = clock_time();
+                w = &s->workers[(unsigned int)SDL_AtomicAdd(&s->next_worker, 1) % s->nb_workers];
+                sched_push(s, w, task);
+                return;
+            case SCHED_TASK_DELAYED:
+                SDL_LockMutex(s->mutex);
+                if (!SDL_AtomicCAS(&task->state, SCHED_TASK_DELAYED, SCHED_TASK_READY)) {
+                    SDL_UnlockMutex(s->mutex);
+                    continue;
+                }
+                delayed_remove(s, task);
+                task->ready_time = clock_time();
+                SDL_UnlockMutex(s->mutex);
+                w = &s->workers[(unsigned int)SDL_AtomicAdd(&s->next_worker, 1) % s->nb_workers];
+                sched_push(s, w, task);
+                return;
+            case SCHED_TASK_RUNNING:
+                // The worker queues it again when the run ends; if it just
+                // put it back, go through the new state
+                if (!SDL_AtomicCAS(&task->state, SCHED_TASK_RUNNING, SCHED_TASK_RUNNING_AGAIN))
+                    continue;
+                return;
+            default:
+                // Already queued, or running once more anyway
+                return;
+        }
+    }
+}
+
+/**
+ * Have a task run a last time and wait until it returned SCHED_DONE. Its
+ * run() must do so as soon as it sees task->stop; a task that already
+ * finished returns at once. Not to be called from the task itself.
+ * @param s scheduler running the task
+ * @param task task to stop, may be freed afterwards
+ */
+void sched_task_stop(Scheduler *s, SchedTask *task) {
+    SDL_AtomicSet(&task->stop, 1);
+    sched_submit(s, task);
+
+    SDL_LockMutex(s->mutex);
+    while (!task->stopped)
+        SDL_CondWait(s->stop_cond, s->mutex);
+    SDL_UnlockMutex(s->mutex);
+}
+
+void sched_report(Scheduler *s) {
+    double elapsed = FFMAX(clock_time() - s->start_time, 1e-6);
+    int64_t runs = 0, steals = 0, busy = 0;
+    int i;
+
+    for (i = 0; i < s->nb_workers; i++) {
+        runs += s->workers[i].runs;
+        steals += s->workers[i].steals;
+        busy += s->workers[i].busy_time;
+    }
+
+    log_info("Scheduler: %d workers, %"PRId64" slices, %"PRId64" steals (%.1f%%), busy %.0f%%",
+             s->nb_workers, runs, steals, runs ? steals * 100.0 / runs : 0,
+             busy / 1e6 * 100 / (elapsed * s->nb_workers));
+}
@@ -0,0 +1,115 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#include "histogram.h"
+
+#define SCHED_MAX_WORKERS 64
+
+// What a task's run function wants next
+enum {
+    SCHED_AGAIN,                    // More work ready, queue it again
+    SCHED_DELAY,                    // Run again at task->wake_time
+    SCHED_IDLE,                     // Nothing to do until sched_submit
+    SCHED_DONE                      // Finished, see sched_task_stop
+};
+
+// Where a task is, changed with CAS only
+enum {
+    SCHED_TASK_IDLE,
+    SCHED_TASK_READY,               // In a worker deque
+    SCHED_TASK_RUNNING,
+    SCHED_TASK_RUNNING_AGAIN,       // Submitted while running, run once more
+    SCHED_TASK_DELAYED              // In the delayed list
+};
+
+struct Scheduler;
+
+/*
+ * Unit of work, embedded in whatever it runs for. run() does one bounded
+ * slice of work, about quantum_us long, and says by its return value when
+ * it wants to run again. A task is only ever queued once and runs on one
+ * worker at a time. Once a worker put a task back it no longer touches it.
+ * A task ends by returning SCHED_DONE, after which submits are ignored;
+ * the owner frees it once sched_task_stop returned.
+ */
+typedef struct SchedTask {
+    int             (*run)(struct SchedTask *task);
+    void            *opaque;
+    int             priority;       // Weight, slices are quantum_us * priority long
+    int64_t         quantum_us;     // Set by the scheduler before each run
+    double          wake_time;      // For SCHED_DELAY, clock_time() based
+
+    SDL_atomic_t    state;          // SCHED_TASK_*
+    SDL_atomic_t    stop;           // Set by sched_task_stop, run() returns SCHED_DONE on it
+    int             stopped;        // Returned SCHED_DONE, under the scheduler mutex
+
+    struct SchedTask *prev;         // Deque or delayed list links
+    struct SchedTask *next;
+
+    double          ready_time;     // clock_time() it was woken or due at, 0 if neither
+    Histogram       *wakeup;        // From ready_time until it runs, in us, NULL for none
+
+    int64_t         runs;
+    int64_t         run_time;       // Total us spent in run()
+} SchedTask;
+
+/*
+ * Double-ended queue of ready tasks owned by one worker. The owner takes
+ * from the head and puts back at the tail, so its tasks take turns; idle
+ * workers steal from the tail.
+ */
+typedef struct SchedDeque {
+    SDL_mutex       *mutex;
+    SchedTask       *head;
+    SchedTask       *tail;
+    int             size;
+} SchedDeque;
+
+typedef struct SchedWorker {
+    struct Scheduler *sched;
+    int             index;
+    SDL_Thread      *tid;
+    SchedDeque      deque;
+    unsigned int    rand;           // Victim selection
+
+    int64_t         runs;
+    int64_t         steals;
+    int64_t         busy_time;      // us spent running tasks
+} SchedWorker;
+
+/*
+ * Pool of worker threads, one per core by default, running tasks from
+ * work-stealing deques. Tasks submitted from outside are spread over the
+ * workers round robin; a worker that runs dry steals from the others
+ * before sleeping. Delayed tasks wait in a list sorted by wake time, the
+ * first worker to look after it is due picks one up.
+ */
+typedef struct Scheduler {
+    SchedWorker     workers[SCHED_MAX_WORKERS];
+    int             nb_workers;
+    SDL_atomic_t    next_worker;    // Round robin for outside submissions
+    SDL_atomic_t    nb_ready;       // Tasks in all deques
+    SDL_atomic_t    nb_sleeping;    // Workers waiting on cond
+
+    SDL_mutex       *mutex;         // Delayed list, sleeping workers and stopped tasks
+    SDL_cond        *cond;
+    SDL_cond        *stop_cond;     // A task returned SCHED_DONE
+    SchedTask       *delayed;       // Sorted by wake_time
+    int             quit;
+
+    int64_t         quantum_us;     // Slice length at priority 1
+    double          start_time;
+} Scheduler;
+
+int sched_init(Scheduler *s, int nb_workers, int64_t quantum_us);
+void sched_destroy(Scheduler *s);
+void sched_task_init(SchedTask *task, int (*run)(SchedTask *task), void *opaque, int priority);
+void sched_submit(Scheduler *s, SchedTask *task);
+void sched_task_stop(Scheduler *s, SchedTask *task);
+void sched_report(Scheduler *s);
+
+#endif /* SCHED_H_ */
@@ -0,0 +1,369 @@
+#include <math.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "clock.h"
+#include "splayer.h"
+
+// Packets queued per decoder, the demux task refills at half of them
+#define SPLAYER_QUEUE_PACKETS 64
+#define SPLAYER_QUEUE_LOW_WATER 50
+
+/**
+ * Lets a blocking open or read give up once the instance is being closed
+ */
+static int splayer_interrupt_cb(void *arg) {
+    SPlayer *p = (SPlayer *)arg;
+
+    return SDL_AtomicGet(&p->task.stop);
+}
+
+static int splayer_decode_run(SchedTask *task);
+
+static int splayer_open_decoder(SPlayer *p, enum AVMediaType type, int index) {
+    AVCodecContext *codecContext = decoder_alloc_context(p->demux.ic->streams[index]);
+
+    if (!codecContext)
+        return -1;
+    // The scheduler runs as many instances in parallel as there are cores
+    codecContext->thread_count = 1;
+
+    if (avcodec_open2(codecContext, codecContext->codec, NULL) < 0) {
+        LOG_ERR("Unsupported codec in %s", p->url);
+        avcodec_free_context(&codecContext);
+        return -1;
+    }
+
+    if (decoder_init(&p->dec[type], codecContext, &p->queue[type],
+                     splayer_decode_run, p, p->cfg.priority) < 0) {
+        decoder_destroy(&p->dec[type]);
+        memset(&p->dec[type], 0, sizeof(Decoder));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open the file and its decoders and start them, from the first slice the
+ * demux task runs
+ */
+static int splayer_open_input(SPlayer *p) {
+    int stream[AVMEDIA_TYPE_NB];
+    int type;
+
+    if (demux_open(&p->demux, p->url, NULL, splayer_interrupt_cb, p, 0, 0) < 0)
+        return -1;
+    if (demux_probe(&p->demux, p->url, 0) < 0)
+        return -1;
+
+    stream[AVMEDIA_TYPE_VIDEO] = demux_find_stream(p->demux.ic, AVMEDIA_TYPE_VIDEO, NULL, -1);
+    stream[AVMEDIA_TYPE_AUDIO] = p->cfg.audio
+        ? demux_find_stream(p->demux.ic, AVMEDIA_TYPE_AUDIO, NULL, stream[AVMEDIA_TYPE_VIDEO]) : -1;
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        if (stream[type] >= 0 && splayer_open_decoder(p, type, stream[type]) < 0)
+            stream[type] = -1;
+    }
+
+    p->nb_decoders = demux_select(&p->demux, stream[AVMEDIA_TYPE_VIDEO], stream[AVMEDIA_TYPE_AUDIO]);
+    if (!p->nb_decoders) {
+        LOG_ERR("No stream to decode in %s", p->url);
+        return -1;
+    }
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        if (p->dec[type].task.run)
+            decoder_start(&p->dec[type], p->sched, &p->task, NULL);
+
+    return 0;
+}
+
+/**
+ * Go back to the start of the file for --loop style playback. The decoders
+ * are all drained and idle, they flush on the new serial.
+ */
+static int splayer_rewind(SPlayer *p) {
+    AVFormatContext *ic = p->demux.ic;
+    int64_t start = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+    int type;
+
+    if (avformat_seek_file(ic, -1, INT64_MIN, start, INT64_MAX, 0) < 0) {
+        LOG_ERR("Could not rewind %s", p->url);
+        return -1;
+    }
+    demux_seeked(&p->demux);
+
+    SDL_LockMutex(p->mutex);
+    p->base_pts = NAN;
+    SDL_UnlockMutex(p->mutex);
+
+    SDL_AtomicSet(&p->drained, 0);
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        if (p->dec[type].task.run)
+            packet_queue_next_serial(&p->queue[type]);
+
+    return 0;
+}
+
+/**
+ * One slice of the demux task: opens the instance on its first run, then
+ * reads packets until the queues are full. At the end of the file it waits
+ * for the decoders to drain, the last one submits it, then starts over or
+ * ends.
+ */
+static int splayer_demux_run(SchedTask *task) {
+    SPlayer *p = (SPlayer *)task->opaque;
+    int64_t deadline;
+    int status, ret;
+
+    if (SDL_AtomicGet(&task->stop))
+        return SCHED_DONE;
+
+    status = SDL_AtomicGet(&p->status);
+    if (status == SPLAYER_ENDED || status == SPLAYER_FAILED)
+        return SCHED_IDLE;
+
+    if (status == SPLAYER_OPENING) {
+        if (splayer_open_input(p) < 0) {
+            SDL_AtomicSet(&p->status, SPLAYER_FAILED);
+            return SCHED_IDLE;
+        }
+        SDL_AtomicSet(&p->status, SPLAYER_PLAYING);
+        // Opening took a slice already
+        return SCHED_AGAIN;
+    }
+
+    deadline = av_gettime_relative() + task->quantum_us;
+    do {
+        if (demux_readahead_wait(&p->demux))
+            return SCHED_IDLE;
+
+        ret = demux_step(&p->demux);
+        switch (ret) {
+            case DEMUX_PACKET:
+                break;
+            case DEMUX_FULL:
+                // The decoder submits us as it takes a packet
+                return SCHED_IDLE;
+            case DEMUX_RETRY:
+                task->wake_time = clock_time() + 0.01;
+                return SCHED_DELAY;
+            case DEMUX_EOF:
+                if (SDL_AtomicGet(&p->drained) < p->nb_decoders)
+                    return SCHED_IDLE;
+                if (!p->cfg.loop || splayer_rewind(p) < 0) {
+                    SDL_AtomicSet(&p->status, SPLAYER_ENDED);
+                    return SCHED_IDLE;
+                }
+                break;
+            default:
+                LOG_ERR("Read error in %s: %s", p->url, av_err2str(ret));
+                SDL_AtomicSet(&p->status, SPLAYER_FAILED);
+                return SCHED_IDLE;
+        }
+    } while (av_gettime_relative() < deadline);
+
+    return SCHED_AGAIN;
+}
+
+/**
+ * Wall time a frame is due at in realtime mode, the first frame sets the
+ * base all decoders pace against
+ * @return the due time, 0 for now
+ */
+static double splayer_due(SPlayer *p, enum AVMediaType type, const AVFrame *frame) {
+    AVStream *st = p->demux.ic->streams[p->demux.stream[type]];
+    double pts, due;
+
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return 0;
+
+    pts = frame->best_effort_timestamp * av_q2d(st->time_base);
+    SDL_LockMutex(p->mutex);
+    if (isnan(p->base_pts)) {
+        p->base_pts = pts;
+        p->base_time = clock_time();
+    }
+    due = p->base_time + pts - p->base_pts;
+    SDL_UnlockMutex(p->mutex);
+
+    return due;
+}
+
+/**
+ * One slice of a decoder task: decodes frames and hands them out until its
+ * queue runs dry, the next frame is not due yet, or the slice is used up
+ */
+static int splayer_decode_run(SchedTask *task) {
+    SPlayer *p = (SPlayer *)task->opaque;
+    enum AVMediaType type = AVMEDIA_TYPE_VIDEO;
+    Decoder *d;
+    int64_t deadline;
+    double due;
+    int ret;
+
+    while (&p->dec[type].task != task)
+        type = type == AVMEDIA_TYPE_VIDEO ? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_VIDEO;
+    d = &p->dec[type];
+
+    if (SDL_AtomicGet(&task->stop))
+        return SCHED_DONE;
+    if (SDL_AtomicGet(&p->paused))
+        return SCHED_IDLE;
+
+    deadline = av_gettime_relative() + task->quantum_us;
+    do {
+        if (!d->frame_held) {
+            ret = decoder_decode_frame(d, d->frame);
+            if (ret < 0)
+                return SCHED_IDLE;
+            if (ret == 0) {
+                // The last one drained has the demux task start over or end
+                if (SDL_AtomicAdd(&p->drained, 1) + 1 == p->nb_decoders)
+                    sched_submit(p->sched, &p->task);
+                return SCHED_IDLE;
+            }
+
+            // Decoded before the last rewind
+            if (d->pkt_serial != SDL_AtomicGet(&d->queue->serial)) {
+                av_frame_unref(d->frame);
+                continue;
+            }
+            SDL_AtomicAdd(&p->frames[type], 1);
+            d->frame_held = 1;
+        }
+
+        if (p->cfg.realtime) {
+            due = splayer_due(p, type, d->frame);
+            if (due > clock_time()) {
+                task->wake_time = due;
+                return SCHED_DELAY;
+            }
+        }
+
+        if (p->cfg.on_frame)
+            p->cfg.on_frame(p->cfg.opaque, d->frame, type);
+        av_frame_unref(d->frame);
+        d->frame_held = 0;
+    } while (av_gettime_relative() < deadline);
+
+    return SCHED_AGAIN;
+}
+
+/**
+ * Have all tasks of an instance look at its state again
+ */
+static void splayer_submit(SPlayer *p) {
+    int type;
+
+    sched_submit(p->sched, &p->task);
+    // The decoders run from when the demux task opened them
+    if (SDL_AtomicGet(&p->status) == SPLAYER_OPENING)
+        return;
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+        if (p->dec[type].task.run)
+            sched_submit(p->sched, &p->dec[type].task);
+}
+
+/**
+ * Create an instance and start opening the file on the scheduler. It plays
+ * as soon as it is open, splayer_pause first to have it wait.
+ * @param s scheduler running the instance
+ * @param url file to play
+ * @param cfg settings, copied
+ * @return the instance, NULL on error
+ */
+SPlayer *splayer_open(Scheduler *s, const char *url, const SPlayerConfig *cfg) {
+    SPlayer *p;
+    int type;
+
+    p = av_mallocz(sizeof(SPlayer));
+    if (!p) {
+        LOG_ERR("Could not allocate memory for player");
+        return NULL;
+    }
+
+    p->sched = s;
+    p->cfg = *cfg;
+    p->url = av_strdup(url);
+    p->mutex = SDL_CreateMutex();
+    p->base_pts = NAN;
+    if (!p->url || !p->mutex || demux_init(&p->demux) < 0) {
+        LOG_ERR("Could not allocate memory for player");
+        splayer_close(&p);
+        return NULL;
+    }
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        if (packet_queue_init(&p->queue[type], SPLAYER_QUEUE_PACKETS, 0) < 0) {
+            splayer_close(&p);
+            return NULL;
+        }
+        packet_queue_set_readahead(&p->queue[type], 0, 0, SPLAYER_QUEUE_LOW_WATER);
+        p->demux.queue[type] = &p->queue[type];
+    }
+
+    SDL_AtomicSet(&p->status, SPLAYER_OPENING);
+    sched_task_init(&p->task, splayer_demux_run, p, cfg->priority);
+    sched_submit(s, &p->task);
+
+    return p;
+}
+
+void splayer_play(SPlayer *p) {
+    SDL_LockMutex(p->mutex);
+    // Frames keep their spacing across the pause
+    if (p->pause_time && !isnan(p->base_pts))
+        p->base_time += clock_time() - p->pause_time;
+    p->pause_time = 0;
+    SDL_AtomicSet(&p->paused, 0);
+    SDL_UnlockMutex(p->mutex);
+
+    splayer_submit(p);
+}
+
+void splayer_pause(SPlayer *p) {
+    SDL_LockMutex(p->mutex);
+    if (!SDL_AtomicGet(&p->paused))
+        p->pause_time = clock_time();
+    SDL_AtomicSet(&p->paused, 1);
+    SDL_UnlockMutex(p->mutex);
+
+    // Have a decoder waiting for its next frame notice now
+    splayer_submit(p);
+}
+
+/**
+ * Stop an instance and free it, waiting for the slices its tasks are running
+ */
+void splayer_close(SPlayer **pp) {
+    SPlayer *p = *pp;
+    int type;
+
+    if (!p)
+        return;
+
+    // The demux task goes first, it may be opening the decoders
+    if (p->task.run)
+        sched_task_stop(p->sched, &p->task);
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        decoder_stop(&p->dec[type], p->sched);
+        decoder_destroy(&p->dec[type]);
+        packet_queue_destroy(&p->queue[type]);
+    }
+    demux_close(&p->demux);
+    av_freep(&p->url);
+    if (p->mutex)
+        SDL_DestroyMutex(p->mutex);
+    av_freep(pp);
+}
@@ -0,0 +1,79 @@
+#ifndef SPLAYER_H_
+#define SPLAYER_H_
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <SDL2/SDL.h>
+
+#include "sched.h"
+#include "packet_queue.h"
+#include "demux.h"
+#include "decoder.h"
+
+enum {
+    SPLAYER_OPENING,
+    SPLAYER_PLAYING,
+    SPLAYER_ENDED,                  // Played to the end without loop
+    SPLAYER_FAILED
+};
+
+/**
+ * Called from a scheduler worker with every decoded frame. The frame is
+ * only valid during the call, av_frame_ref it to keep it.
+ */
+typedef void (*SPlayerFrameFn)(void *opaque, const AVFrame *frame, enum AVMediaType type);
+
+typedef struct SPlayerConfig {
+    int             priority;       // Scheduling weight, 1 for normal
+    int             realtime;       // Hand frames out at their pts, not as fast as decoded
+    int             loop;           // Start over at the end
+    int             audio;          // Decode the audio stream as well
+    SPlayerFrameFn  on_frame;       // NULL to decode only
+    void            *opaque;
+} SPlayerConfig;
+
+/*
+ * One playing file without its own threads: the player's demux and decoder
+ * stages, run as tasks on a shared Scheduler, a slice at a time, so many
+ * instances in one process cost no more threads than there are cores. The
+ * demux task fills a small packet queue per decoder and goes idle once
+ * they are full; each decoder task drains its queue and goes idle when it
+ * runs dry. In realtime mode a decoder task sleeps in the scheduler's
+ * delayed list until its next frame is due. Decoders run single-threaded,
+ * the pool provides the parallelism.
+ *
+ * For many headless streams: no seeking, stream selection options, audio
+ * output, A/V sync or playlists, which the player in main.c adds on top of
+ * the same stages.
+ */
+typedef struct SPlayer {
+    Scheduler       *sched;
+    SchedTask       task;           // Opens the file, then demuxes
+    SPlayerConfig   cfg;
+    char            *url;
+
+    Demuxer         demux;
+    PacketQueue     queue[AVMEDIA_TYPE_NB];
+    Decoder         dec[AVMEDIA_TYPE_NB]; // Audio and video, task.run unset if not decoded
+    int             nb_decoders;    // Started, set before status leaves SPLAYER_OPENING
+    SDL_atomic_t    drained;        // Decoders that returned all frames up to the end
+
+    // Realtime pacing, shared by the decoder tasks
+    SDL_mutex       *mutex;
+    double          base_time;      // Wall time base_pts is due at
+    double          base_pts;       // NAN until the first frame
+    double          pause_time;     // Wall time paused at, 0 when playing
+
+    SDL_atomic_t    status;         // SPLAYER_*
+    SDL_atomic_t    paused;
+
+    SDL_atomic_t    frames[AVMEDIA_TYPE_NB]; // Decoded so far
+} SPlayer;
+
+SPlayer *splayer_open(Scheduler *s, const char *url, const SPlayerConfig *cfg);
+void splayer_play(SPlayer *p);
+void splayer_pause(SPlayer *p);
+void splayer_close(SPlayer **p);
+
+#endif /* SPLAYER_H_ */
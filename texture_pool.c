@@ -0,0 +1,107 @@
+#include <libavutil/frame.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "texture_pool.h"
+
+
+/**
+ * Prepare an empty TexturePool, textures are created on first use
+ * @param pool pointer to TexturePool
+ * @param renderer renderer the textures belong to
+ */
+void texture_pool_init(TexturePool *pool, SDL_Renderer *renderer) {
+    memset(pool, 0, sizeof(TexturePool));
+    pool->renderer = renderer;
+}
+
+/**
+ * Get the texture for a queue slot, matching the requested format and size.
+ * The texture is only recreated when the format or size changed.
+ * @param pool pointer to TexturePool
+ * @param index texture queue slot
+ * @param format SDL pixel format
+ * @param width width in pixels
+ * @param height height in pixels
+ */
+SDL_Texture *texture_pool_get(TexturePool *pool, int index, Uint32 format, int width, int height) {
+    TextureSlot *slot = &pool->slots[index];
+
+    if (slot->texture && slot->format == format
+            && slot->width == width && slot->height == height) {
+        SDL_AtomicAdd(&pool->hits, 1);
+        return slot->texture;
+    }
+
+    if (slot->texture)
+        SDL_DestroyTexture(slot->texture);
+
+    slot->texture = SDL_CreateTexture(pool->renderer,
+                                      format,
+                                      SDL_TEXTUREACCESS_STREAMING,
+                                      width,
+                                      height);
+    if (!slot->texture) {
+        LOG_ERR("SDL_CreateTexture: %s", SDL_GetError());
+        return NULL;
+    }
+    slot->format = format;
+    slot->width = width;
+    slot->height = height;
+
+    SDL_AtomicAdd(&pool->reallocs, 1);
+    LOG_DEBUG("Texture slot %d (re)allocated: %dx%d", index, width, height);
+
+    return slot->texture;
+}
+
+/**
+ * Move the textures of another pool into the slots that have none, so the
+ * next playlist item does not have to create them again
+ * @param pool pointer to TexturePool receiving the textures
+ * @param from pointer to TexturePool giving them up
+ */
+void texture_pool_take(TexturePool *pool, TexturePool *from) {
+    int i;
+
+    for (i = 0; i < TEXTURE_QUEUE_SIZE; i++) {
+        if (pool->slots[i].texture || !from->slots[i].texture)
+            continue;
+        pool->slots[i].texture = from->slots[i].texture;
+        pool->slots[i].format = from->slots[i].format;
+        pool->slots[i].width = from->slots[i].width;
+        pool->slots[i].height = from->slots[i].height;
+        from->slots[i].texture = NULL;
+    }
+}
+
+/**
+ * Destroy the textures only, on the renderer's thread, leaving the frames
+ * to texture_pool_destroy from wherever the pool is closed
+ * @param pool pointer to TexturePool
+ */
+void texture_pool_release_textures(TexturePool *pool) {
+    int i;
+
+    for (i = 0; i < TEXTURE_QUEUE_SIZE; i++) {
+        if (pool->slots[i].texture)
+            SDL_DestroyTexture(pool->slots[i].texture);
+        pool->slots[i].texture = NULL;
+    }
+}
+
+/**
+ * Destroy all textures in the pool and release the frames still queued
+ * @param pool pointer to TexturePool
+ */
+void texture_pool_destroy(TexturePool *pool) {
+    int i;
+
+    for (i = 0; i < TEXTURE_QUEUE_SIZE; i++) {
+        if (pool->slots[i].texture)
+            SDL_DestroyTexture(pool->slots[i].texture);
+        pool->slots[i].texture = NULL;
+        av_frame_free(&pool->slots[i].frame);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef TEXTURE_POOL_H_
+#define TEXTURE_POOL_H_
+
+#include <libavutil/frame.h>
+
+#include <SDL2/SDL.h>
+
+#define TEXTURE_QUEUE_SIZE 16
+
+typedef struct TextureSlot {
+    SDL_Texture     *texture;
+    Uint32          format;
+    int             width;
+    int             height;
+
+    double          pts;            // Presentation time of the frame held, in seconds
+    double          duration;       // Expected display duration, in seconds
+    int             serial;         // Packet queue serial the frame was decoded from
+    AVFrame         *frame;         // Decoded frame, uploaded when it is shown
+} TextureSlot;
+
+/*
+ * Fixed set of streaming textures backing the texture queue. Each slot keeps
+ * its texture for as long as the stream resolution and pixel format stay the
+ * same, so steady-state playback never creates or destroys textures. The
+ * decoder hands its frame over by reference; the frame is only copied into
+ * the texture when shown, then released back to the decoder's pool.
+ */
+typedef struct TexturePool {
+    TextureSlot     slots[TEXTURE_QUEUE_SIZE];
+    SDL_Renderer    *renderer;
+
+    SDL_atomic_t    hits;           // Slot reused as is
+    SDL_atomic_t    reallocs;       // Slot (re)created for a new size/format
+} TexturePool;
+
+void texture_pool_init(TexturePool *pool, SDL_Renderer *renderer);
+SDL_Texture *texture_pool_get(TexturePool *pool, int index, Uint32 format, int width, int height);
+void texture_pool_take(TexturePool *pool, TexturePool *from);
+void texture_pool_release_textures(TexturePool *pool);
+void texture_pool_destroy(TexturePool *pool);
+
+#endif /* TEXTURE_POOL_H_ */
@@ -0,0 +1,112 @@
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "logging.h"
+#include "throttle_io.h"
+
+#define THROTTLE_IO_BUFFER_SIZE (32 * 1024)
+
+
+static int throttle_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    ThrottleIO *t = opaque;
+    int64_t now = av_gettime_relative();
+    int64_t due;
+    int ret;
+
+    if (!t->start) {
+        t->start = now;
+        t->next_spike = now + t->spike_interval;
+    }
+
+    // Hold the read until the bytes so far fit in the bandwidth
+    if (t->rate > 0) {
+        due = t->start + t->bytes * 1000000 / t->rate;
+        if (due > now)
+            av_usleep(due - now);
+    }
+
+    if (t->spike > 0 && t->spike_interval > 0 && now >= t->next_spike) {
+        av_usleep(t->spike);
+        t->spikes++;
+        t->next_spike = av_gettime_relative() + t->spike_interval;
+    }
+
+    ret = avio_read(t->src, buf, buf_size);
+    if (ret > 0)
+        t->bytes += ret;
+    else if (ret == 0)
+        ret = AVERROR_EOF;
+
+    return ret;
+}
+
+static int64_t throttle_io_seek(void *opaque, int64_t offset, int whence) {
+    ThrottleIO *t = opaque;
+
+    if ((whence & ~AVSEEK_FORCE) == AVSEEK_SIZE)
+        return avio_size(t->src);
+
+    return avio_seek(t->src, offset, whence & ~AVSEEK_FORCE);
+}
+
+/**
+ * Open url with throttled reads
+ * @param url any url libavformat can open
+ * @param rate bandwidth in bytes per second, 0 for unlimited
+ * @param spike_ms length of the periodic read stalls, 0 for none
+ * @param spike_interval seconds between stalls
+ */
+AVIOContext *throttle_io_open(const char *url, int rate, int spike_ms, double spike_interval) {
+    AVIOContext *pb = NULL;
+    ThrottleIO *t;
+    uint8_t *buffer;
+
+    t = av_mallocz(sizeof(ThrottleIO));
+    buffer = av_malloc(THROTTLE_IO_BUFFER_SIZE);
+    if (!t || !buffer)
+        goto fail;
+
+    if (avio_open2(&t->src, url, AVIO_FLAG_READ, NULL, NULL) < 0) {
+        LOG_ERR("Could not open %s", url);
+        goto fail;
+    }
+
+    t->rate = rate;
+    t->spike = spike_ms * 1000LL;
+    t->spike_interval = spike_interval * 1000000;
+
+    pb = avio_alloc_context(buffer, THROTTLE_IO_BUFFER_SIZE, 0, t,
+                            throttle_io_read, NULL, throttle_io_seek);
+    if (!pb) {
+        avio_closep(&t->src);
+        goto fail;
+    }
+    pb->seekable = t->src->seekable;
+
+    log_info("Throttled input: %.2f MB/s, %d ms stall every %.1f s",
+             rate / 1e6, spike_ms, spike_interval);
+    return pb;
+
+fail:
+    av_free(buffer);
+    av_free(t);
+    return NULL;
+}
+
+/**
+ * Free a context from throttle_io_open and close its source
+ * @param pb pointer to the context, set to NULL
+ */
+void throttle_io_close(AVIOContext **pb) {
+    ThrottleIO *t;
+
+    if (!*pb)
+        return;
+
+    t = (*pb)->opaque;
+    avio_closep(&t->src);
+    av_free(t);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
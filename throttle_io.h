@@ -0,0 +1,28 @@
+#ifndef THROTTLE_IO_H_
+#define THROTTLE_IO_H_
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/*
+ * Test stand-in for slow storage: reads the url through the normal
+ * protocols, but limits the bandwidth and stalls every read at a fixed
+ * interval, like an NFS server or a disk seeking under load.
+ */
+typedef struct ThrottleIO {
+    AVIOContext     *src;
+    int64_t         rate;           // Bytes per second, 0 for unlimited
+    int64_t         spike;          // Length of each stall, in us
+    int64_t         spike_interval; // Time between stalls, in us
+
+    int64_t         start;          // Time of the first read
+    int64_t         bytes;          // Bytes read since start
+    int64_t         next_spike;
+    int64_t         spikes;
+} ThrottleIO;
+
+AVIOContext *throttle_io_open(const char *url, int rate, int spike_ms, double spike_interval);
+void throttle_io_close(AVIOContext **pb);
+
+#endif /* THROTTLE_IO_H_ */
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "clock.h"
+#include "probe_cache.h"
+#include "thumbs.h"
+
+// Packets read after a seek before a point is given up
+#define THUMBS_MAX_PACKETS 1000
+
+
+/**
+ * Open the file, its video stream and a keyframe-only decoder for a worker.
+ * Worker 0 probes; the others reuse its stream parameters through the
+ * probe cache when that is on.
+ */
+static int thumb_open(ThumbWorker *w) {
+    ThumbJob *job = w->job;
+    AVStream *st;
+    AVCodec *codec = NULL;
+    int index, nb_opened_streams;
+
+    if (avformat_open_input(&w->ic, job->url, NULL, NULL) < 0) {
+        LOG_ERR("Could not open the file");
+        return -1;
+    }
+    nb_opened_streams = w->ic->nb_streams;
+    if (!(job->opts->probe_cache && probe_cache_load(w->ic, job->url) == 0)) {
+        if (avformat_find_stream_info(w->ic, NULL) < 0) {
+            LOG_ERR("Could not find stream info: %s", job->url);
+            return -1;
+        }
+        if (job->opts->probe_cache && w == &job->workers[0])
+            probe_cache_save(w->ic, job->url, nb_opened_streams);
+    }
+
+    index = av_find_best_stream(w->ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (index < 0 || !codec) {
+        LOG_ERR("No decodable video stream in %s", job->url);
+        return -1;
+    }
+    if (w == &job->workers[0])
+        job->stream_index = index;
+    st = w->ic->streams[index];
+    for (index = 0; index < w->ic->nb_streams; index++)
+        if (index != job->stream_index)
+            w->ic->streams[index]->discard = AVDISCARD_ALL;
+
+    w->dec = avcodec_alloc_context3(codec);
+    if (!w->dec || avcodec_parameters_to_context(w->dec, st->codecpar) < 0) {
+        LOG_ERR("Could not create codec context from parameters");
+        return -1;
+    }
+    // Every thumbnail is the keyframe the seek lands on, and the workers
+    // already keep the cores busy
+    w->dec->skip_frame = AVDISCARD_NONKEY;
+    w->dec->thread_count = 1;
+    if (avcodec_open2(w->dec, codec, NULL) < 0) {
+        LOG_ERR("Unsupported codec");
+        return -1;
+    }
+
+    w->packet = av_packet_alloc();
+    w->frame = av_frame_alloc();
+    w->rgb = av_frame_alloc();
+    if (!w->packet || !w->frame || !w->rgb) {
+        LOG_ERR("Could not allocate memory for frame");
+        return -1;
+    }
+    w->rgb->format = AV_PIX_FMT_RGB24;
+    w->rgb->width = job->width;
+    w->rgb->height = job->height;
+    if (w != &job->workers[0] && av_frame_get_buffer(w->rgb, 0) < 0) {
+        LOG_ERR("Could not allocate frame buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void thumb_close(ThumbWorker *w) {
+    sws_freeContext(w->sws);
+    w->sws = NULL;
+    avcodec_free_context(&w->dec);
+    avformat_close_input(&w->ic);
+    av_packet_free(&w->packet);
+    av_frame_free(&w->frame);
+    av_frame_free(&w->rgb);
+}
+
+/**
+ * Decode the keyframe at or before a timestamp into w->frame. Once the
+ * keyframe the seek landed on is sent the decoder is drained: decoders
+ * with delayed output would otherwise hold it back until later pictures,
+ * which skip_frame drops, and return a later keyframe.
+ * @param ts AV_TIME_BASE units
+ */
+static int thumb_decode(ThumbWorker *w, int64_t ts) {
+    int stream_index = w->job->stream_index;
+    int packets = 0, draining = 0, ret;
+
+    if (avformat_seek_file(w->ic, -1, INT64_MIN, ts, ts, 0) < 0)
+        return -1;
+    avcodec_flush_buffers(w->dec);
+
+    for (;;) {
+        ret = avcodec_receive_frame(w->dec, w->frame);
+        if (ret >= 0)
+            return 0;
+        if (ret != AVERROR(EAGAIN) || draining || packets >= THUMBS_MAX_PACKETS)
+            return -1;
+
+        // Past the end, let the decoder return what it still has
+        if (av_read_frame(w->ic, w->packet) < 0) {
+            avcodec_send_packet(w->dec, NULL);
+            draining = 1;
+            continue;
+        }
+
+        packets++;
+        w->packets++;
+        if (w->packet->stream_index == stream_index) {
+            avcodec_send_packet(w->dec, w->packet);
+            if (w->packet->flags & AV_PKT_FLAG_KEY) {
+                avcodec_send_packet(w->dec, NULL);
+                draining = 1;
+            }
+        }
+        av_packet_unref(w->packet);
+    }
+}
+
+/**
+ * Scale w->frame into the worker's tile
+ */
+static int thumb_scale(ThumbWorker *w, AVFrame *dst) {
+    const AVFrame *frame = w->frame;
+
+    w->sws = sws_getCachedContext(w->sws, frame->width, frame->height, frame->format,
+                                  dst->width, dst->height, AV_PIX_FMT_RGB24,
+                                  SWS_BICUBIC, NULL, NULL, NULL);
+    if (!w->sws) {
+        LOG_ERR("Could not create scaler for %s", av_get_pix_fmt_name(frame->format));
+        return -1;
+    }
+
+    if (sws_scale(w->sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                  dst->data, dst->linesize) <= 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Write an RGB24 picture as PNG, through libavcodec's encoder, or as PPM
+ */
+static int thumb_write(const char *path, AVFrame *rgb, int png) {
+    AVCodecContext *enc = NULL;
+    AVCodec *codec;
+    AVPacket *pkt = NULL;
+    FILE *f;
+    int y, ret = 0;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        LOG_ERR("Could not write %s", path);
+        return -1;
+    }
+
+    if (!png) {
+        fprintf(f, "P6\n%d %d\n255\n", rgb->width, rgb->height);
+        for (y = 0; y < rgb->height && ret == 0; y++)
+            if (fwrite(rgb->data[0] + y * rgb->linesize[0], 3, rgb->width, f) != rgb->width)
+                ret = -1;
+    } else {
+        ret = -1;
+        codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+        enc = codec ? avcodec_alloc_context3(codec) : NULL;
+        pkt = av_packet_alloc();
+        if (enc && pkt) {
+            enc->width = rgb->width;
+            enc->height = rgb->height;
+            enc->pix_fmt = AV_PIX_FMT_RGB24;
+            enc->time_base = (AVRational){ 1, 25 };
+            if (avcodec_open2(enc, codec, NULL) >= 0 && avcodec_send_frame(enc, rgb) >= 0
+                    && avcodec_receive_packet(enc, pkt) >= 0 && fwrite(pkt->data, pkt->size, 1, f) == 1)
+                ret = 0;
+        }
+        av_packet_free(&pkt);
+        avcodec_free_context(&enc);
+    }
+
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret < 0)
+        LOG_ERR("Could not write %s", path);
+    return ret;
+}
+
+/**
+ * Take points until all are done
+ */
+static int thumb_worker(void *arg) {
+    ThumbWorker *w = (ThumbWorker *)arg;
+    ThumbJob *job = w->job;
+    const char *ext = job->png ? "png" : "ppm";
+    char path[1024];
+    AVFrame tile;
+    int64_t ts;
+    double t0;
+    int i;
+
+    log_thread_name("thumbs");
+    if (w != &job->workers[0] && thumb_open(w) < 0) {
+        thumb_close(w);
+        return -1;
+    }
+
+    while ((i = SDL_AtomicAdd(&job->next, 1)) < job->count) {
+        t0 = clock_time();
+        // Middle of each of count equal parts
+        ts = job->start + av_rescale(job->duration, 2 * i + 1, 2 * job->count);
+
+        if (thumb_decode(w, ts) < 0) {
+            LOG_WARN("No thumbnail at %.2f s", (double)ts / AV_TIME_BASE);
+            SDL_AtomicAdd(&job->failed, 1);
+            continue;
+        }
+
+        if (job->sheet) {
+            // Scale straight into the tile's place on the sheet
+            memset(&tile, 0, sizeof(tile));
+            tile.width = job->width;
+            tile.height = job->height;
+            tile.linesize[0] = job->sheet->linesize[0];
+            tile.data[0] = job->sheet->data[0] + (i / job->columns) * job->height * tile.linesize[0]
+                + (i % job->columns) * job->width * 3;
+            if (thumb_scale(w, &tile) < 0)
+                SDL_AtomicAdd(&job->failed, 1);
+        } else {
+            snprintf(path, sizeof(path), "%s-%03d.%s", job->opts->thumb_output, i + 1, ext);
+            if (thumb_scale(w, w->rgb) < 0 || thumb_write(path, w->rgb, job->png) < 0)
+                SDL_AtomicAdd(&job->failed, 1);
+        }
+        av_frame_unref(w->frame);
+
+        w->thumbs++;
+        w->busy += clock_time() - t0;
+    }
+
+    return 0;
+}
+
+/**
+ * Write thumbnails of opts->url: --thumbnails of them, one file each or
+ * a single --contact-sheet, on --thumb-threads threads
+ */
+int thumbs_run(const PlayerOptions *o) {
+    ThumbJob job;
+    ThumbWorker *w0;
+    AVCodecParameters *par;
+    AVRational sar;
+    char path[1024];
+    double start, elapsed, dar;
+    int64_t packets = 0;
+    int i, rows, ret = 0;
+
+    if (av_strcasecmp(o->thumb_format, "png") != 0 && av_strcasecmp(o->thumb_format, "ppm") != 0) {
+        LOG_ERR("Unknown thumbnail format %s, use png or ppm", o->thumb_format);
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.opts = o;
+    job.url = o->url;
+    job.count = o->thumbnails;
+    job.png = av_strcasecmp(o->thumb_format, "png") == 0;
+    w0 = &job.workers[0];
+    w0->job = &job;
+
+    start = clock_time();
+    if (thumb_open(w0) < 0) {
+        thumb_close(w0);
+        return -1;
+    }
+
+    job.start = w0->ic->start_time != AV_NOPTS_VALUE ? w0->ic->start_time : 0;
+    job.duration = w0->ic->duration;
+    if (job.duration <= 0) {
+        LOG_ERR("Duration of %s unknown, cannot space thumbnails", job.url);
+        thumb_close(w0);
+        return -1;
+    }
+
+    // Tiles keep the display aspect ratio, at an even height for swscale
+    par = w0->ic->streams[job.stream_index]->codecpar;
+    sar = av_guess_sample_aspect_ratio(w0->ic, w0->ic->streams[job.stream_index], NULL);
+    dar = (double)par->width * (sar.num > 0 && sar.den > 0 ? av_q2d(sar) : 1) / par->height;
+    job.width = FFMAX(o->thumb_width, 2) & ~1;
+    job.height = FFMAX((int)lrint(job.width / dar), 2) & ~1;
+
+    w0->rgb->width = job.width;
+    w0->rgb->height = job.height;
+    if (av_frame_get_buffer(w0->rgb, 0) < 0) {
+        LOG_ERR("Could not allocate frame buffer");
+        thumb_close(w0);
+        return -1;
+    }
+
+    if (o->contact_sheet) {
+        job.columns = o->thumb_columns > 0 ? o->thumb_columns : (int)ceil(sqrt(job.count));
+        rows = (job.count + job.columns - 1) / job.columns;
+        job.sheet = av_frame_alloc();
+        if (!job.sheet) {
+            thumb_close(w0);
+            return -1;
+        }
+        job.sheet->format = AV_PIX_FMT_RGB24;
+        job.sheet->width = job.columns * job.width;
+        job.sheet->height = rows * job.height;
+        if (av_frame_get_buffer(job.sheet, 0) < 0) {
+            LOG_ERR("Could not allocate contact sheet");
+            av_frame_free(&job.sheet);
+            thumb_close(w0);
+            return -1;
+        }
+        // Points that fail stay black
+        memset(job.sheet->data[0], 0, job.sheet->linesize[0] * job.sheet->height);
+    }
+
+    job.nb_workers = av_clip(o->thumb_threads != OPTIONS_AUTO ? o->thumb_threads : SDL_GetCPUCount(),
+                             1, FFMIN(job.count, THUMBS_MAX_THREADS));
+    log_info("Thumbnails: %d of %s (%d:%02d:%02d), %dx%d %s, %d threads",
+             job.count, job.url, (int)(job.duration / AV_TIME_BASE / 3600),
+             (int)(job.duration / AV_TIME_BASE / 60 % 60), (int)(job.duration / AV_TIME_BASE % 60),
+             job.width, job.height, job.sheet ? "contact sheet" : "tiles", job.nb_workers);
+
+    for (i = 1; i < job.nb_workers; i++) {
+        job.workers[i].job = &job;
+        job.workers[i].tid = SDL_CreateThread(thumb_worker, "thumbs", &job.workers[i]);
+        if (!job.workers[i].tid)
+            LOG_WARN("Could not create thumbnail thread: %s", SDL_GetError());
+    }
+    thumb_worker(w0);
+    for (i = 1; i < job.nb_workers; i++)
+        if (job.workers[i].tid)
+            SDL_WaitThread(job.workers[i].tid, NULL);
+
+    if (job.sheet) {
+        snprintf(path, sizeof(path), "%s.%s", o->thumb_output, job.png ? "png" : "ppm");
+        ret = thumb_write(path, job.sheet, job.png);
+        av_frame_free(&job.sheet);
+    }
+
+    elapsed = clock_time() - start;
+    for (i = 0; i < job.nb_workers; i++) {
+        packets += job.workers[i].packets;
+        if (job.workers[i].thumbs)
+            LOG_DEBUG("Thumbnail thread %d: %d thumbnails, %.1f ms each", i, job.workers[i].thumbs,
+                      job.workers[i].busy * 1000 / job.workers[i].thumbs);
+        thumb_close(&job.workers[i]);
+    }
+
+    log_info("Thumbnails: %d in %.2f s, %.1f thumbs/s, %.1f packets read per thumbnail%s",
+             job.count - SDL_AtomicGet(&job.failed), elapsed,
+             (job.count - SDL_AtomicGet(&job.failed)) / FFMAX(elapsed, 1e-6),
+             (double)packets / job.count,
+             SDL_AtomicGet(&job.failed) ? ", some failed" : "");
+
+    return ret < 0 || SDL_AtomicGet(&job.failed) == job.count ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+#ifndef THUMBS_H_
+#define THUMBS_H_
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include <SDL2/SDL.h>
+
+#include "options.h"
+
+#define THUMBS_MAX_THREADS 64
+
+struct ThumbJob;
+
+/*
+ * One extraction thread with its own demuxer, decoder and scaler, so seeks
+ * on different threads never wait on each other
+ */
+typedef struct ThumbWorker {
+    struct ThumbJob *job;
+    SDL_Thread      *tid;           // NULL for worker 0, run by the caller
+    AVFormatContext *ic;
+    AVCodecContext  *dec;
+    struct SwsContext *sws;
+    AVPacket        *packet;
+    AVFrame         *frame;
+    AVFrame         *rgb;           // Scaled tile
+
+    int             thumbs;
+    int64_t         packets;        // Read to get the thumbnails
+    double          busy;           // Seconds spent seeking, decoding and scaling
+} ThumbWorker;
+
+/*
+ * Thumbnails at evenly spaced points of a file, decoded from the keyframe
+ * at or before each point. Points go to the workers one at a time from a
+ * shared counter, so a slow seek does not hold up the rest.
+ */
+typedef struct ThumbJob {
+    const PlayerOptions *opts;
+    const char      *url;
+    int             stream_index;
+    int64_t         start;          // First and last timestamp, AV_TIME_BASE
+    int64_t         duration;
+    int             count;
+    int             width;          // Tile size
+    int             height;
+    int             png;            // Else PPM
+
+    // Contact sheet, NULL when writing one file per tile. Workers only
+    // write their own tiles into it.
+    AVFrame         *sheet;
+    int             columns;
+
+    SDL_atomic_t    next;           // Next point to take
+    SDL_atomic_t    failed;
+
+    ThumbWorker     workers[THUMBS_MAX_THREADS];
+    int             nb_workers;
+} ThumbJob;
+
+int thumbs_run(const PlayerOptions *o);
+
+#endif /* THUMBS_H_ */
@@ -0,0 +1,217 @@
+#ifdef ENABLE_TRACE
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+
+#include "logging.h"
+#include "trace.h"
+
+#define TRACE_CHUNK_EVENTS 16384
+// Per thread, about 24 MB, after which events are dropped
+#define TRACE_MAX_CHUNKS 64
+
+typedef struct TraceEvent {
+    const char      *name;          // Must be a string literal
+    int64_t         ts;             // In us
+    char            phase;
+} TraceEvent;
+
+typedef struct TraceChunk {
+    TraceEvent      events[TRACE_CHUNK_EVENTS];
+} TraceChunk;
+
+/*
+ * Events of one thread. Only the owning thread writes; count is published
+ * after each event, so the writer on exit reads only complete ones even if
+ * the thread is still running. When the thread exits, the next thread of
+ * the same name carries on in its buffer, on the same timeline row, so
+ * threads started per playlist item do not add a buffer each.
+ */
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int             tid;
+    const char      *name;
+    SDL_atomic_t    in_use;         // A thread owns it
+    TraceChunk      *chunks[TRACE_MAX_CHUNKS];
+    SDL_atomic_t    count;
+    int             dropped;
+} TraceBuffer;
+
+int trace_enabled;
+
+static const char *trace_filename;
+static int64_t trace_start;
+static void *trace_buffers;         // TraceBuffer list, pushed lock-free
+static SDL_atomic_t trace_next_tid;
+static __thread TraceBuffer *trace_local;
+static SDL_atomic_t trace_tls;      // SDL_TLSID whose destructor releases a thread's buffer
+
+
+/**
+ * Start recording
+ * @param filename where trace_write puts the trace
+ */
+int trace_init(const char *filename) {
+    trace_filename = filename;
+    trace_start = av_gettime_relative();
+    trace_enabled = 1;
+    return 0;
+}
+
+static void trace_buffer_release(void *data) {
+    SDL_AtomicSet(&((TraceBuffer *)data)->in_use, 0);
+}
+
+/**
+ * Have the buffer released when the calling thread exits, for threads made
+ * with SDL_CreateThread
+ */
+static void trace_buffer_attach(TraceBuffer *b) {
+    SDL_TLSID id = SDL_AtomicGet(&trace_tls);
+
+    if (!id) {
+        SDL_AtomicCAS(&trace_tls, 0, SDL_TLSCreate());
+        id = SDL_AtomicGet(&trace_tls);
+    }
+    if (id)
+        SDL_TLSSet(id, b, trace_buffer_release);
+    trace_local = b;
+}
+
+static TraceBuffer *trace_buffer(void) {
+    TraceBuffer *b = trace_local;
+    void *head;
+
+    if (b)
+        return b;
+
+    b = av_mallocz(sizeof(TraceBuffer));
+    if (!b)
+        return NULL;
+    b->tid = SDL_AtomicAdd(&trace_next_tid, 1) + 1;
+    SDL_AtomicSet(&b->in_use, 1);
+
+    do {
+        head = SDL_AtomicGetPtr(&trace_buffers);
+        b->next = head;
+    } while (!SDL_AtomicCASPtr(&trace_buffers, head, b));
+
+    trace_buffer_attach(b);
+    return b;
+}
+
+/**
+ * Name the calling thread in the trace. Called first thing in a thread, it
+ * takes over the buffer of an exited thread of the same name.
+ */
+void trace_thread_name(const char *name) {
+    TraceBuffer *b;
+
+    if (!trace_local) {
+        for (b = SDL_AtomicGetPtr(&trace_buffers); b; b = b->next) {
+            if (b->name && !strcmp(b->name, name) && SDL_AtomicCAS(&b->in_use, 0, 1)) {
+                trace_buffer_attach(b);
+                return;
+            }
+        }
+    }
+
+    b = trace_buffer();
+    if (b)
+        b->name = name;
+}
+
+/**
+ * Record an event for the calling thread
+ * @param name string literal, the same for a begin and its end
+ * @param phase 'B' for begin, 'E' for end
+ */
+void trace_event(const char *name, char phase) {
+    TraceBuffer *b = trace_buffer();
+    TraceEvent *e;
+    int n, chunk;
+
+    if (!b)
+        return;
+
+    n = SDL_AtomicGet(&b->count);
+    chunk = n / TRACE_CHUNK_EVENTS;
+    if (chunk >= TRACE_MAX_CHUNKS) {
+        b->dropped++;
+        return;
+    }
+    if (!b->chunks[chunk]) {
+        b->chunks[chunk] = av_malloc(sizeof(TraceChunk));
+        if (!b->chunks[chunk]) {
+            b->dropped++;
+            return;
+        }
+    }
+
+    e = &b->chunks[chunk]->events[n % TRACE_CHUNK_EVENTS];
+    e->name = name;
+    e->ts = av_gettime_relative() - trace_start;
+    e->phase = phase;
+
+    // Publish the event
+    SDL_AtomicSet(&b->count, n + 1);
+}
+
+/**
+ * Write every thread's events as Chrome trace JSON. Threads may still be
+ * running, only the events published so far are written.
+ */
+int trace_write(void) {
+    TraceBuffer *b;
+    TraceEvent *e;
+    FILE *f;
+    int i, n, first = 1;
+    int64_t total = 0;
+
+    if (!trace_enabled)
+        return 0;
+
+    f = fopen(trace_filename, "w");
+    if (!f) {
+        LOG_ERR("Could not open trace file %s", trace_filename);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (b = SDL_AtomicGetPtr(&trace_buffers); b; b = b->next) {
+        if (b->name) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", b->tid, b->name);
+            first = 0;
+        }
+
+        n = SDL_AtomicGet(&b->count);
+        for (i = 0; i < n; i++) {
+            e = &b->chunks[i / TRACE_CHUNK_EVENTS]->events[i % TRACE_CHUNK_EVENTS];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%"PRId64",\"pid\":1,\"tid\":%d}",
+                    first ? "" : ",\n", e->name, e->phase, e->ts, b->tid);
+            first = 0;
+        }
+        total += n;
+
+        if (b->dropped)
+            LOG_WARN("Trace: %d events dropped on thread %s", b->dropped, b->name ? b->name : "?");
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        LOG_ERR("Could not write trace file %s", trace_filename);
+        return -1;
+    }
+
+    log_info("Trace: %"PRId64" events written to %s", total, trace_filename);
+    return 0;
+}
+
+#endif /* ENABLE_TRACE */
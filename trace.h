@@ -0,0 +1,33 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Timeline of what every thread is doing, written as a Chrome trace
+ * (chrome://tracing, ui.perfetto.dev). Each thread records begin/end events
+ * into its own buffer without locks; the buffers are merged on exit.
+ *
+ * Only built with ENABLE_TRACE (make TRACE=1). Without it the macros
+ * compile to nothing and trace.c is empty.
+ */
+#ifdef ENABLE_TRACE
+
+extern int trace_enabled;
+
+int trace_init(const char *filename);
+void trace_thread_name(const char *name);
+void trace_event(const char *name, char phase);
+int trace_write(void);
+
+#define TRACE_BEGIN(name) do { if (trace_enabled) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name) do { if (trace_enabled) trace_event(name, 'E'); } while (0)
+#define TRACE_THREAD(name) do { if (trace_enabled) trace_thread_name(name); } while (0)
+
+#else
+
+#define TRACE_BEGIN(name) do { } while (0)
+#define TRACE_END(name) do { } while (0)
+#define TRACE_THREAD(name) do { } while (0)
+
+#endif /* ENABLE_TRACE */
+
+#endif /* TRACE_H_ */